@@ -0,0 +1,47 @@
+#ifndef BENCHMARK_COUNTINGDATA
+#define BENCHMARK_COUNTINGDATA
+
+#include <kdtree/Data.h>
+
+
+/*! \brief Passes updates on to other data while counting the leaves visited
+ */
+template< typename P >
+class CountingData : public kd::Data< P >
+{
+public:
+
+  CountingData( kd::Data< P >& data )
+    : m_data( data ), m_leaves( 0 ) {}
+
+  void update( const P& point, typename P::base_type distSq )
+  {
+    m_data.update( point, distSq );
+  }
+
+  void updateBulk( const P* points, const typename P::base_type* distancesSq, unsigned int count )
+  {
+    ++m_leaves;
+    m_data.updateBulk( points, distancesSq, count );
+  }
+
+  bool incomplete() const
+  {
+    return m_data.incomplete();
+  }
+
+  typename P::base_type maxDistanceSq() const
+  {
+    return m_data.maxDistanceSq();
+  }
+
+  //! Number of leaves visited so far
+  unsigned long leaves() const { return m_leaves; }
+
+private:
+
+  kd::Data< P >& m_data;
+  unsigned long m_leaves;
+};
+
+#endif // BENCHMARK_COUNTINGDATA
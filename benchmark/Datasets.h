@@ -0,0 +1,167 @@
+#ifndef BENCHMARK_DATASETS
+#define BENCHMARK_DATASETS
+
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <math.h>
+
+
+/*! \brief Generates uniformly distributed points in the unit cube
+ */
+template< typename P, unsigned int DIM >
+void randomPoints( unsigned int count, std::vector< P >& points )
+{
+  points.reserve( points.size() + count );
+
+  for ( unsigned int i=0; i<count; ++i )
+  {
+    typename P::base_type p[ DIM ];
+    for ( unsigned int d=0; d<DIM; ++d )
+      p[ d ] = drand48();
+    points.push_back( P( p ) );
+  }
+}
+
+/*! \brief Generates points in gaussian clusters of very different sizes
+ *
+ *  Drawing the queries with the same call puts them among the points, as
+ *  real queries tend to be.
+ */
+template< typename P, unsigned int DIM >
+void clusteredPoints( unsigned int count, std::vector< P >& points, unsigned int clusters = 100 )
+{
+  std::vector< double > centres( clusters * DIM );
+  std::vector< double > sizes( clusters );
+
+  for ( unsigned int c=0; c<clusters; ++c )
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+      centres[ c * DIM + d ] = drand48();
+
+    sizes[ c ] = 0.001 * pow( 50.0, drand48() );
+  }
+
+  points.reserve( points.size() + count );
+
+  for ( unsigned int i=0; i<count; ++i )
+  {
+    const unsigned int c = lrand48() % clusters;
+
+    typename P::base_type p[ DIM ];
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      // Box-Muller
+      const double u = 1.0 - drand48();
+      p[ d ] = centres[ c * DIM + d ] + sizes[ c ] * sqrt( -2.0 * log( u ) ) * cos( 2.0 * M_PI * drand48() );
+    }
+
+    points.push_back( P( p ) );
+  }
+}
+
+
+/*! \brief Generates points near a random plane through the unit cube
+ *
+ *  The points have DIM coordinates but only two degrees of freedom.
+ */
+template< typename P, unsigned int DIM >
+void planarPoints( unsigned int count, std::vector< P >& points )
+{
+  // Fixed so that points and queries lie on the same plane
+  srand48( 1 );
+
+  double axes[ 2 ][ DIM ];
+  for ( unsigned int a=0; a<2; ++a )
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+      axes[ a ][ d ] = drand48() - 0.5;
+  }
+
+  srand48( count );
+
+  points.reserve( points.size() + count );
+
+  for ( unsigned int i=0; i<count; ++i )
+  {
+    const double u = drand48();
+    const double v = drand48();
+
+    typename P::base_type p[ DIM ];
+    for ( unsigned int d=0; d<DIM; ++d )
+      p[ d ] = 0.5 + u * axes[ 0 ][ d ] + v * axes[ 1 ][ d ] + 0.0001 * ( drand48() - 0.5 );
+
+    points.push_back( P( p ) );
+  }
+}
+
+
+//! Peak resident set size of the process in megabytes
+inline double peakMemory()
+{
+  rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  return usage.ru_maxrss / 1024.0;
+}
+
+//! Current resident set size of the process in megabytes
+inline double currentMemory()
+{
+  long pages = 0;
+  long resident = 0;
+
+  FILE* file = fopen( "/proc/self/statm", "r" );
+  if ( file )
+  {
+    if ( fscanf( file, "%ld %ld", &pages, &resident ) != 2 )
+      resident = 0;
+    fclose( file );
+  }
+
+  return resident * double( sysconf( _SC_PAGESIZE ) ) / ( 1024.0 * 1024.0 );
+}
+
+
+//! Kinds of points the generators below make
+enum Dataset
+{
+  DATASET_UNIFORM = 0,
+  DATASET_CLUSTERED,
+  DATASET_PLANAR
+};
+
+//! Name of a dataset for printing
+inline const char* datasetName( Dataset data )
+{
+  const char* names[] = { "uniform", "clustered", "planar" };
+  return names[ data ];
+}
+
+/*! \brief Generates points and queries of the same kind
+ *
+ *  The clustered and planar queries are drawn along with the points, so
+ *  they fall among them.
+ */
+template< typename P, unsigned int DIM >
+void datasetPoints( Dataset data, unsigned int pointCount, unsigned int queryCount, std::vector< P >& points, std::vector< P >& queries )
+{
+  if ( data == DATASET_UNIFORM )
+  {
+    randomPoints< P, DIM >( pointCount, points );
+    randomPoints< P, DIM >( queryCount, queries );
+  }
+  else
+  {
+    if ( data == DATASET_CLUSTERED )
+      clusteredPoints< P, DIM >( pointCount + queryCount, points );
+    else
+      planarPoints< P, DIM >( pointCount + queryCount, points );
+
+    queries.assign( points.end() - queryCount, points.end() );
+    points.resize( pointCount );
+  }
+}
+
+#endif // BENCHMARK_DATASETS
@@ -0,0 +1,76 @@
+#ifndef BENCHMARK_LISTNEIGHBOURDATA
+#define BENCHMARK_LISTNEIGHBOURDATA
+
+#include <kdtree/Data.h>
+
+#include <list>
+
+
+/*! \brief The original std::list based group query data, kept for comparison
+ */
+template< typename P >
+class ListNeighbourData : public kd::Data< P >
+{
+public:
+
+  struct PointDistance
+  {
+    PointDistance( const P& p, typename P::base_type d )
+      : distSq( d ), point( p ) {}
+
+    typename P::base_type distSq;
+    P point;
+  };
+
+  typedef std::list< PointDistance > PointDistanceList;
+
+  ListNeighbourData( unsigned int num, typename P::base_type dist )
+    : m_nthDistanceSq( dist ), m_maxNeighbours( num ) { }
+
+  void update( const P& point, typename P::base_type distSq )
+  {
+    if ( distSq < m_nthDistanceSq )
+    {
+      typename PointDistanceList::iterator it = m_points.begin();
+      typename PointDistanceList::iterator end = m_points.end();
+
+      for( ; it != end; ++it )
+      {
+        if ( it->distSq > distSq )
+          break;
+      }
+
+      m_points.insert( it, PointDistance( point, distSq ) );
+
+      if ( m_points.size() > m_maxNeighbours )
+      {
+        m_points.pop_back();
+        m_nthDistanceSq = m_points.back().distSq;
+      }
+    }
+  }
+
+  typename P::base_type maxDistanceSq() const
+  {
+    return m_nthDistanceSq;
+  }
+
+  bool incomplete() const
+  {
+    return m_points.size() < m_maxNeighbours;
+  }
+
+  const PointDistanceList& points() const
+  {
+    return m_points;
+  }
+
+private:
+
+  PointDistanceList m_points;
+  typename P::base_type m_nthDistanceSq;
+
+  unsigned int m_maxNeighbours;
+};
+
+#endif // BENCHMARK_LISTNEIGHBOURDATA
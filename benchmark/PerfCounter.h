@@ -0,0 +1,76 @@
+#ifndef BENCHMARK_PERF_COUNTER
+#define BENCHMARK_PERF_COUNTER
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+/*! \brief Counts hardware cache misses of the calling thread between start and stop
+ *
+ *  Where the kernel does not allow perf events, as in many containers,
+ *  valid() is false and count() is always zero.
+ */
+class PerfCounter
+{
+public:
+
+  PerfCounter()
+  {
+    perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    m_fd = int( syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 ) );
+  }
+
+  ~PerfCounter()
+  {
+    if ( m_fd >= 0 )
+      close( m_fd );
+  }
+
+  bool valid() const { return m_fd >= 0; }
+
+  void start()
+  {
+    if ( m_fd < 0 )
+      return;
+
+    ioctl( m_fd, PERF_EVENT_IOC_RESET, 0 );
+    ioctl( m_fd, PERF_EVENT_IOC_ENABLE, 0 );
+  }
+
+  void stop()
+  {
+    if ( m_fd >= 0 )
+      ioctl( m_fd, PERF_EVENT_IOC_DISABLE, 0 );
+  }
+
+  //! Misses counted between the last start and stop
+  unsigned long long count() const
+  {
+    unsigned long long value = 0;
+
+    if ( m_fd >= 0 && read( m_fd, &value, sizeof( value ) ) != sizeof( value ) )
+      value = 0;
+
+    return value;
+  }
+
+private:
+
+  PerfCounter( const PerfCounter& );
+  PerfCounter& operator=( const PerfCounter& );
+
+  int m_fd;
+};
+
+#endif // BENCHMARK_PERF_COUNTER
@@ -0,0 +1,32 @@
+#ifndef BENCHMARK_POINT
+#define BENCHMARK_POINT
+
+
+/*! \brief Fixed size point used to benchmark trees of any dimension
+ */
+template< typename T, unsigned int DIM >
+class Point
+{
+public:
+
+  typedef T base_type;
+
+  Point( const T coords[ DIM ] ) { for ( unsigned int i=0; i<DIM; ++i ) data[ i ] = coords[ i ]; }
+  Point() { for ( unsigned int i=0; i<DIM; ++i ) data[ i ] = T( 0 ); }
+
+  T& operator[]( int index )
+  {
+    return data[ index ];
+  }
+
+  T operator[]( int index ) const
+  {
+    return data[ index ];
+  }
+
+public:
+
+  T data[ DIM ];
+};
+
+#endif // BENCHMARK_POINT
@@ -0,0 +1,30 @@
+#ifndef BENCHMARK_TIMER
+#define BENCHMARK_TIMER
+
+#include <sys/time.h>
+
+
+/*! \brief Wall clock stopwatch, started on construction
+ */
+class Timer
+{
+public:
+
+  Timer() { reset(); }
+
+  void reset() { gettimeofday( &m_start, 0 ); }
+
+  //! Seconds since construction or the last reset
+  double elapsed() const
+  {
+    timeval now;
+    gettimeofday( &now, 0 );
+    return ( now.tv_sec - m_start.tv_sec ) + ( now.tv_usec - m_start.tv_usec ) * 1e-6;
+  }
+
+private:
+
+  timeval m_start;
+};
+
+#endif // BENCHMARK_TIMER
@@ -0,0 +1,1877 @@
+
+#include <kdtree/TreeFactory.h>
+#include <kdtree/TreeFile.h>
+#include <kdtree/Forest.h>
+#include <kdtree/Join.h>
+#include <kdtree/Statistics.h>
+#include <kdtree/ExternalTreeBuilder.h>
+#include <kdtree/SharedTree.h>
+#include "Point.h"
+#include "Timer.h"
+#include "ListNeighbourData.h"
+#include "CountingData.h"
+#include "Datasets.h"
+#include "PerfCounter.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+
+/*! \brief Times building a tree over random points and querying it
+ */
+template< unsigned int DIM >
+void benchmarkQueries( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  Timer timer;
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+  double buildTime = timer.elapsed();
+
+  kd::Bounds< P, DIM > bounds = boundsFactory.createBounds< P, DIM >( points );
+
+  // Sum the results so the searches can not be optimised away
+  float checksum = 0.0f;
+
+  timer.reset();
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    checksum += tree->nearestNeighbour( queries[ i ], bounds ).maxDistanceSq();
+  }
+  double nearestTime = timer.elapsed();
+
+  timer.reset();
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    checksum += tree->nearestNeighbours( 8, queries[ i ], bounds ).maxDistanceSq();
+  }
+  double nearest8Time = timer.elapsed();
+
+  printf( "%2u %10u %10.3f %12.0f %12.0f   (%g)\n",
+      DIM, pointCount, buildTime,
+      queryCount / nearestTime, queryCount / nearest8Time, checksum );
+}
+
+
+/*! \brief Times building a tree and reports the peak memory of the process
+ *
+ *  Sizes should be benchmarked in increasing order as the peak memory only
+ *  ever grows.
+ */
+template< unsigned int DIM >
+void benchmarkBuild( unsigned int pointCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  Timer timer;
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+  double buildTime = timer.elapsed();
+
+  printf( "%2u %10u %10.3f %10.1f\n", DIM, pointCount, buildTime, peakMemory() );
+}
+
+
+/*! \brief Times building the same tree with increasing numbers of threads
+ */
+template< unsigned int DIM >
+void benchmarkBuildScaling( unsigned int pointCount, unsigned int maxThreads )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  double serialTime = 0.0;
+
+  for ( unsigned int threads=1; threads<=maxThreads; threads*=2 )
+  {
+    treeFactory.setThreads( threads );
+
+    Timer timer;
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+    double buildTime = timer.elapsed();
+
+    if ( threads == 1 )
+      serialTime = buildTime;
+
+    printf( "%2u %10u %8u %10.3f %8.2f\n", DIM, pointCount, threads, buildTime, serialTime / buildTime );
+  }
+}
+
+
+/*! \brief Reports batched query throughput for increasing numbers of threads
+ *
+ *  The first row is the plain loop of single queries for comparison.
+ */
+template< unsigned int DIM >
+void benchmarkBatch( unsigned int pointCount, unsigned int queryCount, unsigned int maxThreads )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  std::vector< P > neighbours( queryCount * 8 );
+  std::vector< float > distancesSq( queryCount * 8 );
+
+  float checksum = 0.0f;
+
+  Timer timer;
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    checksum += tree->nearestNeighbour( queries[ i ], tree->bounds() ).maxDistanceSq();
+  }
+  double nearestTime = timer.elapsed();
+
+  timer.reset();
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    checksum += tree->nearestNeighbours( 8, queries[ i ], tree->bounds() ).maxDistanceSq();
+  }
+  double nearest8Time = timer.elapsed();
+
+  printf( "%2u %10u %8s %12.0f %12.0f\n", DIM, pointCount, "loop", queryCount / nearestTime, queryCount / nearest8Time );
+
+  for ( unsigned int threads=1; threads<=maxThreads; threads*=2 )
+  {
+    kd::ThreadPool pool( threads );
+
+    timer.reset();
+    tree->nearestNeighbour( &queries[ 0 ], queryCount, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    nearestTime = timer.elapsed();
+    checksum += distancesSq[ 0 ];
+
+    timer.reset();
+    tree->nearestNeighbours( 8, &queries[ 0 ], queryCount, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    nearest8Time = timer.elapsed();
+    checksum += distancesSq[ 0 ];
+
+    printf( "%2u %10u %8u %12.0f %12.0f\n", DIM, pointCount, threads, queryCount / nearestTime, queryCount / nearest8Time );
+  }
+
+  printf( "(%g)\n", checksum );
+}
+
+
+/*! \brief Compares the group query data containers across group sizes
+ */
+template< unsigned int DIM >
+void benchmarkNeighbourData( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  const float unbounded = std::numeric_limits< float >::max();
+  const unsigned int sizes[] = { 1, 4, 8, 16, 32, 64, 128, 256 };
+
+  float checksum = 0.0f;
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    const unsigned int num = sizes[ s ];
+
+    Timer timer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      ListNeighbourData< P > data( num, unbounded );
+      tree->search( queries[ i ], data, tree->bounds() );
+      checksum += data.maxDistanceSq();
+    }
+    double listTime = timer.elapsed();
+
+    timer.reset();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< P > data( num, unbounded );
+      tree->search( queries[ i ], data, tree->bounds() );
+      checksum += data.points().back().distSq;
+    }
+    double ownedTime = timer.elapsed();
+
+    std::vector< typename kd::MultiNeighbourData< P >::PointDistance > buffer( num );
+
+    timer.reset();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< P > data( num, unbounded, &buffer[ 0 ] );
+      tree->search( queries[ i ], data, tree->bounds() );
+      checksum += data.points().back().distSq;
+    }
+    double bufferTime = timer.elapsed();
+
+    printf( "%2u %6u %12.0f %12.0f %12.0f\n", DIM, num,
+        queryCount / listTime, queryCount / ownedTime, queryCount / bufferTime );
+  }
+
+  printf( "(%g)\n", checksum );
+}
+
+
+/*! \brief Reports query throughput for each leaf size and distance kernel
+ */
+template< unsigned int DIM >
+void benchmarkSimd( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const unsigned int sizes[] = { 1, 8, 16, 32, 64 };
+
+  float checksum = 0.0f;
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    treeFactory.setBucketSize( sizes[ s ] );
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+    for ( int level=kd::SIMD_SCALAR; level<=kd::detectSimdLevel(); ++level )
+    {
+      tree->setSimdLevel( kd::SimdLevel( level ) );
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbour( queries[ i ], tree->bounds() ).maxDistanceSq();
+      }
+      double nearestTime = timer.elapsed();
+
+      timer.reset();
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbours( 8, queries[ i ], tree->bounds() ).maxDistanceSq();
+      }
+      double nearest8Time = timer.elapsed();
+
+      printf( "%2u %6u %8s %12.0f %12.0f\n", DIM, sizes[ s ], kd::simdLevelName( kd::SimdLevel( level ) ),
+          queryCount / nearestTime, queryCount / nearest8Time );
+    }
+  }
+
+  printf( "(%g)\n", checksum );
+}
+
+
+/*! \brief Reports the time spent per leaf visited, which is dominated by the traversal
+ *
+ *  Uses single point leaves so that the cost of deciding which cells to
+ *  visit outweighs measuring the points in them.
+ */
+template< unsigned int DIM >
+void benchmarkTraversal( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 1 );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  const float unbounded = std::numeric_limits< float >::max();
+  const unsigned int sizes[] = { 1, 8 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    unsigned long leaves = 0;
+    float checksum = 0.0f;
+
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< P > data( sizes[ s ], unbounded );
+      CountingData< P > counter( data );
+      tree->search( queries[ i ], counter, tree->bounds() );
+      leaves += counter.leaves();
+    }
+
+    Timer timer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< P > data( sizes[ s ], unbounded );
+      tree->search( queries[ i ], data, tree->bounds() );
+      checksum += data.maxDistanceSq();
+    }
+    double time = timer.elapsed();
+
+    printf( "%2u %4u %12.1f %12.1f   (%g)\n", DIM, sizes[ s ], double( leaves ) / queryCount,
+        time * 1e9 / leaves, checksum );
+  }
+}
+
+
+/*! \brief Reports radius and box query throughput for increasing numbers of points found
+ *
+ *  The radius and box sizes are picked to hold the given number of points
+ *  on average. The limited count stops at the first point found.
+ */
+template< unsigned int DIM >
+void benchmarkRange( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  std::vector< P > found( pointCount );
+  const unsigned int expected[] = { 10, 100, 1000 };
+
+  for ( unsigned int e=0; e<sizeof( expected ) / sizeof( expected[ 0 ] ); ++e )
+  {
+    // Volume of a unit ball, which the radius is scaled to
+    const double unitBall = pow( M_PI, DIM / 2.0 ) / tgamma( DIM / 2.0 + 1.0 );
+    const double volume = double( expected[ e ] ) / pointCount;
+    const float radius = pow( volume / unitBall, 1.0 / DIM );
+    const float halfWidth = 0.5 * pow( volume, 1.0 / DIM );
+
+    unsigned long total = 0;
+
+    Timer timer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      total += tree->withinRadius( queries[ i ], radius, &found[ 0 ], found.size() );
+    }
+    double radiusTime = timer.elapsed();
+
+    timer.reset();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      total += tree->countWithinRadius( queries[ i ], radius, 1 );
+    }
+    double radiusLimitTime = timer.elapsed();
+
+    timer.reset();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      P min( queries[ i ] );
+      P max( queries[ i ] );
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        min[ d ] -= halfWidth;
+        max[ d ] += halfWidth;
+      }
+
+      total += tree->withinBox( kd::Bounds< P, DIM >( min, max ), &found[ 0 ], found.size() );
+    }
+    double boxTime = timer.elapsed();
+
+    printf( "%2u %8u %12.0f %12.0f %12.0f   (%lu)\n", DIM, expected[ e ],
+        queryCount / radiusTime, queryCount / radiusLimitTime, queryCount / boxTime, total );
+  }
+}
+
+
+/*! \brief Compares the time to first query of building a tree against mapping one from disk
+ *
+ *  The file is mapped twice, the second time its pages are already in the
+ *  page cache as they would be when another process has the tree open.
+ */
+template< unsigned int DIM >
+void benchmarkFile( unsigned int pointCount, const char* path )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  kd::TreeFile treeFile( measurer, boundsFactory );
+
+  Timer timer;
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+  tree->nearestNeighbour( points[ 0 ], tree->bounds() );
+  double buildTime = timer.elapsed();
+
+  timer.reset();
+  treeFile.write( *tree, path );
+  double writeTime = timer.elapsed();
+
+  double mapTime[ 2 ];
+  double verifyTime = 0.0;
+
+  for ( unsigned int i=0; i<2; ++i )
+  {
+    timer.reset();
+    std::unique_ptr< kd::Tree< P, DIM > > mapped( treeFile.map< P, DIM >( path ) );
+    mapped->nearestNeighbour( points[ 0 ], mapped->bounds() );
+    mapTime[ i ] = timer.elapsed();
+  }
+
+  timer.reset();
+  std::unique_ptr< kd::Tree< P, DIM > > verified( treeFile.map< P, DIM >( path, true ) );
+  verifyTime = timer.elapsed();
+
+  unlink( path );
+
+  printf( "%2u %10u %10.2f %10.2f %10.3f %10.3f %10.2f\n", DIM, pointCount,
+      buildTime * 1e3, writeTime * 1e3, mapTime[ 0 ] * 1e3, mapTime[ 1 ] * 1e3, verifyTime * 1e3 );
+}
+
+
+/*! \brief Compares building a tree out of core in a range of memory budgets with building it in memory
+ *
+ *  The points are read from a file at path, and the tree written next to
+ *  it. The in-memory row includes writing the tree to a file.
+ */
+template< unsigned int DIM >
+void benchmarkExternal( unsigned int pointCount, unsigned int queryCount, const char* path )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  FILE* file = fopen( path, "wb" );
+  fwrite( &points[ 0 ], sizeof( P ), points.size(), file );
+  fclose( file );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  kd::TreeFile treeFile( measurer, boundsFactory );
+
+  const std::string treePath = std::string( path ) + ".tree";
+  double treeSize = 0.0;
+
+  Timer timer;
+  {
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+    treeFile.write( *tree, treePath.c_str() );
+    treeSize = tree->memory() / ( 1024.0 * 1024.0 );
+  }
+  const double memoryTime = timer.elapsed();
+
+  // Building in memory holds the whole tree besides the caller's points
+  printf( "%2u %10u %12s %10.1f %10.2f\n", DIM, pointCount, "in memory", treeSize, memoryTime );
+
+  const size_t budgets[] = { 1024, 64, 8 };
+
+  for ( unsigned int b=0; b<sizeof( budgets ) / sizeof( budgets[ 0 ] ); ++b )
+  {
+    kd::ExternalTreeBuilder builder( treeFactory, budgets[ b ] << 20 );
+    kd::FilePointStream< P > stream( path );
+
+    timer.reset();
+    const bool built = builder.build< P, DIM >( stream, treePath.c_str() );
+    const double buildTime = timer.elapsed();
+
+    std::unique_ptr< kd::Tree< P, DIM > > tree( built ? treeFile.map< P, DIM >( treePath.c_str() ) : 0 );
+    float checksum = 0.0f;
+
+    timer.reset();
+    for ( unsigned int i=0; tree.get() && i<queryCount; ++i )
+      checksum += tree->nearestNeighbours( 8, queries[ i ], tree->bounds() ).maxDistanceSq();
+    const double queryTime = timer.elapsed();
+
+    printf( "%2u %10u %12zu %10.1f %10.2f %12.0f   (%g)\n", DIM, pointCount, budgets[ b ],
+        builder.peakMemory() / ( 1024.0 * 1024.0 ), buildTime, queryCount / queryTime, checksum );
+  }
+
+  unlink( treePath.c_str() );
+  unlink( path );
+}
+
+
+/*! \brief Compares the speed and cache misses of queries and index trees by the order of their points
+ *
+ *  Queries are run in the order they were drawn and along each curve. The
+ *  index trees are built over the caller's points as drawn and stored
+ *  along the Hilbert curve, then searched in random order. Misses are per
+ *  query, or per point for builds, and shown as -1 where perf events are
+ *  not allowed.
+ */
+template< unsigned int DIM >
+void benchmarkLocality( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+  typedef kd::IndexTree< P, DIM > IndexTree;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+  typename kd::Tree< P, DIM >::Context context;
+
+  PerfCounter misses;
+  float checksum = 0.0f;
+
+  const char* names[] = { "random", "morton", "hilbert" };
+
+  for ( unsigned int c=0; c<3; ++c )
+  {
+    std::vector< unsigned int > order( queryCount );
+    for ( unsigned int i=0; i<queryCount; ++i )
+      order[ i ] = i;
+
+    if ( c )
+      kd::curveOrder( kd::PointView< P >( &queries[ 0 ], queryCount ), tree->bounds(), c == 1 ? kd::CURVE_MORTON : kd::CURVE_HILBERT, order );
+
+    Timer timer;
+    misses.start();
+    for ( unsigned int i=0; i<queryCount; ++i )
+      checksum += tree->nearestNeighbours( 8, queries[ order[ i ] ], context ).back().distSq;
+    misses.stop();
+    const double time = timer.elapsed();
+
+    printf( "%2u %10u %8s %8s %10s %12.0f %10.1f\n", DIM, pointCount, "queries", names[ c ], "",
+        queryCount / time, misses.valid() ? double( misses.count() ) / queryCount : -1.0 );
+  }
+
+  std::vector< unsigned int > order;
+  kd::curveOrder( kd::PointView< P >( &points[ 0 ], pointCount ), tree->bounds(), kd::CURVE_HILBERT, order );
+
+  std::vector< P > ordered( pointCount );
+  for ( unsigned int i=0; i<pointCount; ++i )
+    ordered[ i ] = points[ order[ i ] ];
+
+  for ( unsigned int c=0; c<2; ++c )
+  {
+    const std::vector< P >& stored = c ? ordered : points;
+
+    Timer timer;
+    misses.start();
+    std::unique_ptr< IndexTree > indexTree( treeFactory.createIndexed< P, DIM >( kd::PointView< P >( &stored[ 0 ], pointCount ) ) );
+    misses.stop();
+    const double buildTime = timer.elapsed();
+    const double buildMisses = misses.valid() ? double( misses.count() ) / pointCount : -1.0;
+
+    // Reading back the points found is where their order shows
+    timer.reset();
+    misses.start();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< typename IndexTree::Item > found = indexTree->nearestNeighbours( 8, queries[ i ], indexTree->bounds() );
+
+      for ( unsigned int j=0; j<found.points().size(); ++j )
+        checksum += stored[ found.points()[ j ].point.index ][ DIM - 1 ];
+    }
+    misses.stop();
+    const double queryTime = timer.elapsed();
+
+    printf( "%2u %10u %8s %8s %10.3f %12.0f %10.1f %10.1f   (%g)\n", DIM, pointCount, "indexed", names[ 2 * c ], buildTime,
+        queryCount / queryTime, misses.valid() ? double( misses.count() ) / queryCount : -1.0, buildMisses, checksum );
+  }
+}
+
+
+/*! \brief Compares a forest against rebuilding a tree after every batch of changes
+ *
+ *  Each round inserts and removes "updates" points between them and then
+ *  answers "queries" nearest neighbour queries.
+ */
+template< unsigned int DIM >
+void benchmarkDynamic( unsigned int pointCount, unsigned int rounds, unsigned int updates, unsigned int queries )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > inserts;
+  randomPoints< P, DIM >( rounds * updates / 2, inserts );
+
+  std::vector< P > targets;
+  randomPoints< P, DIM >( queries, targets );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  // Both sides remove the same points, the oldest ones
+  float total = 0;
+
+  Timer timer;
+  {
+    kd::Forest< P, DIM > forest( treeFactory );
+    forest.insert( points );
+
+    unsigned int removed = 0;
+
+    for ( unsigned int r=0; r<rounds; ++r )
+    {
+      for ( unsigned int u=0; u<updates / 2; ++u )
+      {
+        forest.insert( inserts[ r * ( updates / 2 ) + u ] );
+        forest.remove( points[ removed++ ] );
+      }
+
+      for ( unsigned int q=0; q<queries; ++q )
+        total += forest.nearestNeighbour( targets[ q ] ).maxDistanceSq();
+    }
+  }
+  double forestTime = timer.elapsed();
+
+  timer.reset();
+  {
+    std::vector< P > current( points );
+    std::unique_ptr< kd::Tree< P, DIM > > tree;
+
+    for ( unsigned int r=0; r<rounds; ++r )
+    {
+      current.erase( current.begin(), current.begin() + updates / 2 );
+      current.insert( current.end(), inserts.begin() + r * ( updates / 2 ), inserts.begin() + ( r + 1 ) * ( updates / 2 ) );
+
+      tree.reset( treeFactory.create< P, DIM >( current ) );
+
+      for ( unsigned int q=0; q<queries; ++q )
+        total += tree->nearestNeighbour( targets[ q ], tree->bounds() ).maxDistanceSq();
+    }
+  }
+  double rebuildTime = timer.elapsed();
+
+  printf( "%2u %10u %8u %8u %12.3f %12.3f   (%g)\n", DIM, pointCount, updates, queries, forestTime, rebuildTime, total );
+}
+
+
+/*! \brief Sweeps the error allowed in approximate searches, reporting recall against exact searches
+ *
+ *  Recall is the fraction of the exact k nearest neighbours matched, a
+ *  neighbour counting as matched when it is no further than the exact one.
+ */
+template< unsigned int DIM >
+void benchmarkApproximate( unsigned int pointCount, unsigned int queryCount, unsigned int num )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  std::vector< float > exact( queryCount * num );
+
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    kd::MultiNeighbourData< P > data = tree->nearestNeighbours( num, queries[ i ], tree->bounds() );
+
+    for ( unsigned int j=0; j<num; ++j )
+      exact[ i * num + j ] = data.points()[ j ].distSq;
+  }
+
+  const kd::SearchOptions sweep[] = {
+    kd::SearchOptions( 0.0 ),
+    kd::SearchOptions( 0.1 ),
+    kd::SearchOptions( 0.25 ),
+    kd::SearchOptions( 0.5 ),
+    kd::SearchOptions( 1.0 ),
+    kd::SearchOptions( 2.0 ),
+    kd::SearchOptions( 0.0, 64 ),
+    kd::SearchOptions( 0.0, 16 ),
+    kd::SearchOptions( 0.0, 4 ),
+    kd::SearchOptions( 0.5, 16 ),
+    kd::SearchOptions( 0.0, 64, kd::TRAVERSAL_BEST_FIRST ),
+    kd::SearchOptions( 0.0, 16, kd::TRAVERSAL_BEST_FIRST ),
+    kd::SearchOptions( 0.0, 4, kd::TRAVERSAL_BEST_FIRST ),
+    kd::SearchOptions( 0.5, 16, kd::TRAVERSAL_BEST_FIRST ),
+  };
+
+  for ( unsigned int s=0; s<sizeof( sweep ) / sizeof( sweep[ 0 ] ); ++s )
+  {
+    kd::SearchStats stats;
+    unsigned int matched = 0;
+
+    Timer timer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      kd::MultiNeighbourData< P > data = tree->nearestNeighbours( num, queries[ i ], tree->bounds(), sweep[ s ], &stats );
+
+      for ( unsigned int j=0; j<data.points().size(); ++j )
+      {
+        if ( data.points()[ j ].distSq <= exact[ i * num + j ] )
+          ++matched;
+      }
+    }
+    double time = timer.elapsed();
+
+    char leaves[ 16 ] = "-";
+    if ( sweep[ s ].maxLeaves != ~0u )
+      sprintf( leaves, "%u", sweep[ s ].maxLeaves );
+
+    printf( "%2u %4u %6s %8.2f %8s %12.0f %8.4f %12.1f %12.1f\n", DIM, num,
+        sweep[ s ].traversal == kd::TRAVERSAL_BEST_FIRST ? "best" : "depth", sweep[ s ].epsilon, leaves,
+        queryCount / time, double( matched ) / ( queryCount * num ),
+        double( stats.nodes ) / queryCount, double( stats.leaves ) / queryCount );
+  }
+}
+
+
+/*! \brief Compares exact depth-first and best-first searches
+ */
+template< unsigned int DIM >
+void benchmarkBestFirst( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  const unsigned int sizes[] = { 1, 16 };
+  const kd::Traversal traversals[] = { kd::TRAVERSAL_DEPTH_FIRST, kd::TRAVERSAL_BEST_FIRST };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    for ( unsigned int t=0; t<2; ++t )
+    {
+      const kd::SearchOptions options( 0.0, ~0u, traversals[ t ] );
+
+      kd::SearchStats stats;
+      float checksum = 0.0f;
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbours( sizes[ s ], queries[ i ], tree->bounds(), options, &stats ).maxDistanceSq();
+      }
+      double time = timer.elapsed();
+
+      printf( "%2u %4u %6s %12.0f %12.1f %12.1f   (%g)\n", DIM, sizes[ s ], t ? "best" : "depth",
+          queryCount / time, double( stats.nodes ) / queryCount, double( stats.leaves ) / queryCount, checksum );
+    }
+  }
+}
+
+
+/*! \brief Compares the cost of queries on trees built with each split rule
+ *
+ *  data is 0 for uniform points, 1 for clustered and 2 for points near a plane.
+ */
+template< unsigned int DIM >
+void benchmarkSplits( unsigned int data, unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  std::vector< P > queries;
+  datasetPoints< P, DIM >( Dataset( data ), pointCount, queryCount, points, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const kd::SplitRule rules[] = { kd::SPLIT_LONGEST_SIDE, kd::SPLIT_MAX_SPREAD, kd::SPLIT_MAX_VARIANCE, kd::SPLIT_SLIDING_MIDPOINT, kd::SPLIT_SAMPLED_COST };
+  const char* names[] = { "longest", "spread", "variance", "sliding", "sampled" };
+
+  for ( unsigned int r=0; r<5; ++r )
+  {
+    treeFactory.setSplitRule( rules[ r ] );
+
+    Timer buildTimer;
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+    const double buildTime = buildTimer.elapsed();
+
+    printf( "%2u %10s %10s %10.3f", DIM, datasetName( Dataset( data ) ), names[ r ], buildTime );
+
+    const unsigned int sizes[] = { 1, 16 };
+    float checksum = 0.0f;
+
+    for ( unsigned int s=0; s<2; ++s )
+    {
+      kd::SearchStats stats;
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbours( sizes[ s ], queries[ i ], tree->bounds(), kd::SearchOptions(), &stats ).maxDistanceSq();
+      }
+      double time = timer.elapsed();
+
+      printf( " %12.0f %10.1f", queryCount / time, double( stats.leaves ) / queryCount );
+    }
+
+    printf( "   (%g)\n", checksum );
+  }
+}
+
+
+/*! \brief A point carrying other data, as kept in a larger store
+ */
+template< unsigned int DIM >
+class Record : public Point< float, DIM >
+{
+public:
+
+  Record() {}
+  Record( const float coords[ DIM ] ) : Point< float, DIM >( coords ) {}
+
+  char payload[ 128 - DIM * sizeof( float ) ];
+};
+
+
+/*! \brief Compares the size and speed of a tree copying wide points with one holding their indices
+ */
+template< unsigned int DIM >
+void benchmarkIndexed( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Record< DIM > R;
+
+  srand48( 0 );
+
+  std::vector< R > records;
+  randomPoints< R, DIM >( pointCount, records );
+
+  std::vector< R > queries;
+  randomPoints< R, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const unsigned int sizes[] = { 1, 16 };
+
+  {
+    const double before = currentMemory();
+    std::unique_ptr< kd::Tree< R, DIM > > tree( treeFactory.create< R, DIM >( records ) );
+    const double size = currentMemory() - before;
+
+    for ( unsigned int s=0; s<2; ++s )
+    {
+      float checksum = 0.0f;
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbours( sizes[ s ], queries[ i ], tree->bounds() ).maxDistanceSq();
+      }
+      double time = timer.elapsed();
+
+      printf( "%2u %4u %8s %10.1f %12.0f   (%g)\n", DIM, sizes[ s ], "copied", size, queryCount / time, checksum );
+    }
+  }
+
+  {
+    const double before = currentMemory();
+    std::unique_ptr< kd::IndexTree< R, DIM > > tree(
+        treeFactory.createIndexed< R, DIM >( kd::PointView< R >( records.data(), records.size() ) ) );
+    const double size = currentMemory() - before;
+
+    for ( unsigned int s=0; s<2; ++s )
+    {
+      float checksum = 0.0f;
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        checksum += tree->nearestNeighbours( sizes[ s ], queries[ i ], tree->bounds() ).maxDistanceSq();
+      }
+      double time = timer.elapsed();
+
+      printf( "%2u %4u %8s %10.1f %12.0f   (%g)\n", DIM, sizes[ s ], "indexed", size, queryCount / time, checksum );
+    }
+  }
+}
+
+
+/*! \brief Compares the memory trees can be kept in for build, destroy and query time and size
+ */
+template< unsigned int DIM >
+void benchmarkAllocation( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const kd::TreeAllocation allocations[] = { kd::ALLOCATE_VECTORS, kd::ALLOCATE_ARENA, kd::ALLOCATE_HUGE_PAGES };
+  const char* names[] = { "vectors", "arena", "huge" };
+
+  for ( unsigned int a=0; a<3; ++a )
+  {
+    treeFactory.setAllocation( allocations[ a ] );
+
+    const double before = currentMemory();
+
+    Timer buildTimer;
+    kd::Tree< P, DIM >* tree = treeFactory.create< P, DIM >( points );
+    const double buildTime = buildTimer.elapsed();
+
+    const double size = currentMemory() - before;
+
+    float checksum = 0.0f;
+
+    Timer queryTimer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      checksum += tree->nearestNeighbour( queries[ i ], tree->bounds() ).maxDistanceSq();
+    }
+    const double queryTime = queryTimer.elapsed();
+
+    Timer destroyTimer;
+    delete tree;
+    const double destroyTime = destroyTimer.elapsed();
+
+    printf( "%2u %10u %8s %10.3f %12.6f %10.1f %12.0f   (%g)\n", DIM, pointCount, names[ a ],
+        buildTime, destroyTime, size, queryCount / queryTime, checksum );
+  }
+}
+
+
+/*! \brief Compares searches through the virtual Data interface with ones compiled for the data type
+ */
+template< unsigned int DIM >
+void benchmarkInlined( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  const float unbounded = std::numeric_limits< float >::max();
+  const unsigned int sizes[] = { 1, 16 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    for ( unsigned int inlined=0; inlined<2; ++inlined )
+    {
+      float checksum = 0.0f;
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        if ( sizes[ s ] == 1 )
+        {
+          kd::NeighbourData< P > data( unbounded );
+
+          if ( inlined )
+            tree->search( queries[ i ], data, tree->bounds() );
+          else
+            tree->search( queries[ i ], static_cast< kd::Data< P >& >( data ), tree->bounds() );
+
+          checksum += data.maxDistanceSq();
+        }
+        else
+        {
+          kd::MultiNeighbourData< P > data( sizes[ s ], unbounded );
+
+          if ( inlined )
+            tree->search( queries[ i ], data, tree->bounds() );
+          else
+            tree->search( queries[ i ], static_cast< kd::Data< P >& >( data ), tree->bounds() );
+
+          checksum += data.maxDistanceSq();
+        }
+      }
+      double time = timer.elapsed();
+
+      printf( "%2u %4u %8s %12.0f   (%g)\n", DIM, sizes[ s ], inlined ? "inlined" : "virtual", queryCount / time, checksum );
+    }
+  }
+}
+
+/*! \brief Times k nearest neighbour queries on one tree under metric M
+ */
+template< unsigned int DIM, typename M >
+void benchmarkMetric( const char* name, const std::vector< Point< float, DIM > >& points,
+                      const std::vector< Point< float, DIM > >& queries, const M& metric )
+{
+  typedef Point< float, DIM > P;
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM, M > > tree( treeFactory.create< P, DIM >( points, metric ) );
+
+  const unsigned int sizes[] = { 1, 16 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    kd::SearchStats stats;
+    float checksum = 0.0f;
+
+    Timer timer;
+    for ( unsigned int i=0; i<queries.size(); ++i )
+    {
+      checksum += tree->nearestNeighbours( sizes[ s ], queries[ i ], tree->bounds(), kd::SearchOptions(), &stats ).maxDistanceSq();
+    }
+    double time = timer.elapsed();
+
+    printf( "%2u %4u %10s %12.0f %12.1f   (%g)\n", DIM, sizes[ s ], name,
+        queries.size() / time, double( stats.leaves ) / queries.size(), checksum );
+  }
+}
+
+
+template< unsigned int DIM >
+void benchmarkMetrics( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  float weights[ DIM ];
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    weights[ d ] = float( d + 1 );
+  }
+
+  benchmarkMetric( "euclidean", points, queries, kd::EuclideanMetric< float >() );
+  benchmarkMetric( "manhattan", points, queries, kd::ManhattanMetric< float >() );
+  benchmarkMetric( "chebyshev", points, queries, kd::ChebyshevMetric< float >() );
+  benchmarkMetric( "weighted", points, queries, kd::WeightedEuclideanMetric< float, DIM >( weights ) );
+  benchmarkMetric( "periodic", points, queries, kd::PeriodicMetric< float, DIM >() );
+}
+
+
+/*! \brief Compares a dual-tree join with a batch of separate queries
+ *
+ *  The join also has to build a tree over the queries, which is timed on
+ *  its own. The self join finds the neighbours of every point among the
+ *  others, which the batch does by asking for one neighbour more.
+ */
+template< unsigned int DIM >
+void benchmarkJoin( unsigned int pointCount, unsigned int queryCount, unsigned int threads )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setThreads( threads );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  Timer timer;
+  std::unique_ptr< kd::Tree< P, DIM > > queryTree( treeFactory.create< P, DIM >( queries ) );
+  const double buildTime = timer.elapsed();
+
+  kd::ThreadPool pool( threads );
+
+  const unsigned int sizes[] = { 1, 8 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    const unsigned int num = sizes[ s ];
+
+    std::vector< P > neighbours( size_t( pointCount > queryCount ? pointCount : queryCount ) * ( num + 1 ) );
+    std::vector< float > distancesSq( neighbours.size() );
+    double checksum = 0.0;
+
+    timer.reset();
+    tree->nearestNeighbours( num, &queries[ 0 ], queryCount, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    const double batchTime = timer.elapsed();
+
+    for ( unsigned int i=0; i<queryCount; ++i )
+      checksum += distancesSq[ i * num + num - 1 ];
+
+    timer.reset();
+    kd::nearestNeighbourJoin( *queryTree, *tree, num, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    const double joinTime = timer.elapsed();
+
+    for ( unsigned int i=0; i<queryCount; ++i )
+      checksum -= distancesSq[ i * num + num - 1 ];
+
+    timer.reset();
+    tree->nearestNeighbours( num + 1, &points[ 0 ], pointCount, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    const double selfBatchTime = timer.elapsed();
+
+    for ( unsigned int i=0; i<pointCount; ++i )
+      checksum += distancesSq[ i * ( num + 1 ) + num ];
+
+    timer.reset();
+    kd::allNearestNeighbours( *tree, num, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+    const double selfJoinTime = timer.elapsed();
+
+    for ( unsigned int i=0; i<pointCount; ++i )
+      checksum -= distancesSq[ i * num + num - 1 ];
+
+    printf( "%2u %4u %8u %10.2f %10.2f %10.2f %12.2f %12.2f   (%g)\n", DIM, num, threads,
+        batchTime, buildTime, joinTime, selfBatchTime, selfJoinTime, checksum );
+  }
+}
+
+
+/*! \brief Compares single queries through a reused QueryContext with plain ones
+ */
+template< unsigned int DIM >
+void benchmarkContext( unsigned int pointCount, unsigned int queryCount )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  typename kd::Tree< P, DIM >::Context context;
+
+  const unsigned int sizes[] = { 1, 8, 16 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    const unsigned int num = sizes[ s ];
+    float checksum = 0.0f;
+
+    Timer timer;
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      if ( num == 1 )
+        checksum += tree->nearestNeighbour( queries[ i ], tree->bounds() ).maxDistanceSq();
+      else
+        checksum += tree->nearestNeighbours( num, queries[ i ], tree->bounds() ).points().back().distSq;
+    }
+    const double plainTime = timer.elapsed();
+
+    timer.reset();
+    for ( unsigned int i=0; i<queryCount; ++i )
+    {
+      if ( num == 1 )
+        checksum -= tree->nearestNeighbour( queries[ i ], context ).maxDistanceSq();
+      else
+        checksum -= tree->nearestNeighbours( num, queries[ i ], context ).back().distSq;
+    }
+    const double contextTime = timer.elapsed();
+
+    printf( "%2u %10u %4u %12.0f %12.0f   (%g)\n", DIM, pointCount, num, queryCount / plainTime, queryCount / contextTime, checksum );
+  }
+}
+
+
+/*! \brief Measures what counting and recording queries costs, and prints what they gather
+ */
+template< unsigned int DIM >
+void benchmarkStatistics( unsigned int pointCount, unsigned int queryCount, unsigned int num )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+  typename kd::Tree< P, DIM >::Context context;
+  float checksum = 0.0f;
+
+  Timer timer;
+  for ( unsigned int i=0; i<queryCount; ++i )
+    checksum += tree->nearestNeighbours( num, queries[ i ], context ).back().distSq;
+  const double plainTime = timer.elapsed();
+
+  kd::SearchStats stats;
+
+  timer.reset();
+  for ( unsigned int i=0; i<queryCount; ++i )
+    checksum -= tree->nearestNeighbours( num, queries[ i ], context, kd::SearchOptions(), &stats ).back().distSq;
+  const double countedTime = timer.elapsed();
+
+  kd::QueryStatistics statistics;
+
+  timer.reset();
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    kd::QueryRecorder recorder( statistics );
+    checksum += tree->nearestNeighbours( num, queries[ i ], context, kd::SearchOptions(), recorder.stats() ).back().distSq;
+  }
+  const double recordedTime = timer.elapsed();
+
+  const kd::StatisticsSnapshot snapshot = statistics.snapshot();
+  const kd::TreeShape shape = kd::treeShape( *tree );
+
+  printf( "%2u %10u %12.0f %12.0f %12.0f %8.1f %8.1f %8.1f %8.0f %8.0f   (%g)\n",
+      DIM, pointCount, queryCount / plainTime, queryCount / countedTime, queryCount / recordedTime,
+      double( snapshot.nodes ) / snapshot.queries, double( snapshot.leaves ) / snapshot.queries,
+      double( snapshot.farCells ) / snapshot.queries, snapshot.percentile( 0.5 ), snapshot.percentile( 0.99 ), checksum );
+
+  printf( "   depth %u-%u (mean %.1f, balance %.2f), occupancy %u-%u (mean %.1f)\n",
+      shape.minDepth, shape.maxDepth, shape.meanDepth, shape.balance,
+      shape.minOccupancy, shape.maxOccupancy, shape.meanOccupancy );
+}
+
+
+/*! \brief Times the queries of several readers while a writer rebuilds and installs the tree
+ *
+ *  Readers search without interruption, then while a SharedTree is
+ *  rebuilt and installed over and over, then taking a mutex around a raw
+ *  tree pointer which the writer swaps and deletes under the same mutex.
+ *  Latencies are in nanoseconds, see QueryStatistics.
+ */
+template< unsigned int DIM >
+void benchmarkSharedTree( unsigned int pointCount, unsigned int readerCount, unsigned int rebuilds )
+{
+  typedef Point< float, DIM > P;
+  typedef kd::Tree< P, DIM > Tree;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( 100000, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  kd::SharedTree< P, DIM > shared( treeFactory.create< P, DIM >( points ) );
+  Tree* locked = treeFactory.create< P, DIM >( points );
+  std::mutex lock;
+
+  // The quiet phase lasts as long as the rebuilds take without readers
+  Timer rebuild;
+  for ( unsigned int r=0; r<rebuilds; ++r )
+    delete treeFactory.create< P, DIM >( points );
+  const double duration = rebuild.elapsed();
+
+  const char* names[] = { "quiet", "shared", "mutex" };
+
+  for ( unsigned int phase=0; phase<3; ++phase )
+  {
+    kd::QueryStatistics statistics;
+    std::atomic< bool > done( false );
+    std::vector< std::thread > readers;
+
+    for ( unsigned int t=0; t<readerCount; ++t )
+    {
+      readers.push_back( std::thread( [ &, t ]()
+      {
+        typename Tree::Context context;
+        kd::SearchStats stats;
+
+        for ( unsigned int i=t; ! done.load( std::memory_order_relaxed ); ++i )
+        {
+          const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+          if ( phase == 2 )
+          {
+            std::lock_guard< std::mutex > guard( lock );
+            locked->nearestNeighbours( 8, queries[ i % queries.size() ], context );
+          }
+          else
+          {
+            shared.snapshot()->nearestNeighbours( 8, queries[ i % queries.size() ], context );
+          }
+
+          statistics.record( stats, std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now() - start ).count() );
+        }
+      } ) );
+    }
+
+    Timer timer;
+
+    if ( phase == 0 )
+    {
+      usleep( (unsigned int)( duration * 1e6 ) );
+    }
+    else
+    {
+      for ( unsigned int r=0; r<rebuilds; ++r )
+      {
+        Tree* tree = treeFactory.create< P, DIM >( points );
+
+        if ( phase == 1 )
+        {
+          shared.install( tree );
+        }
+        else
+        {
+          std::lock_guard< std::mutex > guard( lock );
+          std::swap( tree, locked );
+          delete tree;
+        }
+      }
+    }
+
+    const double elapsed = timer.elapsed();
+
+    done.store( true );
+    for ( unsigned int t=0; t<readers.size(); ++t )
+      readers[ t ].join();
+
+    const kd::StatisticsSnapshot snapshot = statistics.snapshot();
+
+    printf( "%2u %10u %7u %7s %12.0f %10.0f %10.0f %10.0f %10.3f\n", DIM, pointCount, readerCount, names[ phase ],
+        snapshot.queries / elapsed, snapshot.percentile( 0.5 ), snapshot.percentile( 0.99 ), snapshot.percentile( 0.999 ), elapsed / rebuilds );
+  }
+
+  delete locked;
+}
+
+
+/*! \brief Compares trees with exact and quantized leaves for size, speed and recall
+ *
+ *  Recall is the fraction of the true num nearest neighbours found, which
+ *  is below one only for approximate searches.
+ */
+template< unsigned int DIM >
+void benchmarkQuantized( unsigned int pointCount, unsigned int queryCount, unsigned int num )
+{
+  typedef Point< float, DIM > P;
+
+  srand48( 0 );
+
+  std::vector< P > points;
+  randomPoints< P, DIM >( pointCount, points );
+
+  std::vector< P > queries;
+  randomPoints< P, DIM >( queryCount, queries );
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const kd::LeafPrecision precisions[] = { kd::LEAF_EXACT, kd::LEAF_QUANTIZED_16, kd::LEAF_QUANTIZED_8 };
+  const char* names[] = { "exact", "16 bit", "8 bit" };
+  const double epsilons[] = { 0.0, 0.5 };
+
+  // The true neighbour distances, each query's nearest first
+  std::vector< float > truth( size_t( queryCount ) * num );
+
+  for ( unsigned int p=0; p<3; ++p )
+  {
+    treeFactory.setLeafPrecision( precisions[ p ] );
+
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+    const double size = tree->memory() / ( 1024.0 * 1024.0 );
+
+    typename kd::Tree< P, DIM >::Context context( num );
+
+    for ( unsigned int e=0; e<2; ++e )
+    {
+      const kd::SearchOptions options( epsilons[ e ] );
+      std::vector< float > found( truth.size() );
+
+      Timer timer;
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        const typename kd::MultiNeighbourData< P >::PointDistanceList neighbours = tree->nearestNeighbours( num, queries[ i ], context, options );
+
+        for ( unsigned int j=0; j<neighbours.size(); ++j )
+          found[ i * num + j ] = neighbours[ j ].distSq;
+      }
+      const double time = timer.elapsed();
+
+      if ( p == 0 && e == 0 )
+        truth = found;
+
+      // Count the true neighbours, allowing for the rounding of each kernel
+      unsigned int hits = 0;
+
+      for ( unsigned int i=0; i<queryCount; ++i )
+      {
+        const float limit = truth[ i * num + num - 1 ] * 1.00001f;
+
+        for ( unsigned int j=0; j<num; ++j )
+          hits += found[ i * num + j ] <= limit ? 1 : 0;
+      }
+
+      printf( "%2u %10u %8s %6.2f %10.1f %12.0f %8.4f\n", DIM, pointCount, names[ p ], epsilons[ e ],
+          size, queryCount / time, double( hits ) / ( double( queryCount ) * num ) );
+    }
+  }
+}
+
+
+int main( int argc, char** argv )
+{
+  if ( argc > 1 && strcmp( argv[ 1 ], "swap" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int readerCount = argc > 3 ? atoi( argv[ 3 ] ) : 4;
+    unsigned int rebuilds = argc > 4 ? atoi( argv[ 4 ] ) : 10;
+
+    printf( "%2s %10s %7s %7s %12s %10s %10s %10s %10s\n", "D", "points", "readers", "reads", "k=8 q/s", "p50 ns", "p99 ns", "p99.9 ns", "install s" );
+
+    benchmarkSharedTree< 3 >( pointCount, readerCount, rebuilds );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "locality" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 4000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 400000;
+
+    printf( "%2s %10s %8s %8s %10s %12s %10s %10s\n", "D", "points", "what", "order", "build (s)", "k=8 q/s", "misses/q", "misses/p" );
+
+    benchmarkLocality< 3 >( pointCount, queryCount );
+    benchmarkLocality< 8 >( pointCount / 4, queryCount / 20 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "external" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 10000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 100000;
+    const char* path = argc > 4 ? argv[ 4 ] : "kdtree-benchmark.points";
+
+    printf( "%2s %10s %12s %10s %10s %12s\n", "D", "points", "budget (MB)", "peak (MB)", "build (s)", "k=8 q/s" );
+
+    benchmarkExternal< 3 >( pointCount, queryCount, path );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "statistics" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 200000;
+    unsigned int num = argc > 4 ? atoi( argv[ 4 ] ) : 8;
+
+    printf( "%2s %10s %12s %12s %12s %8s %8s %8s %8s %8s\n", "D", "points", "plain q/s", "counted q/s", "recorded q/s",
+        "nodes", "leaves", "far", "p50 ns", "p99 ns" );
+
+    benchmarkStatistics< 3 >( pointCount, queryCount, num );
+    benchmarkStatistics< 8 >( pointCount, queryCount / 10, num );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "quantized" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 4000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 100000;
+    unsigned int num = argc > 4 ? atoi( argv[ 4 ] ) : 10;
+
+    printf( "%2s %10s %8s %6s %10s %12s %8s\n", "D", "points", "leaves", "eps", "size (MB)", "queries/s", "recall" );
+
+    benchmarkQuantized< 3 >( pointCount, queryCount, num );
+    benchmarkQuantized< 16 >( pointCount, queryCount / 10, num );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "context" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 100000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 1000000;
+
+    printf( "%2s %10s %4s %12s %12s\n", "D", "points", "k", "plain q/s", "context q/s" );
+
+    benchmarkContext< 3 >( pointCount, queryCount );
+    benchmarkContext< 8 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "join" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 1000000;
+    unsigned int threads = argc > 4 ? atoi( argv[ 4 ] ) : std::thread::hardware_concurrency();
+
+    printf( "%2s %4s %8s %10s %10s %10s %12s %12s\n", "D", "k", "threads", "batch (s)", "build (s)", "join (s)", "self batch", "self join" );
+
+    benchmarkJoin< 3 >( pointCount, queryCount, threads );
+    benchmarkJoin< 8 >( pointCount, queryCount / 4, threads );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "splits" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %10s %10s %10s %12s %10s %12s %10s\n", "D", "data", "split", "build (s)", "k=1 q/s", "leaves", "k=16 q/s", "leaves" );
+
+    for ( unsigned int data=0; data<3; ++data )
+    {
+      benchmarkSplits< 3 >( data, pointCount, queryCount );
+      benchmarkSplits< 8 >( data, pointCount, queryCount / 4 );
+    }
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "indexed" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 2000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 100000;
+
+    printf( "%2s %4s %8s %10s %12s\n", "D", "k", "tree", "size (MB)", "q/s" );
+
+    benchmarkIndexed< 3 >( pointCount, queryCount );
+    benchmarkIndexed< 8 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "allocation" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 4000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 200000;
+
+    printf( "%2s %10s %8s %10s %12s %10s %12s\n", "D", "points", "memory", "build (s)", "destroy (s)", "RSS (MB)", "q/s" );
+
+    benchmarkAllocation< 3 >( pointCount, queryCount );
+    benchmarkAllocation< 8 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "inlined" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 100000;
+
+    printf( "%2s %4s %8s %12s\n", "D", "k", "data", "q/s" );
+
+    benchmarkInlined< 3 >( pointCount, queryCount );
+    benchmarkInlined< 8 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "metrics" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %4s %10s %12s %12s\n", "D", "k", "metric", "q/s", "leaves/query" );
+
+    benchmarkMetrics< 3 >( pointCount, queryCount );
+    benchmarkMetrics< 8 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "bestfirst" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %4s %6s %12s %12s %12s\n", "D", "k", "order", "q/s", "nodes/query", "leaves/query" );
+
+    benchmarkBestFirst< 3 >( pointCount, queryCount );
+    benchmarkBestFirst< 8 >( pointCount, queryCount );
+    benchmarkBestFirst< 16 >( pointCount, queryCount / 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "approximate" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 2000;
+
+    printf( "%2s %4s %6s %8s %8s %12s %8s %12s %12s\n", "D", "k", "order", "epsilon", "leaves", "q/s", "recall", "nodes/query", "leaves/query" );
+
+    benchmarkApproximate< 8 >( pointCount, queryCount, 10 );
+    benchmarkApproximate< 16 >( pointCount, queryCount, 10 );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "dynamic" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int rounds = argc > 3 ? atoi( argv[ 3 ] ) : 20;
+
+    printf( "%2s %10s %8s %8s %12s %12s\n", "D", "points", "updates", "queries", "forest (s)", "rebuild (s)" );
+
+    const unsigned int updates[] = { 100, 10000 };
+    const unsigned int queries[] = { 100, 10000 };
+
+    for ( unsigned int u=0; u<2; ++u )
+    {
+      for ( unsigned int q=0; q<2; ++q )
+      {
+        benchmarkDynamic< 3 >( pointCount, rounds, updates[ u ], queries[ q ] );
+      }
+    }
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "file" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    const char* path = argc > 3 ? argv[ 3 ] : "kdtree-benchmark.tree";
+
+    printf( "%2s %10s %10s %10s %10s %10s %10s\n", "D", "points", "build (ms)", "write (ms)", "map (ms)", "remap (ms)", "verify (ms)" );
+
+    benchmarkFile< 3 >( pointCount, path );
+    benchmarkFile< 8 >( pointCount, path );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "range" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %8s %12s %12s %12s\n", "D", "expected", "radius (q/s)", "any (q/s)", "box (q/s)" );
+
+    benchmarkRange< 3 >( pointCount, queryCount );
+    benchmarkRange< 8 >( pointCount, queryCount );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "traversal" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %4s %12s %12s\n", "D", "k", "leaves/query", "ns/leaf" );
+
+    benchmarkTraversal< 3 >( pointCount, queryCount );
+    benchmarkTraversal< 8 >( pointCount, queryCount );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "simd" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 100000;
+
+    printf( "%2s %6s %8s %12s %12s\n", "D", "bucket", "kernel", "k=1 (q/s)", "k=8 (q/s)" );
+
+    benchmarkSimd< 3 >( pointCount, queryCount );
+    benchmarkSimd< 8 >( pointCount, queryCount );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "neighbours" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 20000;
+
+    printf( "%2s %6s %12s %12s %12s\n", "D", "k", "list (q/s)", "heap (q/s)", "buffer (q/s)" );
+
+    benchmarkNeighbourData< 3 >( pointCount, queryCount );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "batch" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 1000000;
+    unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 1000000;
+    unsigned int maxThreads = argc > 4 ? atoi( argv[ 4 ] ) : std::thread::hardware_concurrency();
+
+    printf( "%2s %10s %8s %12s %12s\n", "D", "points", "threads", "k=1 (q/s)", "k=8 (q/s)" );
+
+    benchmarkBatch< 3 >( pointCount, queryCount, maxThreads );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "threads" ) == 0 )
+  {
+    unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 10000000;
+    unsigned int maxThreads = argc > 3 ? atoi( argv[ 3 ] ) : std::thread::hardware_concurrency();
+
+    printf( "%2s %10s %8s %10s %8s\n", "D", "points", "threads", "build (s)", "speedup" );
+
+    benchmarkBuildScaling< 3 >( pointCount, maxThreads );
+
+    return 0;
+  }
+
+  if ( argc > 1 && strcmp( argv[ 1 ], "build" ) == 0 )
+  {
+    printf( "%2s %10s %10s %10s\n", "D", "points", "build (s)", "peak (MB)" );
+
+    if ( argc == 2 )
+    {
+      benchmarkBuild< 3 >( 1000000 );
+      benchmarkBuild< 3 >( 10000000 );
+      benchmarkBuild< 3 >( 100000000 );
+    }
+
+    for ( int i=2; i<argc; ++i )
+      benchmarkBuild< 3 >( atoi( argv[ i ] ) );
+
+    return 0;
+  }
+
+  unsigned int pointCount = argc > 1 ? atoi( argv[ 1 ] ) : 1000000;
+  unsigned int queryCount = argc > 2 ? atoi( argv[ 2 ] ) : 100000;
+
+  printf( "%2s %10s %10s %12s %12s\n", "D", "points", "build (s)", "k=1 (q/s)", "k=8 (q/s)" );
+
+  benchmarkQueries< 2 >( pointCount, queryCount );
+  benchmarkQueries< 3 >( pointCount, queryCount );
+  benchmarkQueries< 8 >( pointCount, queryCount );
+
+  return 0;
+}
+
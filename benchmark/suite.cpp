@@ -0,0 +1,256 @@
+#include <kdtree/TreeFactory.h>
+#include "Point.h"
+#include "Timer.h"
+#include "Datasets.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+
+/*! \brief Measurements of one kind of query against one tree
+ *
+ *  Latencies are in microseconds and negative where not measured, as for
+ *  batches whose queries are not timed one at a time.
+ */
+struct Result
+{
+  const char* dataset;
+  unsigned int dim;
+  unsigned int points;
+  unsigned int queries;
+  unsigned int threads;
+
+  //! Seconds to build the tree
+  double build;
+
+  //! Megabytes taken by the tree, see Tree::memory
+  double memory;
+
+  const char* query;
+  unsigned int k;
+
+  //! Queries per second
+  double rate;
+
+  double p50;
+  double p99;
+};
+
+
+/*! \brief Writes results as CSV or JSON, one result per row or object
+ */
+class ResultWriter
+{
+public:
+
+  explicit ResultWriter( bool json )
+    : m_json( json ), m_rows( 0 ) {}
+
+  void begin()
+  {
+    if ( m_json )
+      printf( "[\n" );
+    else
+      printf( "dataset,dim,points,queries,threads,build_s,memory_mb,query,k,queries_per_s,p50_us,p99_us\n" );
+  }
+
+  void write( const Result& r )
+  {
+    if ( m_json )
+    {
+      printf( "%s  { \"dataset\": \"%s\", \"dim\": %u, \"points\": %u, \"queries\": %u, \"threads\": %u, "
+          "\"build_s\": %.6f, \"memory_mb\": %.3f, \"query\": \"%s\", \"k\": %u, \"queries_per_s\": %.1f, ",
+          m_rows ? ",\n" : "", r.dataset, r.dim, r.points, r.queries, r.threads, r.build, r.memory, r.query, r.k, r.rate );
+
+      if ( r.p50 < 0.0 )
+        printf( "\"p50_us\": null, \"p99_us\": null }" );
+      else
+        printf( "\"p50_us\": %.3f, \"p99_us\": %.3f }", r.p50, r.p99 );
+    }
+    else
+    {
+      printf( "%s,%u,%u,%u,%u,%.6f,%.3f,%s,%u,%.1f,", r.dataset, r.dim, r.points, r.queries, r.threads, r.build, r.memory, r.query, r.k, r.rate );
+
+      if ( r.p50 < 0.0 )
+        printf( ",\n" );
+      else
+        printf( "%.3f,%.3f\n", r.p50, r.p99 );
+    }
+
+    ++m_rows;
+    fflush( stdout );
+  }
+
+  void end()
+  {
+    if ( m_json )
+      printf( "\n]\n" );
+  }
+
+private:
+
+  bool m_json;
+  unsigned int m_rows;
+};
+
+
+//! Sum of everything the queries return, printed so that no query is optimised away
+double checksum = 0.0;
+
+/*! \brief Times query over every index, once for the rate and once for the latency of each call
+ */
+template< typename F >
+void measure( unsigned int queryCount, F query, Result& result )
+{
+  Timer timer;
+  for ( unsigned int i=0; i<queryCount; ++i )
+    checksum += query( i );
+  result.rate = queryCount / timer.elapsed();
+
+  std::vector< double > latencies( queryCount );
+
+  for ( unsigned int i=0; i<queryCount; ++i )
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    checksum += query( i );
+    latencies[ i ] = std::chrono::duration< double, std::micro >( std::chrono::steady_clock::now() - start ).count();
+  }
+
+  std::sort( latencies.begin(), latencies.end() );
+  result.p50 = latencies[ queryCount / 2 ];
+  result.p99 = latencies[ std::min( queryCount - 1, queryCount * 99 / 100 ) ];
+}
+
+
+/*! \brief Runs every query kind against trees over each dataset of dimension DIM
+ *
+ *  The radius is the median distance to the k-th neighbour of the first
+ *  queries, so that radius queries find about k points whatever the
+ *  density of the dataset.
+ */
+template< unsigned int DIM >
+void benchmarkDimension( ResultWriter& writer, unsigned int pointCount, unsigned int queryCount, unsigned int maxThreads, unsigned int num )
+{
+  typedef Point< float, DIM > P;
+
+  // High dimensional queries approach brute force, so fewer are run
+  queryCount = std::max( 100u, std::min( queryCount, queryCount * 8 / DIM ) );
+
+  const Dataset datasets[] = { DATASET_UNIFORM, DATASET_CLUSTERED, DATASET_PLANAR };
+
+  for ( unsigned int s=0; s<sizeof( datasets ) / sizeof( datasets[ 0 ] ); ++s )
+  {
+    srand48( 0 );
+
+    std::vector< P > points;
+    std::vector< P > queries;
+    datasetPoints< P, DIM >( datasets[ s ], pointCount, queryCount, points, queries );
+
+    kd::BoundsFactory boundsFactory;
+    kd::Measurer measurer;
+    kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+    Timer buildTimer;
+    std::unique_ptr< kd::Tree< P, DIM > > tree( treeFactory.create< P, DIM >( points ) );
+
+    Result result;
+    result.dataset = datasetName( datasets[ s ] );
+    result.dim = DIM;
+    result.points = pointCount;
+    result.queries = queryCount;
+    result.threads = 1;
+    result.build = buildTimer.elapsed();
+    result.memory = tree->memory() / ( 1024.0 * 1024.0 );
+
+    const kd::Tree< P, DIM >& searched = *tree;
+    typename kd::Tree< P, DIM >::Context context;
+
+    result.query = "nearest";
+    result.k = 1;
+    measure( queryCount, [ & ]( unsigned int i ) { return searched.nearestNeighbour( queries[ i ], context ).maxDistanceSq(); }, result );
+    writer.write( result );
+
+    result.query = "knn";
+    result.k = num;
+    measure( queryCount, [ & ]( unsigned int i ) { return searched.nearestNeighbours( num, queries[ i ], context ).back().distSq; }, result );
+    writer.write( result );
+
+    std::vector< float > radii;
+    for ( unsigned int i=0; i<std::min( queryCount, 100u ); ++i )
+      radii.push_back( sqrt( searched.nearestNeighbours( num, queries[ i ], context ).back().distSq ) );
+
+    std::nth_element( radii.begin(), radii.begin() + radii.size() / 2, radii.end() );
+    const float radius = radii[ radii.size() / 2 ];
+
+    std::vector< P > found( pointCount );
+
+    result.query = "radius";
+    measure( queryCount, [ & ]( unsigned int i ) { return float( searched.withinRadius( queries[ i ], radius, &found[ 0 ], found.size() ) ); }, result );
+    writer.write( result );
+
+    std::vector< P > neighbours( queryCount * num );
+    std::vector< float > distancesSq( queryCount * num );
+
+    result.query = "batch_knn";
+    result.p50 = -1.0;
+    result.p99 = -1.0;
+
+    for ( unsigned int threads=1; threads<=maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2 )
+    {
+      kd::ThreadPool pool( threads );
+
+      Timer timer;
+      tree->nearestNeighbours( num, &queries[ 0 ], queryCount, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+      result.rate = queryCount / timer.elapsed();
+      result.threads = threads;
+      checksum += distancesSq[ 0 ];
+
+      writer.write( result );
+    }
+  }
+}
+
+
+/*! \brief Benchmark suite over generated datasets, for tracking performance across versions
+ *
+ *  suite [csv|json] [points] [queries] [threads] [k]
+ *
+ *  Writes one result per tree and query kind to stdout, covering build
+ *  time, memory, the rate and latency percentiles of single queries and
+ *  the scaling of batches over threads.
+ */
+int main( int argc, char** argv )
+{
+  const bool json = argc > 1 && strcmp( argv[ 1 ], "json" ) == 0;
+  unsigned int pointCount = argc > 2 ? atoi( argv[ 2 ] ) : 100000;
+  unsigned int queryCount = argc > 3 ? atoi( argv[ 3 ] ) : 10000;
+  unsigned int maxThreads = argc > 4 ? atoi( argv[ 4 ] ) : std::thread::hardware_concurrency();
+  unsigned int num = argc > 5 ? atoi( argv[ 5 ] ) : 10;
+
+  if ( maxThreads == 0 )
+    maxThreads = 1;
+
+  ResultWriter writer( json );
+  writer.begin();
+
+  benchmarkDimension< 2 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 3 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 4 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 8 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 16 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 32 >( writer, pointCount, queryCount, maxThreads, num );
+  benchmarkDimension< 64 >( writer, pointCount, queryCount, maxThreads, num );
+
+  writer.end();
+
+  fprintf( stderr, "(%g)\n", checksum );
+
+  return 0;
+}
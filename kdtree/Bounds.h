@@ -1,6 +1,8 @@
 #ifndef BOUNDS
 #define BOUNDS
 
+#include "PointView.h"
+
 #include <vector>
 #include <limits>
 #include <math.h>
@@ -74,6 +76,7 @@ public:
       if ( length < m_max[ i ] - m_min[ i ] )
       {
         longestDim = i;
+        length = m_max[ i ] - m_min[ i ];
       }
     }
 
@@ -114,16 +117,30 @@ public:
   BoundsFactory() {};
 
   template< typename P, unsigned int DIM >
-  Bounds< P, DIM > createBounds( const std::vector< P >& points ) const;
+  Bounds< P, DIM > createBounds( const std::vector< P >& points ) const
+  {
+    return createBounds< P, DIM >( PointView< P >( points.data(), points.size() ) );
+  }
 
+  //! Bounds of points held by the caller
   template< typename P, unsigned int DIM >
-  BoundsPair< P, DIM > split( const Bounds< P, DIM >& bounds, const P& point, const int dimension ) const;
+  Bounds< P, DIM > createBounds( const PointView< P >& points ) const;
+
+  template< typename P, unsigned int DIM >
+  BoundsPair< P, DIM > split( const Bounds< P, DIM >& bounds, const P& point, const int dimension ) const
+  {
+    return split( bounds, point[ dimension ], dimension );
+  }
+
+  //! Split bounds in two where they cross value along dimension
+  template< typename P, unsigned int DIM >
+  BoundsPair< P, DIM > split( const Bounds< P, DIM >& bounds, typename P::base_type value, const unsigned int dimension ) const;
 
 };
 
 
 template< typename P, unsigned int DIM >
-Bounds< P, DIM > BoundsFactory::createBounds( const std::vector< P >& points ) const
+Bounds< P, DIM > BoundsFactory::createBounds( const PointView< P >& points ) const
 {
   typename P::base_type min[ DIM ];
   typename P::base_type max[ DIM ];
@@ -134,15 +151,14 @@ Bounds< P, DIM > BoundsFactory::createBounds( const std::vector< P >& points ) c
     max[ i ] = - std::numeric_limits< typename P::base_type >::max();
   }
 
-  typename std::vector< P >::const_iterator it = points.begin();
-  typename std::vector< P >::const_iterator end = points.end();
-
-  for ( ; it != end; ++it )
+  for ( size_t p=0; p<points.size(); ++p )
   {
+    const P& point = points[ p ];
+
     for ( unsigned int i=0; i<DIM; ++i )
     {
-      min[ i ] = (*it)[ i ] < min[ i ] ? (*it)[ i ] : min[ i ];
-      max[ i ] = (*it)[ i ] > max[ i ] ? (*it)[ i ] : max[ i ];
+      min[ i ] = point[ i ] < min[ i ] ? point[ i ] : min[ i ];
+      max[ i ] = point[ i ] > max[ i ] ? point[ i ] : max[ i ];
     }
   }
 
@@ -152,8 +168,8 @@ Bounds< P, DIM > BoundsFactory::createBounds( const std::vector< P >& points ) c
 template< typename P, unsigned int DIM >
 BoundsPair< P, DIM > BoundsFactory::split(
     const Bounds< P, DIM >& bounds,
-    const P& point,
-    const int dimension
+    typename P::base_type value,
+    const unsigned int dimension
     ) const
 {
   typename P::base_type maxcoords[ DIM ];
@@ -163,8 +179,8 @@ BoundsPair< P, DIM > BoundsFactory::split(
   {
     if ( i == dimension )
     {
-      maxcoords[ i ] = point[ i ];
-      mincoords[ i ] = point[ i ];
+      maxcoords[ i ] = value;
+      mincoords[ i ] = value;
     }
     else
     {
@@ -1,20 +1,40 @@
 #ifndef DATA
 #define DATA
 
-#include <list>
+#include <vector>
+#include <algorithm>
+#include <limits>
 
 namespace kd 
 {
 
+/*! \brief Collects the points a search finds
+ *
+ *  Tree::search is compiled for the concrete type it is handed. The Data
+ *  classes below are final so those searches call them directly, while
+ *  searching through a Data< P >& keeps working through the virtual
+ *  functions for anything else.
+ */
 template< typename P >
 class Data
 {
 public:
 
   Data() {}
+  virtual ~Data() {}
 
   virtual void update( const P& point, typename P::base_type distSq ) = 0;
 
+  /*! \brief Update with a bucket of points, distancesSq[ i ] belonging to points[ i ]
+   */
+  virtual void updateBulk( const P* points, const typename P::base_type* distancesSq, unsigned int count )
+  {
+    for ( unsigned int i=0; i<count; ++i )
+    {
+      update( points[ i ], distancesSq[ i ] );
+    }
+  }
+
   virtual bool incomplete() const = 0;
 
   virtual typename P::base_type maxDistanceSq() const = 0;
@@ -23,7 +43,7 @@ public:
 /*! \brief Basic data for a single nearest neighbour query
  */
 template< typename P >
-class NeighbourData : public Data< P >
+class NeighbourData final : public Data< P >
 {
 public:
   NeighbourData( typename P::base_type d )
@@ -39,6 +59,20 @@ public:
     }
   }
 
+  void updateBulk( const P* points, const typename P::base_type* distancesSq, unsigned int count )
+  {
+    unsigned int nearest = 0;
+
+    for ( unsigned int i=1; i<count; ++i )
+    {
+      if ( distancesSq[ i ] < distancesSq[ nearest ] )
+        nearest = i;
+    }
+
+    if ( count )
+      NeighbourData::update( points[ nearest ], distancesSq[ nearest ] );
+  }
+
   bool incomplete() const
   {
     return ! m_found;
@@ -62,9 +96,14 @@ private:
 
 
 /*! \brief Data for a group nearest neighbours query
+ *
+ *  Up to "num" neighbours are kept in a fixed size array, either owned by the
+ *  data or supplied by the caller, so no memory is allocated as candidates
+ *  are added. Small groups are kept sorted by insertion and larger ones in a
+ *  binary max-heap which is only sorted when the points are asked for.
  */
 template< typename P >
-class MultiNeighbourData : public Data< P >
+class MultiNeighbourData final : public Data< P >
 {
 public:
 
@@ -72,6 +111,8 @@ public:
    */
   struct PointDistance
   {
+    PointDistance() : distSq( 0 ) {}
+
     PointDistance( const P& p, typename P::base_type d )
       : distSq( d ), point( p ) {}
     
@@ -79,41 +120,77 @@ public:
     P point;
   };
 
-  typedef std::list< PointDistance > PointDistanceList;
+  /*! \brief Neighbours found, ordered nearest first
+   */
+  class PointDistanceList
+  {
+  public:
+
+    typedef const PointDistance* const_iterator;
+
+    PointDistanceList( const PointDistance* points, unsigned int size )
+      : m_begin( points ), m_end( points + size ) {}
+
+    const_iterator begin() const { return m_begin; }
+    const_iterator end() const { return m_end; }
+
+    unsigned int size() const { return m_end - m_begin; }
+    bool empty() const { return m_begin == m_end; }
+
+    const PointDistance& operator[]( unsigned int index ) const { return m_begin[ index ]; }
+    const PointDistance& back() const { return *( m_end - 1 ); }
+
+  private:
+
+    const PointDistance* m_begin;
+    const PointDistance* m_end;
+  };
+
+  //! Groups of up to this size are kept sorted rather than as a heap
+  static const unsigned int SORTED_LIMIT = 8;
 
   MultiNeighbourData( unsigned int num, typename P::base_type dist )
-    : m_nthDistanceSq( dist ), m_maxNeighbours( num ) { }
+    : m_storage( num ), m_buffer( 0 ), m_size( 0 ), m_sorted( true ),
+      m_nthDistanceSq( dist ), m_maxNeighbours( num ) { }
+
+  /*! \brief Collect the neighbours in a caller owned buffer of at least "num" entries
+   *
+   *  The buffer must outlive the data and any copies of it.
+   */
+  MultiNeighbourData( unsigned int num, typename P::base_type dist, PointDistance* buffer )
+    : m_buffer( buffer ), m_size( 0 ), m_sorted( true ),
+      m_nthDistanceSq( dist ), m_maxNeighbours( num ) { }
 
 
   /*! \brief Update neighbour data to include provide point if desired
    */
   void update( const P& point, typename P::base_type distSq )
   {
-    if ( distSq < m_nthDistanceSq )
+    if ( distSq < m_nthDistanceSq && m_maxNeighbours != 0 )
     {
-      typename PointDistanceList::iterator it = m_points.begin();
-      typename PointDistanceList::iterator end = m_points.end();
-
-      for( ; it != end; ++it )
+      if ( m_maxNeighbours <= SORTED_LIMIT )
       {
-        if ( it->distSq > distSq )
-          break;
+        insertSorted( PointDistance( point, distSq ) );
       }
-
-      // When it is nearest than one of our points insert it
-      m_points.insert( it, PointDistance( point, distSq ) );
-
-      // Crop our list at the desired size
-      if ( m_points.size() > m_maxNeighbours )
+      else
       {
-        m_points.pop_back();
-
-        // Update our nthDistanceSq
-        m_nthDistanceSq = m_points.back().distSq;
+        insertHeap( PointDistance( point, distSq ) );
       }
     }
   }
 
+  /*! \brief Update neighbour data with a bucket of points
+   */
+  void updateBulk( const P* points, const typename P::base_type* distancesSq, unsigned int count )
+  {
+    for ( unsigned int i=0; i<count; ++i )
+    {
+      // Most candidates are rejected here against the current radius
+      if ( distancesSq[ i ] < m_nthDistanceSq )
+        MultiNeighbourData::update( points[ i ], distancesSq[ i ] );
+    }
+  }
+
   //! Return the distance squared to the furtherest neighbour found
   typename P::base_type maxDistanceSq() const
   {
@@ -123,18 +200,107 @@ public:
   //! Returns true if we have not found as many neighbours as we would like
   bool incomplete() const
   {
-    return m_points.size() < m_maxNeighbours;
+    return m_size < m_maxNeighbours;
   }
 
   //! Returns a list of the points (and their distances) found
-  const PointDistanceList& points() const
+  PointDistanceList points() const
+  {
+    if ( ! m_sorted )
+    {
+      std::sort_heap( begin(), begin() + m_size, compare );
+      m_sorted = true;
+    }
+
+    return PointDistanceList( begin(), m_size );
+  }
+
+private:
+
+  //! Orders neighbours by distance, which makes a max-heap of the furthest
+  static bool compare( const PointDistance& a, const PointDistance& b )
+  {
+    return a.distSq < b.distSq;
+  }
+
+  PointDistance* begin() const
+  {
+    return m_buffer ? m_buffer : m_storage.data();
+  }
+
+  void insertSorted( const PointDistance& neighbour )
+  {
+    PointDistance* points = begin();
+
+    // Shift further neighbours along, dropping the last one when full
+    unsigned int i = m_size < m_maxNeighbours ? m_size++ : m_size - 1;
+
+    for ( ; i > 0 && points[ i - 1 ].distSq > neighbour.distSq; --i )
+    {
+      points[ i ] = points[ i - 1 ];
+    }
+
+    points[ i ] = neighbour;
+
+    if ( m_size == m_maxNeighbours )
+    {
+      m_nthDistanceSq = points[ m_size - 1 ].distSq;
+    }
+  }
+
+  void insertHeap( const PointDistance& neighbour )
   {
-    return m_points;
+    PointDistance* points = begin();
+
+    if ( m_sorted )
+    {
+      // The points have been asked for since the last update
+      std::make_heap( points, points + m_size, compare );
+      m_sorted = false;
+    }
+
+    if ( m_size < m_maxNeighbours )
+    {
+      points[ m_size++ ] = neighbour;
+      std::push_heap( points, points + m_size, compare );
+    }
+    else
+    {
+      // Replace the furthest neighbour and sift it down into place
+      unsigned int i = 0;
+
+      for ( ;; )
+      {
+        unsigned int child = 2 * i + 1;
+        if ( child >= m_size )
+          break;
+
+        if ( child + 1 < m_size && points[ child ].distSq < points[ child + 1 ].distSq )
+          ++child;
+
+        if ( points[ child ].distSq <= neighbour.distSq )
+          break;
+
+        points[ i ] = points[ child ];
+        i = child;
+      }
+
+      points[ i ] = neighbour;
+    }
+
+    if ( m_size == m_maxNeighbours )
+    {
+      m_nthDistanceSq = points[ 0 ].distSq;
+    }
   }
 
 private:
 
-  PointDistanceList m_points;
+  mutable std::vector< PointDistance > m_storage;
+  PointDistance* m_buffer;
+  unsigned int m_size;
+  mutable bool m_sorted;
+
   typename P::base_type m_nthDistanceSq;
 
   unsigned int m_maxNeighbours;
@@ -143,6 +309,122 @@ private:
 
 
 
+/*! \brief Data for a fixed radius query, handing each point found to a visitor
+ *
+ *  The visitor is called as visitor( point, distSq ) for every point closer
+ *  than the radius. Returning false from it ends the search early.
+ */
+template< typename P, typename V >
+class RadiusData final : public Data< P >
+{
+public:
+
+  RadiusData( typename P::base_type radiusSq, V& visitor )
+    : m_radiusSq( radiusSq ), m_visitor( visitor ) {}
+
+  void update( const P& point, typename P::base_type distSq )
+  {
+    if ( distSq < m_radiusSq && ! m_visitor( point, distSq ) )
+    {
+      // Nothing can be closer than this so every remaining cell is skipped
+      m_radiusSq = std::numeric_limits< typename P::base_type >::lowest();
+    }
+  }
+
+  void updateBulk( const P* points, const typename P::base_type* distancesSq, unsigned int count )
+  {
+    for ( unsigned int i=0; i<count; ++i )
+    {
+      RadiusData::update( points[ i ], distancesSq[ i ] );
+    }
+  }
+
+  //! The search never needs to look beyond the radius
+  bool incomplete() const
+  {
+    return false;
+  }
+
+  typename P::base_type maxDistanceSq() const
+  {
+    return m_radiusSq;
+  }
+
+private:
+
+  typename P::base_type m_radiusSq;
+  V& m_visitor;
+};
+
+
+/*! \brief Visitor copying the points found into a caller owned buffer
+ *
+ *  Counts every point it is given but only keeps the first "capacity" of
+ *  them.
+ */
+template< typename P >
+class BufferVisitor
+{
+public:
+
+  BufferVisitor( P* points, unsigned int capacity )
+    : m_points( points ), m_capacity( capacity ), m_count( 0 ) {}
+
+  bool operator()( const P& point )
+  {
+    if ( m_count < m_capacity )
+      m_points[ m_count ] = point;
+
+    ++m_count;
+    return true;
+  }
+
+  bool operator()( const P& point, typename P::base_type )
+  {
+    return (*this)( point );
+  }
+
+  //! Number of points visited, which may be more than were kept
+  unsigned int count() const { return m_count; }
+
+private:
+
+  P* m_points;
+  unsigned int m_capacity;
+  unsigned int m_count;
+};
+
+
+/*! \brief Visitor counting the points found up to a limit, at which it stops the search
+ */
+template< typename P >
+class CountVisitor
+{
+public:
+
+  CountVisitor( unsigned int limit )
+    : m_limit( limit ), m_count( 0 ) {}
+
+  bool operator()( const P& )
+  {
+    return ++m_count < m_limit;
+  }
+
+  bool operator()( const P& point, typename P::base_type )
+  {
+    return (*this)( point );
+  }
+
+  unsigned int count() const { return m_count; }
+
+private:
+
+  unsigned int m_limit;
+  unsigned int m_count;
+};
+
+
+
 }; // namespace kd
 
 #endif // DATA
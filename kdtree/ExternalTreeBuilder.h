@@ -0,0 +1,828 @@
+#ifndef EXTERNAL_TREE_BUILDER
+#define EXTERNAL_TREE_BUILDER
+
+#include "TreeFactory.h"
+#include "TreeFile.h"
+#include "PointStream.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+
+#include <stdio.h>
+
+namespace kd
+{
+
+/*! \brief Builds trees over more points than fit in memory, straight into a TreeFile
+ *
+ *  The points are read from a PointStream, a few times over. While there
+ *  are too many of them to build in memory they are split, as the
+ *  TreeFactory would, at splits chosen from a sample of them, and written
+ *  out to a temporary file per cell. Each cell is then split again in the
+ *  same way or, once it fits, read back and built in memory by the
+ *  factory. Nodes, points and coordinates go to the file as each cell is
+ *  finished, so only one cell is ever held in memory. The finished file
+ *  is opened with TreeFile::map.
+ *
+ *  The memory budget covers everything the build allocates, which
+ *  peakMemory reports afterwards. Trees split with SPLIT_SLIDING_MIDPOINT
+ *  may have many more nodes than points over bucket size, which can take
+ *  the build of a cell past the budget. As with TreeFile the tree may hold
+ *  up to 2^32 - 1 points, and the temporary files take as much disk again
+ *  as the finished tree, next to it.
+ */
+class ExternalTreeBuilder
+{
+public:
+
+  static const size_t DEFAULT_MEMORY_BUDGET = size_t( 256 ) << 20;
+
+  //! Builds trees with the bucket size and split rule of factory
+  explicit ExternalTreeBuilder( const TreeFactory& factory, size_t memoryBudget = DEFAULT_MEMORY_BUDGET )
+   : m_factory( factory ), m_memoryBudget( memoryBudget ), m_peakMemory( 0 ) {}
+
+  //! Set the bytes a build may allocate, files and the stream's own memory aside
+  void setMemoryBudget( size_t bytes ) { m_memoryBudget = bytes; }
+
+  size_t memoryBudget() const { return m_memoryBudget; }
+
+  /*! \brief Builds a tree over points and writes it to path
+   *
+   *  Returns false if the stream could not be read, a file could not be
+   *  written or the budget is too small to build in, which takes more
+   *  the more points there are. The points must be plain data, as for
+   *  TreeFile.
+   */
+  template< typename P, unsigned int DIM >
+  bool build( PointStream< P >& points, const char* path );
+
+  //! Most bytes allocated at once by the last build
+  size_t peakMemory() const { return m_peakMemory; }
+
+private:
+
+  const TreeFactory m_factory;
+  size_t m_memoryBudget;
+  size_t m_peakMemory;
+};
+
+
+/*! \brief State of one build by an ExternalTreeBuilder
+ *
+ *  The budget is shared out up front. Half of it bounds the points of a
+ *  cell built in memory, along with their coordinates and nodes. While
+ *  splitting a cell an eighth holds the sample, a quarter is shared
+ *  between the buffers the points are written to the cells' files through
+ *  and a sixteenth is the buffer the stream is read through.
+ *
+ *  The splits and buckets of a cell are kept until all of its cells are
+ *  built, so those of every cell being split at once share the last
+ *  quarter. A cell is split into no more cells than leaves room for as
+ *  many levels of as many cells again as it takes to reach cells which
+ *  fit in memory, see cellLimit.
+ */
+template< typename P, unsigned int DIM >
+class ExternalBuild
+{
+public:
+
+  typedef typename P::base_type base_type;
+
+  //! Most points sampled to choose the splits of a cell
+  static const unsigned int MAX_SAMPLES = 65536;
+
+  //! Most cells a cell is split into at once, each holds a file open
+  static const unsigned int MAX_CELLS = 256;
+
+  //! Fewest points written to a cell's file at a time
+  static const unsigned int MIN_SPILL = 64;
+
+  //! Most points read from a stream at a time
+  static const unsigned int MAX_READ = 65536;
+
+  ExternalBuild( const TreeFactory& factory, size_t budget, const char* path );
+
+  ~ExternalBuild();
+
+  bool run( PointStream< P >& input );
+
+  size_t peakMemory() const { return m_peak; }
+
+private:
+
+  //! Split of a cell into smaller cells, with the ties sent to each side in proportion to the sample's
+  struct Split
+  {
+    base_type split;
+    unsigned int dim;
+
+    //! Offset to the upper side, or for a cell the index of its bucket
+    unsigned int right;
+
+    unsigned long long lowerTies;
+    unsigned long long upperTies;
+
+    //! Points equal to the split seen so far
+    unsigned long long ties;
+  };
+
+  //! Cell whose points are written to a temporary file
+  struct Bucket
+  {
+    Bucket( const Bounds< P, DIM >& b )
+     : bounds( b ), file( 0 ), count( 0 ) {}
+
+    Bounds< P, DIM > bounds;
+    std::string path;
+    FILE* file;
+    unsigned long long count;
+    std::vector< P > buffer;
+  };
+
+  //! Closes and removes the files of buckets however partition returns
+  class SpillGuard
+  {
+  public:
+
+    explicit SpillGuard( std::vector< Bucket >& buckets )
+     : m_buckets( buckets ) {}
+
+    ~SpillGuard()
+    {
+      for ( unsigned int b=0; b<m_buckets.size(); ++b )
+      {
+        if ( m_buckets[ b ].file )
+          fclose( m_buckets[ b ].file );
+
+        if ( ! m_buckets[ b ].path.empty() )
+          remove( m_buckets[ b ].path.c_str() );
+      }
+    }
+
+  private:
+
+    SpillGuard( const SpillGuard& );
+    SpillGuard& operator=( const SpillGuard& );
+
+    std::vector< Bucket >& m_buckets;
+  };
+
+  void acquire( size_t bytes )
+  {
+    m_used += bytes;
+    m_peak = std::max( m_peak, m_used );
+  }
+
+  void release( size_t bytes ) { m_used -= bytes; }
+
+  //! Takes bytes of the share for splits and buckets, and of the budget
+  void acquireSplits( size_t bytes )
+  {
+    m_splitUsed += bytes;
+    acquire( bytes );
+  }
+
+  void releaseSplits( size_t bytes )
+  {
+    m_splitUsed -= bytes;
+    release( bytes );
+  }
+
+  //! Most cells to split count points into, 0 if not even two would leave room for the levels below
+  unsigned int cellLimit( unsigned long long count ) const;
+
+  //! Adds the nodes of the subtree over count points of input
+  bool partition( PointStream< P >& input, unsigned long long count, const Bounds< P, DIM >& bounds, std::vector< P >& sample );
+
+  //! Builds count points of input in memory, appending their nodes, points and coordinates
+  bool buildCell( PointStream< P >& input, unsigned long long count, const Bounds< P, DIM >& bounds );
+
+  //! Splits sample[ begin, end ) in pre-order until each cell holds no more than target samples
+  void splitSample(
+      std::vector< P >& sample,
+      unsigned int begin,
+      unsigned int end,
+      const Bounds< P, DIM >& bounds,
+      unsigned int target,
+      unsigned int maxCells,
+      std::vector< Split >& splits,
+      std::vector< Bucket >& buckets
+      ) const;
+
+  //! Appends the nodes for the cell at splits[ index ], building its buckets
+  bool emit( unsigned int index, std::vector< Split >& splits, std::vector< Bucket >& buckets );
+
+  //! Bucket the point falls in
+  static unsigned int route( const P& point, std::vector< Split >& splits );
+
+  bool flush( Bucket& bucket );
+
+  //! Reservoir sample of the points seen, count being the number seen before point
+  void sample( std::vector< P >& sample, const P& point, unsigned long long count );
+
+  //! Appends a node to the temporary file of nodes
+  bool appendNode( const Node< P >& node );
+
+  //! Writes the finished tree from the temporary files
+  bool finish();
+
+  //! Copies size bytes of a temporary file into a section of the tree's file
+  bool copySection( FILE* out, FILE* in, unsigned long long& position, unsigned long long offset,
+                    unsigned long long size, unsigned long long& hash );
+
+  FILE* temporary( const std::string& path );
+
+  const TreeFactory& m_factory;
+  const std::string m_path;
+
+  size_t m_used;
+  size_t m_peak;
+
+  //! Points of a cell built in memory
+  unsigned long long m_capacity;
+  unsigned int m_samples;
+  size_t m_spillBytes;
+  unsigned int m_maxCells;
+
+  //! Share of the budget for the splits and buckets of every cell being split
+  size_t m_splitBytes;
+  size_t m_splitUsed;
+
+  unsigned int m_readPoints;
+  unsigned int m_bucketSize;
+
+  std::vector< P > m_read;
+
+  unsigned long long m_random;
+  unsigned int m_spillCount;
+
+  FILE* m_nodes;
+  FILE* m_points;
+  FILE* m_coordinates;
+
+  unsigned long long m_nodeCount;
+  unsigned long long m_pointCount;
+
+  base_type m_min[ DIM ];
+  base_type m_max[ DIM ];
+};
+
+
+template< typename P, unsigned int DIM >
+ExternalBuild< P, DIM >::ExternalBuild( const TreeFactory& factory, size_t budget, const char* path )
+ : m_factory( factory ), m_path( path ), m_used( 0 ), m_peak( 0 ),
+   m_random( 0x9E3779B97F4A7C15ull ), m_spillCount( 0 ),
+   m_nodes( 0 ), m_points( 0 ), m_coordinates( 0 ), m_nodeCount( 0 ), m_pointCount( 0 )
+{
+  m_bucketSize = factory.m_bucketSize < 1 ? 1
+    : factory.m_bucketSize > Tree< P, DIM >::MAX_BUCKET_SIZE ? Tree< P, DIM >::MAX_BUCKET_SIZE : factory.m_bucketSize;
+
+  // A cell of n points takes n points, n * DIM coordinates and, with median
+  // splits, under 4 * n / bucket size + 1 nodes
+  const size_t cellBytes = budget / 2;
+  const unsigned long long pointBytes = ( sizeof( P ) + DIM * sizeof( base_type ) ) * m_bucketSize + 4 * sizeof( Node< P > );
+
+  m_capacity = cellBytes > sizeof( Node< P > ) ? ( cellBytes - sizeof( Node< P > ) ) * m_bucketSize / pointBytes : 0;
+  m_samples = (unsigned int)( std::min< size_t >( MAX_SAMPLES, budget / 8 / sizeof( P ) ) );
+  m_spillBytes = budget / 4;
+  m_maxCells = (unsigned int)( std::min< size_t >( MAX_CELLS, m_spillBytes / ( MIN_SPILL * sizeof( P ) ) ) );
+  m_splitBytes = budget / 4;
+  m_splitUsed = 0;
+  m_readPoints = (unsigned int)( std::min< size_t >( MAX_READ, budget / 16 / sizeof( P ) ) );
+}
+
+
+template< typename P, unsigned int DIM >
+ExternalBuild< P, DIM >::~ExternalBuild()
+{
+  const char* suffixes[] = { ".nodes", ".points", ".coordinates" };
+  FILE* files[] = { m_nodes, m_points, m_coordinates };
+
+  for ( unsigned int f=0; f<3; ++f )
+  {
+    if ( files[ f ] )
+    {
+      fclose( files[ f ] );
+      remove( ( m_path + suffixes[ f ] ).c_str() );
+    }
+  }
+
+  release( m_read.capacity() * sizeof( P ) );
+}
+
+
+template< typename P, unsigned int DIM >
+FILE* ExternalBuild< P, DIM >::temporary( const std::string& path )
+{
+  FILE* file = fopen( path.c_str(), "w+b" );
+
+  // Everything is written in large blocks, and buffers would be outside the budget
+  if ( file )
+    setvbuf( file, 0, _IONBF, 0 );
+
+  return file;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::run( PointStream< P >& input )
+{
+  if ( m_capacity < 2 * m_bucketSize || m_samples < 2 || m_maxCells < 2 || m_readPoints < 1 )
+    return false;
+
+  m_nodes = temporary( m_path + ".nodes" );
+  m_points = temporary( m_path + ".points" );
+  m_coordinates = temporary( m_path + ".coordinates" );
+
+  if ( ! m_nodes || ! m_points || ! m_coordinates || ! input.rewind() )
+    return false;
+
+  m_read.resize( m_readPoints );
+  acquire( m_read.capacity() * sizeof( P ) );
+
+  std::vector< P > drawn;
+  drawn.reserve( m_samples );
+  acquire( drawn.capacity() * sizeof( P ) );
+
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    m_min[ d ] = std::numeric_limits< base_type >::max();
+    m_max[ d ] = - std::numeric_limits< base_type >::max();
+  }
+
+  // The first pass finds the bounds and draws the sample for the first splits
+  unsigned long long count = 0;
+
+  while ( size_t read = input.read( m_read.data(), m_read.size() ) )
+  {
+    for ( size_t i=0; i<read; ++i, ++count )
+    {
+      const P& point = m_read[ i ];
+
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        m_min[ d ] = point[ d ] < m_min[ d ] ? point[ d ] : m_min[ d ];
+        m_max[ d ] = point[ d ] > m_max[ d ] ? point[ d ] : m_max[ d ];
+      }
+
+      sample( drawn, point, count );
+    }
+  }
+
+  if ( count > std::numeric_limits< unsigned int >::max() )
+    return false;
+
+  const Bounds< P, DIM > bounds( ( P( m_min ) ), P( m_max ) );
+
+  if ( count && ! partition( input, count, bounds, drawn ) )
+    return false;
+
+  return finish();
+}
+
+
+template< typename P, unsigned int DIM >
+void ExternalBuild< P, DIM >::sample( std::vector< P >& sample, const P& point, unsigned long long count )
+{
+  if ( sample.size() < m_samples )
+  {
+    sample.push_back( point );
+    return;
+  }
+
+  // xorshift64*, the build is the same every time and leaves drand48 alone
+  m_random ^= m_random >> 12;
+  m_random ^= m_random << 25;
+  m_random ^= m_random >> 27;
+  const unsigned long long slot = ( m_random * 2685821657736338717ull ) % ( count + 1 );
+
+  if ( slot < m_samples )
+    sample[ slot ] = point;
+}
+
+
+template< typename P, unsigned int DIM >
+unsigned int ExternalBuild< P, DIM >::cellLimit( unsigned long long count ) const
+{
+  // Each cell has a bucket and a split, as do all but one of the splits.
+  // A path is at most the tree's and a suffix, doubled by the string
+  const size_t cellBytes = 2 * sizeof( Split ) + sizeof( Bucket ) + 2 * ( m_path.size() + 32 );
+  const size_t available = m_splitBytes - m_splitUsed;
+  const unsigned long long target = std::max( m_capacity / 4 * 3, 1ull );
+
+  for ( unsigned int cells=m_maxCells; cells>=2; --cells )
+  {
+    unsigned long long reach = cells;
+    unsigned int levels = 1;
+
+    while ( reach * target < count )
+    {
+      reach *= cells;
+      ++levels;
+    }
+
+    if ( size_t( levels ) * cells * cellBytes <= available )
+      return cells;
+  }
+
+  return 0;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::partition(
+    PointStream< P >& input,
+    unsigned long long count,
+    const Bounds< P, DIM >& bounds,
+    std::vector< P >& drawn
+    )
+{
+  if ( count <= m_capacity )
+  {
+    release( drawn.capacity() * sizeof( P ) );
+    std::vector< P >().swap( drawn );
+
+    return buildCell( input, count, bounds );
+  }
+
+  const unsigned int maxCells = cellLimit( count );
+
+  if ( maxCells < 2 )
+    return false;
+
+  if ( drawn.empty() )
+  {
+    if ( ! input.rewind() )
+      return false;
+
+    drawn.reserve( m_samples );
+    acquire( drawn.capacity() * sizeof( P ) );
+
+    unsigned long long seen = 0;
+    while ( size_t read = input.read( m_read.data(), m_read.size() ) )
+    {
+      for ( size_t i=0; i<read; ++i, ++seen )
+        sample( drawn, m_read[ i ], seen );
+    }
+  }
+
+  std::vector< Split > splits;
+  std::vector< Bucket > buckets;
+  splits.reserve( 2 * maxCells );
+  buckets.reserve( maxCells );
+  SpillGuard guard( buckets );
+  const size_t cellBytes = splits.capacity() * sizeof( Split ) + buckets.capacity() * sizeof( Bucket );
+  acquireSplits( cellBytes );
+
+  // Aim under the capacity so that cells the sample underestimates still fit
+  const unsigned long long target = ( m_capacity / 4 * 3 ) * drawn.size() / count;
+  splitSample( drawn, 0, drawn.size(), bounds, (unsigned int)( std::max( target, 1ull ) ), maxCells, splits, buckets );
+
+  release( drawn.capacity() * sizeof( P ) );
+  std::vector< P >().swap( drawn );
+
+  // Send every point to the file of its cell
+  const size_t spill = std::max< size_t >( MIN_SPILL, m_spillBytes / buckets.size() / sizeof( P ) );
+
+  bool ok = input.rewind();
+
+  for ( unsigned int b=0; b<buckets.size(); ++b )
+  {
+    char suffix[ 32 ];
+    snprintf( suffix, sizeof( suffix ), ".spill%u", m_spillCount++ );
+
+    buckets[ b ].path = m_path + suffix;
+    buckets[ b ].file = ok ? temporary( buckets[ b ].path ) : 0;
+    buckets[ b ].buffer.reserve( spill );
+    acquire( buckets[ b ].buffer.capacity() * sizeof( P ) );
+    acquireSplits( buckets[ b ].path.capacity() );
+
+    ok = ok && buckets[ b ].file;
+  }
+
+  while ( size_t read = ok ? input.read( m_read.data(), m_read.size() ) : 0 )
+  {
+    for ( size_t i=0; i<read; ++i )
+    {
+      Bucket& bucket = buckets[ route( m_read[ i ], splits ) ];
+
+      bucket.buffer.push_back( m_read[ i ] );
+      ++bucket.count;
+
+      if ( bucket.buffer.size() == bucket.buffer.capacity() )
+        ok = flush( bucket ) && ok;
+    }
+  }
+
+  for ( unsigned int b=0; b<buckets.size(); ++b )
+  {
+    ok = flush( buckets[ b ] ) && ok;
+
+    if ( buckets[ b ].file && fclose( buckets[ b ].file ) != 0 )
+      ok = false;
+    buckets[ b ].file = 0;
+
+    release( buckets[ b ].buffer.capacity() * sizeof( P ) );
+    std::vector< P >().swap( buckets[ b ].buffer );
+  }
+
+  // Emitting removes each file once read back, the guard any left should it fail
+  ok = emit( 0, splits, buckets ) && ok;
+
+  for ( unsigned int b=0; b<buckets.size(); ++b )
+    releaseSplits( buckets[ b ].path.capacity() );
+
+  releaseSplits( cellBytes );
+
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+void ExternalBuild< P, DIM >::splitSample(
+    std::vector< P >& sample,
+    unsigned int begin,
+    unsigned int end,
+    const Bounds< P, DIM >& bounds,
+    unsigned int target,
+    unsigned int maxCells,
+    std::vector< Split >& splits,
+    std::vector< Bucket >& buckets
+    ) const
+{
+  const unsigned int index = splits.size();
+
+  if ( end - begin <= target || end - begin < 2 || maxCells < 2 )
+  {
+    Split cell;
+    cell.dim = Node< P >::LEAF;
+    cell.right = buckets.size();
+    splits.push_back( cell );
+    buckets.push_back( Bucket( bounds ) );
+    return;
+  }
+
+  Split split;
+  const unsigned int rank = m_factory.partition< P, DIM >(
+      sample, begin, end, bounds, m_bucketSize, PointAccess< P >(), split.dim, split.split );
+
+  split.right = 0;
+  split.ties = 0;
+  split.lowerTies = 0;
+  split.upperTies = 0;
+
+  for ( unsigned int i=begin; i<end; ++i )
+  {
+    if ( sample[ i ][ split.dim ] == split.split )
+      ++( i < rank ? split.lowerTies : split.upperTies );
+  }
+
+  splits.push_back( split );
+
+  BoundsPair< P, DIM > boundsPair = m_factory.m_boundsFactory.split( bounds, split.split, split.dim );
+
+  // Share the cells out as the sample is, so no side is left as one cell
+  // far too large while the other is split finely
+  const unsigned long long share = (unsigned long long)( maxCells ) * ( rank - begin ) / ( end - begin );
+  const unsigned int lowerCells = (unsigned int)( std::min< unsigned long long >( maxCells - 1, std::max( share, 1ull ) ) );
+
+  splitSample( sample, begin, rank, boundsPair.left, target, lowerCells, splits, buckets );
+  splits[ index ].right = splits.size() - index;
+  splitSample( sample, rank, end, boundsPair.right, target, maxCells - lowerCells, splits, buckets );
+}
+
+
+template< typename P, unsigned int DIM >
+unsigned int ExternalBuild< P, DIM >::route( const P& point, std::vector< Split >& splits )
+{
+  unsigned int index = 0;
+
+  while ( splits[ index ].dim != Node< P >::LEAF )
+  {
+    Split& split = splits[ index ];
+    const base_type value = point[ split.dim ];
+
+    bool lower = value < split.split;
+
+    // Points equal to the split may go either side. Sharing them out as
+    // the sample's were sends at least one point each way from the first
+    // split, so every cell holds fewer points than the one split up. A
+    // sliding midpoint need not be on any sampled point, and then there is
+    // nothing to share out
+    const unsigned long long sampled = split.lowerTies + split.upperTies;
+
+    if ( value == split.split && sampled )
+    {
+      lower = ( split.ties + 1 ) * split.lowerTies / sampled > split.ties * split.lowerTies / sampled;
+      ++split.ties;
+    }
+
+    index += lower ? 1 : split.right;
+  }
+
+  return splits[ index ].right;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::flush( Bucket& bucket )
+{
+  const size_t size = bucket.buffer.size();
+  const bool ok = size == 0 || ( bucket.file && fwrite( bucket.buffer.data(), sizeof( P ), size, bucket.file ) == size );
+
+  bucket.buffer.clear();
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::emit( unsigned int index, std::vector< Split >& splits, std::vector< Bucket >& buckets )
+{
+  const Split& split = splits[ index ];
+
+  if ( split.dim == Node< P >::LEAF )
+  {
+    Bucket& bucket = buckets[ split.right ];
+
+    std::vector< P > none;
+    FilePointStream< P > stream( bucket.path.c_str() );
+    const bool ok = stream.valid() && partition( stream, bucket.count, bucket.bounds, none );
+
+    remove( bucket.path.c_str() );
+    return ok;
+  }
+
+  Node< P > node = Node< P >::splitNode( split.split, split.dim );
+  const unsigned long long nodeIndex = m_nodeCount;
+
+  bool ok = appendNode( node );
+  ok = emit( index + 1, splits, buckets ) && ok;
+
+  node.right = (unsigned int)( m_nodeCount - nodeIndex );
+
+  // Go back to fill in where the upper side starts
+  ok = ok && fseek( m_nodes, long( nodeIndex * sizeof( Node< P > ) ), SEEK_SET ) == 0
+    && fwrite( &node, sizeof( node ), 1, m_nodes ) == 1
+    && fseek( m_nodes, 0, SEEK_END ) == 0;
+
+  return emit( index + split.right, splits, buckets ) && ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::appendNode( const Node< P >& node )
+{
+  ++m_nodeCount;
+  return fwrite( &node, sizeof( node ), 1, m_nodes ) == 1;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::buildCell( PointStream< P >& input, unsigned long long count, const Bounds< P, DIM >& bounds )
+{
+  if ( count == 0 )
+    return appendNode( Node< P >::leafNode( (unsigned int)( m_pointCount ), 0 ) );
+
+  if ( ! input.rewind() )
+    return false;
+
+  typename Tree< P, DIM >::PointList points( count );
+  acquire( points.capacity() * sizeof( P ) );
+
+  size_t read = 0;
+  while ( read < count )
+  {
+    const size_t got = input.read( points.data() + read, count - read );
+    if ( got == 0 )
+      break;
+    read += got;
+  }
+
+  typename Tree< P, DIM >::NodeList nodes;
+  typename Tree< P, DIM >::CoordinateList coordinates;
+
+  bool ok = read == count;
+
+  if ( ok )
+  {
+    nodes.reserve( 4 * count / m_bucketSize + 1 );
+    const size_t reserved = nodes.capacity();
+    acquire( reserved * sizeof( Node< P > ) );
+
+    m_factory.createSubTree< P, DIM >( points, 0, count, bounds, nodes, 0, PointAccess< P >() );
+
+    // Only sliding midpoint splits can outgrow the reservation, see ExternalTreeBuilder
+    if ( nodes.capacity() > reserved )
+      acquire( ( nodes.capacity() - reserved ) * sizeof( Node< P > ) );
+
+    coordinates.resize( count * DIM );
+    acquire( coordinates.capacity() * sizeof( base_type ) );
+
+    Tree< P, DIM >::createCoordinates( nodes.data(), nodes.size(), points.data(), coordinates.data(), PointAccess< P >() );
+
+    for ( size_t n=0; n<nodes.size(); ++n )
+    {
+      if ( nodes[ n ].leaf() )
+        nodes[ n ].first += (unsigned int)( m_pointCount );
+    }
+
+    ok = fwrite( nodes.data(), sizeof( Node< P > ), nodes.size(), m_nodes ) == nodes.size()
+      && fwrite( points.data(), sizeof( P ), count, m_points ) == count
+      && fwrite( coordinates.data(), sizeof( base_type ), coordinates.size(), m_coordinates ) == coordinates.size();
+
+    m_nodeCount += nodes.size();
+    m_pointCount += count;
+  }
+
+  release( points.capacity() * sizeof( P ) + nodes.capacity() * sizeof( Node< P > ) + coordinates.capacity() * sizeof( base_type ) );
+
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::copySection( FILE* out, FILE* in, unsigned long long& position, unsigned long long offset,
+                                           unsigned long long size, unsigned long long& hash )
+{
+  if ( fseek( in, 0, SEEK_SET ) != 0 )
+    return false;
+
+  char* buffer = reinterpret_cast< char* >( m_read.data() );
+  const size_t capacity = m_read.size() * sizeof( P );
+
+  // The first block pads up to the section, the rest follow on
+  bool ok = TreeFile::writeSection( out, position, offset, buffer, 0, hash );
+
+  while ( ok && size )
+  {
+    const size_t block = size_t( std::min< unsigned long long >( size, capacity ) );
+
+    ok = fread( buffer, 1, block, in ) == block
+      && TreeFile::writeSection( out, position, position, buffer, block, hash );
+
+    size -= block;
+  }
+
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalBuild< P, DIM >::finish()
+{
+  if ( m_nodeCount > std::numeric_limits< unsigned int >::max() )
+    return false;
+
+  TreeFileHeader head = TreeFile::header< P, DIM >( m_nodeCount, m_pointCount );
+
+  FILE* file = fopen( m_path.c_str(), "wb" );
+  if ( ! file )
+    return false;
+
+  setvbuf( file, 0, _IONBF, 0 );
+
+  // As TreeFile::write, the header goes in last once the checksum is known
+  bool ok = fseek( file, long( sizeof( TreeFileHeader ) ), SEEK_SET ) == 0;
+
+  unsigned long long position = sizeof( TreeFileHeader );
+  unsigned long long hash = TreeFile::checksum( 0, 0 );
+
+  P corners[ 2 ] = { P( m_min ), P( m_max ) };
+
+  ok = ok && TreeFile::writeSection( file, position, head.boundsOffset, corners, sizeof( corners ), hash );
+  ok = ok && copySection( file, m_nodes, position, head.nodesOffset, m_nodeCount * sizeof( Node< P > ), hash );
+  ok = ok && copySection( file, m_points, position, head.pointsOffset, m_pointCount * sizeof( P ), hash );
+  ok = ok && copySection( file, m_coordinates, position, head.coordinatesOffset, m_pointCount * DIM * sizeof( base_type ), hash );
+
+  head.checksum = hash;
+
+  ok = ok && fseek( file, 0, SEEK_SET ) == 0;
+  ok = ok && fwrite( &head, sizeof( head ), 1, file ) == 1;
+
+  if ( fclose( file ) != 0 )
+    ok = false;
+
+  if ( ! ok )
+    remove( m_path.c_str() );
+
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool ExternalTreeBuilder::build( PointStream< P >& points, const char* path )
+{
+  ExternalBuild< P, DIM > build( m_factory, m_memoryBudget, path );
+
+  const bool ok = build.run( points );
+  m_peakMemory = build.peakMemory();
+
+  return ok;
+}
+
+
+}; // namespace kd
+
+#endif // EXTERNAL_TREE_BUILDER
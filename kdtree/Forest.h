@@ -0,0 +1,451 @@
+#ifndef FOREST
+#define FOREST
+
+#include "TreeFactory.h"
+
+#include <vector>
+#include <limits>
+
+namespace kd
+{
+
+/*! \brief A set of points which can change, held as a forest of static Trees
+ *
+ *  Uses the logarithmic method of Bentley and Saxe: level i holds a Tree of
+ *  at most 2^i points, or nothing. Inserting merges the new points with the
+ *  full levels below the first one they fit in and rebuilds that one level,
+ *  so each point is rebuilt O(log n) times and an insert costs O(log^2 n)
+ *  amortised.
+ *
+ *  Removed points are marked rather than taken out of their Tree and are
+ *  skipped by queries. A level is rebuilt without its removed points once
+ *  they are more than half of it, which keeps the space and query time
+ *  proportional to the points that remain.
+ *
+ *  Queries visit every level with the same Data, so the distance found in
+ *  one Tree prunes the search of the next.
+ */
+template< typename P, unsigned int DIM, typename M = EuclideanMetric< typename P::base_type > >
+class Forest
+{
+public:
+
+  typedef typename P::base_type base_type;
+
+  //! The factory builds every Tree in the forest, with its settings
+  Forest( const TreeFactory& factory, const M& metric = M() )
+   : m_factory( factory ), m_metric( metric ), m_size( 0 ) {}
+
+  ~Forest()
+  {
+    for ( unsigned int i=0; i<m_levels.size(); ++i )
+    {
+      delete m_levels[ i ].tree;
+    }
+  }
+
+  //! Add a point
+  void insert( const P& point )
+  {
+    std::vector< P > points( 1, point );
+    insert( points );
+  }
+
+  //! Add a batch of points, cheaper than adding them one at a time
+  void insert( const std::vector< P >& points );
+
+  /*! \brief Remove one point with exactly the coordinates of point
+   *
+   *  Returns false if there is no such point.
+   */
+  bool remove( const P& point );
+
+  //! Rebuild the points that remain into as few Trees as possible
+  void compact();
+
+  //! Number of points in the forest
+  unsigned int size() const { return m_size; }
+
+  //! Number of levels currently holding a Tree
+  unsigned int trees() const;
+
+  //! Find the nearest neighbour to target
+  NeighbourData< P > nearestNeighbour( const P& target ) const
+  {
+    NeighbourData< P > data( std::numeric_limits< base_type >::max() );
+    search( target, data );
+    return data;
+  }
+
+  //! Find the "num" nearest neighbours to target
+  MultiNeighbourData< P > nearestNeighbours( unsigned int num, const P& target ) const
+  {
+    MultiNeighbourData< P > data( num, std::numeric_limits< base_type >::max() );
+    search( target, data );
+    return data;
+  }
+
+  /*! \brief Calls visitor( point, distanceSq ) for each point closer than radius to target
+   *
+   *  Returning false from the visitor ends the search early.
+   */
+  template< typename V >
+  void withinRadius( const P& target, base_type radius, V& visitor ) const
+  {
+    RadiusData< P, V > data( m_metric.fromLength( radius ), visitor );
+    search( target, data );
+  }
+
+  //! Count the points closer than radius to target, stopping once limit are found
+  unsigned int countWithinRadius( const P& target, base_type radius, unsigned int limit = ~0u ) const
+  {
+    if ( limit == 0 )
+      return 0;
+
+    CountVisitor< P > visitor( limit );
+    withinRadius( target, radius, visitor );
+    return visitor.count();
+  }
+
+  /*! \brief Calls visitor( point ) for each point inside box, including its boundary
+   *
+   *  Returning false from the visitor ends the search early.
+   */
+  template< typename V >
+  void withinBox( const Bounds< P, DIM >& box, V& visitor ) const;
+
+  //! Visit the points in every Tree which could improve data, see Tree::search
+  template< typename D >
+  void search( const P& target, D& data ) const;
+
+private:
+
+  // Forests own their Trees so are not copied
+  Forest( const Forest& );
+  Forest& operator=( const Forest& );
+
+  /*! \brief One Tree of the forest and which of its points are removed
+   *
+   *  removed[ i ] belongs to tree->points()[ i ].
+   */
+  struct Level
+  {
+    Level() : tree( 0 ), removedCount( 0 ) {}
+
+    Tree< P, DIM, M >* tree;
+    std::vector< unsigned char > removed;
+    unsigned int removedCount;
+
+    bool live( const P& point ) const
+    {
+      return ! removedCount || ! removed[ &point - tree->points() ];
+    }
+  };
+
+  /*! \brief Passes on the points of one level which have not been removed
+   */
+  template< typename D >
+  class LiveData final : public Data< P >
+  {
+  public:
+
+    LiveData( const Level& level, D& data )
+      : m_level( level ), m_data( data ) {}
+
+    void update( const P& point, base_type distSq )
+    {
+      if ( m_level.live( point ) )
+        m_data.update( point, distSq );
+    }
+
+    void updateBulk( const P* points, const base_type* distancesSq, unsigned int count )
+    {
+      if ( ! m_level.removedCount )
+      {
+        m_data.updateBulk( points, distancesSq, count );
+        return;
+      }
+
+      // Hand on each run of live points in one go
+      const unsigned char* removed = &m_level.removed[ points - m_level.tree->points() ];
+      unsigned int i = 0;
+
+      while ( i < count )
+      {
+        while ( i < count && removed[ i ] )
+          ++i;
+
+        unsigned int first = i;
+
+        while ( i < count && ! removed[ i ] )
+          ++i;
+
+        if ( i > first )
+          m_data.updateBulk( points + first, distancesSq + first, i - first );
+      }
+    }
+
+    bool incomplete() const { return m_data.incomplete(); }
+
+    base_type maxDistanceSq() const { return m_data.maxDistanceSq(); }
+
+  private:
+
+    const Level& m_level;
+    D& m_data;
+  };
+
+  //! Passes on the points of one level which have not been removed to a box visitor
+  template< typename V >
+  class LiveVisitor
+  {
+  public:
+
+    LiveVisitor( const Level& level, V& visitor )
+      : m_level( level ), m_visitor( visitor ), m_stopped( false ) {}
+
+    bool operator()( const P& point )
+    {
+      if ( m_level.live( point ) && ! m_visitor( point ) )
+        m_stopped = true;
+
+      return ! m_stopped;
+    }
+
+    bool stopped() const { return m_stopped; }
+
+  private:
+
+    const Level& m_level;
+    V& m_visitor;
+    bool m_stopped;
+  };
+
+  //! Finds the first live point of a level inside a box
+  class FindVisitor
+  {
+  public:
+
+    FindVisitor( const Level& level )
+      : m_level( level ), m_index( ~0u ) {}
+
+    bool operator()( const P& point )
+    {
+      if ( ! m_level.live( point ) )
+        return true;
+
+      m_index = &point - m_level.tree->points();
+      return false;
+    }
+
+    unsigned int index() const { return m_index; }
+
+  private:
+
+    const Level& m_level;
+    unsigned int m_index;
+  };
+
+  //! Appends the live points of a level to points and empties it
+  void take( Level& level, std::vector< P >& points );
+
+  //! Builds a level's Tree from points, which must fit
+  void build( Level& level, const std::vector< P >& points );
+
+  static unsigned int capacity( unsigned int level )
+  {
+    return level < 32 ? 1u << level : ~0u;
+  }
+
+  TreeFactory m_factory;
+  const M m_metric;
+
+  std::vector< Level > m_levels;
+
+  unsigned int m_size;
+};
+
+
+template< typename P, unsigned int DIM, typename M >
+void Forest< P, DIM, M >::insert( const std::vector< P >& points )
+{
+  if ( points.empty() )
+    return;
+
+  std::vector< P > carry( points );
+  m_size += points.size();
+
+  for ( unsigned int i=0; ; ++i )
+  {
+    if ( i == m_levels.size() )
+      m_levels.push_back( Level() );
+
+    Level& level = m_levels[ i ];
+
+    if ( level.tree )
+      take( level, carry );
+
+    if ( carry.size() <= capacity( i ) )
+    {
+      build( level, carry );
+      return;
+    }
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+bool Forest< P, DIM, M >::remove( const P& point )
+{
+  const Bounds< P, DIM > box( point, point );
+
+  for ( unsigned int i=0; i<m_levels.size(); ++i )
+  {
+    Level& level = m_levels[ i ];
+
+    if ( ! level.tree )
+      continue;
+
+    FindVisitor visitor( level );
+    level.tree->withinBox( box, visitor );
+
+    if ( visitor.index() == ~0u )
+      continue;
+
+    if ( level.removed.empty() )
+      level.removed.resize( level.tree->size(), 0 );
+
+    level.removed[ visitor.index() ] = 1;
+    ++level.removedCount;
+    --m_size;
+
+    // Rebuilding from fewer points always fits back in the same level
+    if ( 2 * level.removedCount > level.tree->size() )
+    {
+      std::vector< P > live;
+      take( level, live );
+
+      if ( ! live.empty() )
+        build( level, live );
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+void Forest< P, DIM, M >::compact()
+{
+  std::vector< P > points;
+  points.reserve( m_size );
+
+  for ( unsigned int i=0; i<m_levels.size(); ++i )
+  {
+    if ( m_levels[ i ].tree )
+      take( m_levels[ i ], points );
+  }
+
+  m_size = 0;
+  insert( points );
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+unsigned int Forest< P, DIM, M >::trees() const
+{
+  unsigned int count = 0;
+
+  for ( unsigned int i=0; i<m_levels.size(); ++i )
+  {
+    if ( m_levels[ i ].tree )
+      ++count;
+  }
+
+  return count;
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+template< typename D >
+void Forest< P, DIM, M >::search( const P& target, D& data ) const
+{
+  // Largest first, as it is the most likely to hold the nearest points and
+  // so give the smaller Trees a tight radius to work with
+  for ( unsigned int i=m_levels.size(); i-- > 0; )
+  {
+    const Level& level = m_levels[ i ];
+
+    if ( ! level.tree )
+      continue;
+
+    // A search always reaches one leaf, so skip Trees which can not help
+    const Bounds< P, DIM >& bounds = level.tree->bounds();
+    base_type cellDistanceSq( 0 );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      const base_type offset = target[ d ] < bounds.min()[ d ] ? target[ d ] - bounds.min()[ d ]
+        : target[ d ] > bounds.max()[ d ] ? target[ d ] - bounds.max()[ d ]
+        : base_type( 0 );
+
+      m_metric.combine( cellDistanceSq, m_metric.cellTerm( d, target[ d ], offset ) );
+    }
+
+    if ( ! data.incomplete() && cellDistanceSq >= data.maxDistanceSq() )
+      continue;
+
+    LiveData< D > live( level, data );
+    level.tree->search( target, live, level.tree->bounds() );
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+template< typename V >
+void Forest< P, DIM, M >::withinBox( const Bounds< P, DIM >& box, V& visitor ) const
+{
+  for ( unsigned int i=m_levels.size(); i-- > 0; )
+  {
+    const Level& level = m_levels[ i ];
+
+    if ( ! level.tree )
+      continue;
+
+    LiveVisitor< V > live( level, visitor );
+    level.tree->withinBox( box, live );
+
+    if ( live.stopped() )
+      return;
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+void Forest< P, DIM, M >::take( Level& level, std::vector< P >& points )
+{
+  const P* treePoints = level.tree->points();
+
+  for ( unsigned int i=0; i<level.tree->size(); ++i )
+  {
+    if ( level.live( treePoints[ i ] ) )
+      points.push_back( treePoints[ i ] );
+  }
+
+  delete level.tree;
+  level = Level();
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+void Forest< P, DIM, M >::build( Level& level, const std::vector< P >& points )
+{
+  level.tree = m_factory.create< P, DIM >( points, m_metric );
+}
+
+
+}; // namespace kd
+
+#endif // FOREST
@@ -0,0 +1,547 @@
+#ifndef JOIN
+#define JOIN
+
+#include "Tree.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <limits>
+
+namespace kd
+{
+
+/*! \brief Finds the nearest neighbours of every point of one Tree among the points of another
+ *
+ *  Rather than searching the reference tree once per query point, the join
+ *  walks both trees together ( Gray and Moore's dual-tree algorithm ). Each
+ *  step pairs a query node with a reference node and is skipped when the
+ *  two nodes' bounding boxes are further apart than the largest k-th
+ *  distance found so far for any point under the query node, so one
+ *  comparison can rule out a reference subtree for a whole block of
+ *  queries. The reference node is split while it is much wider than the
+ *  query node, nearer child first, and the query node otherwise.
+ *
+ *  A leaf's queries are spread out compared to their neighbours in more
+ *  than a couple of dimensions, so a pair of leaves is a poor bound. Once
+ *  the query node is a leaf each of its points instead descends the
+ *  reference node on its own, as a single tree search would, but starting
+ *  from that node with the distance bounds of the points before it close
+ *  by.
+ *
+ *  The boxes are the tight bounds of the points under each node, worked
+ *  out once when the join is made. Subtrees of the query tree are joined in
+ *  parallel, each against the whole reference tree, see setGrain.
+ *
+ *  Both trees must use the same metric, the reference tree's is used to
+ *  measure distances. Trees with quantized leaves, see LeafPrecision, are
+ *  joined over exact coordinates copied out of their points for as long as
+ *  the join lasts, so their distances are exact too.
+ */
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+class NeighbourJoin
+{
+public:
+
+  typedef typename P::base_type base_type;
+
+  /*! \brief Join queries against references
+   *
+   *  When excludeSelf is true the trees must be the same and each point is
+   *  left out of its own neighbours, other points at the same position are
+   *  still found.
+   */
+  NeighbourJoin( const Tree< P, DIM, M, IQ >& queries, const Tree< P, DIM, M, IR >& references, bool excludeSelf = false );
+
+  /*! \brief Find the "num" nearest references to every query
+   *
+   *  The neighbours of queries.points()[ i ] are written nearest first from
+   *  neighbours[ i * num ] onwards and their distances to the same positions
+   *  of distancesSq, which may be null. When fewer than num references are
+   *  found the remaining entries are left untouched.
+   */
+  void nearestNeighbours( unsigned int num, IR* neighbours, base_type* distancesSq, ThreadPool& pool );
+
+  //! Query subtrees with more points than this are split between tasks by default
+  static const unsigned int DEFAULT_GRAIN = 4096;
+
+  //! Set the most query points joined by one task, smaller grains spread the work finer
+  void setGrain( unsigned int points ) { m_grain = points ? points : 1; }
+
+private:
+
+  // Joins refer to the trees they are given so are not copied
+  NeighbourJoin( const NeighbourJoin& );
+  NeighbourJoin& operator=( const NeighbourJoin& );
+
+  /*! \brief Tight bounding box of the points under each node of a tree
+   */
+  struct NodeBoxes
+  {
+    //! Boxes of the nodes of tree, whose leaves' points are laid out in coordinates
+    template< typename I >
+    void create( const Tree< P, DIM, M, I >& tree, const base_type* coordinates );
+
+    const base_type* low( unsigned int node ) const { return &lows[ node * DIM ]; }
+    const base_type* high( unsigned int node ) const { return &highs[ node * DIM ]; }
+
+    std::vector< base_type > lows;
+    std::vector< base_type > highs;
+
+    //! Longest side of each box
+    std::vector< base_type > extents;
+
+    //! Number of points under each node
+    std::vector< unsigned int > counts;
+  };
+
+  //! The reference node is split rather than the query node while it is this many times wider
+  static const unsigned int REFERENCE_SPLIT_RATIO = 4;
+
+  /*! \brief Joins one query subtree against the whole reference tree
+   */
+  class JoinTask : public Task
+  {
+  public:
+
+    JoinTask( NeighbourJoin& join, unsigned int query ) : m_join( join ), m_query( query ) {}
+
+    void run();
+
+  private:
+
+    NeighbourJoin& m_join;
+    const unsigned int m_query;
+
+    //! The query being searched for by descend and its position in the query tree
+    base_type m_target[ DIM ];
+    unsigned int m_position;
+
+    //! Its best distances and reference positions so far
+    base_type* m_bestDistances;
+    unsigned int* m_bestPositions;
+
+    //! Offsets from the current reference cell to the query along each axis
+    base_type m_offsets[ DIM ];
+
+    //! Distances from the query to the points of a reference leaf
+    std::vector< base_type > m_distances;
+
+    //! Join a query node with a reference node which could improve it
+    void traverse( unsigned int query, unsigned int reference );
+
+    //! Search the reference node for each point of a query leaf
+    void queryLeaf( unsigned int query, unsigned int reference );
+
+    //! Search below a reference node a distance from the query, see Tree::searchDepthFirst
+    void descend( unsigned int reference, base_type distance );
+  };
+
+  //! Lower bound on the distance between a point under one node and a point under the other
+  base_type boxDistance( unsigned int query, unsigned int reference ) const
+  {
+    const base_type* queryLow = m_queryBoxes->low( query );
+    const base_type* queryHigh = m_queryBoxes->high( query );
+    const base_type* referenceLow = m_referenceBoxes.low( reference );
+    const base_type* referenceHigh = m_referenceBoxes.high( reference );
+
+    base_type distance( 0 );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      m_metric.combine( distance, m_metric.boxTerm( d, queryLow[ d ], queryHigh[ d ], referenceLow[ d ], referenceHigh[ d ] ) );
+    }
+
+    return distance;
+  }
+
+  //! Queues tasks for the subtrees of query small enough to join on one thread
+  void split( TaskGroup& group, unsigned int query );
+
+  //! Coordinates of a tree's leaves, copied into copy from its points should its leaves be quantized
+  static const base_type* exactCoordinates( const Tree< P, DIM, M, P >& tree, std::vector< base_type >& copy )
+  {
+    if ( tree.coordinates() )
+      return tree.coordinates();
+
+    copy.resize( size_t( tree.size() ) * DIM );
+    Tree< P, DIM, M, P >::createCoordinates( tree.nodes(), tree.nodeCount(), tree.points(), copy.data(), PointAccess< P >() );
+
+    return copy.data();
+  }
+
+  //! Index trees are never quantized
+  template< typename I >
+  static const base_type* exactCoordinates( const Tree< P, DIM, M, I >& tree, std::vector< base_type >& )
+  {
+    return tree.coordinates();
+  }
+
+  const Tree< P, DIM, M, IQ >& m_queries;
+  const Tree< P, DIM, M, IR >& m_references;
+  const M& m_metric;
+  const bool m_excludeSelf;
+
+  //! Exact coordinates of the leaves of each tree, owned here for quantized ones
+  std::vector< base_type > m_ownReferenceCoordinates;
+  std::vector< base_type > m_ownQueryCoordinates;
+  const base_type* m_referenceCoordinates;
+  const base_type* m_queryCoordinates;
+
+  NodeBoxes m_referenceBoxes;
+  NodeBoxes m_ownQueryBoxes;
+
+  //! The query boxes, which are the reference boxes in a self join
+  const NodeBoxes* m_queryBoxes;
+
+  unsigned int m_num;
+  unsigned int m_grain;
+
+  //! The num best distances and reference positions of each query, nearest first
+  std::vector< base_type > m_bestDistances;
+  std::vector< unsigned int > m_bestPositions;
+
+  //! Largest num-th best distance of the queries under each query node
+  std::vector< base_type > m_bounds;
+};
+
+
+/*! \brief Find the "num" nearest points of references to every point of queries
+ *
+ *  See NeighbourJoin::nearestNeighbours for the layout of the results.
+ */
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void nearestNeighbourJoin(
+    const Tree< P, DIM, M, IQ >& queries,
+    const Tree< P, DIM, M, IR >& references,
+    unsigned int num,
+    IR* neighbours,
+    typename P::base_type* distancesSq,
+    ThreadPool& pool
+    )
+{
+  NeighbourJoin< P, DIM, M, IQ, IR > join( queries, references );
+  join.nearestNeighbours( num, neighbours, distancesSq, pool );
+}
+
+
+/*! \brief Find the "num" nearest other points of the tree to each of its points
+ *
+ *  A point is not its own neighbour. See NeighbourJoin::nearestNeighbours
+ *  for the layout of the results.
+ */
+template< typename P, unsigned int DIM, typename M, typename I >
+void allNearestNeighbours(
+    const Tree< P, DIM, M, I >& tree,
+    unsigned int num,
+    I* neighbours,
+    typename P::base_type* distancesSq,
+    ThreadPool& pool
+    )
+{
+  NeighbourJoin< P, DIM, M, I, I > join( tree, tree, true );
+  join.nearestNeighbours( num, neighbours, distancesSq, pool );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+NeighbourJoin< P, DIM, M, IQ, IR >::NeighbourJoin(
+    const Tree< P, DIM, M, IQ >& queries,
+    const Tree< P, DIM, M, IR >& references,
+    bool excludeSelf
+    )
+ : m_queries( queries ), m_references( references ), m_metric( references.metric() ),
+   m_excludeSelf( excludeSelf ), m_queryBoxes( &m_referenceBoxes ), m_num( 0 ), m_grain( DEFAULT_GRAIN )
+{
+  m_referenceCoordinates = exactCoordinates( references, m_ownReferenceCoordinates );
+  m_queryCoordinates = m_referenceCoordinates;
+  m_referenceBoxes.create( references, m_referenceCoordinates );
+
+  if ( ! excludeSelf )
+  {
+    m_queryCoordinates = exactCoordinates( queries, m_ownQueryCoordinates );
+    m_ownQueryBoxes.create( queries, m_queryCoordinates );
+    m_queryBoxes = &m_ownQueryBoxes;
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+template< typename I >
+void NeighbourJoin< P, DIM, M, IQ, IR >::NodeBoxes::create( const Tree< P, DIM, M, I >& tree, const base_type* coordinates )
+{
+  const unsigned int nodeCount = tree.nodeCount();
+  const Node< P >* nodes = tree.nodes();
+
+  lows.resize( nodeCount * DIM );
+  highs.resize( nodeCount * DIM );
+  extents.resize( nodeCount );
+  counts.resize( nodeCount );
+
+  // Children always follow their parent, so going backwards meets them first
+  for ( unsigned int i=nodeCount; i-- > 0; )
+  {
+    const Node< P >& node = nodes[ i ];
+    base_type* low = &lows[ i * DIM ];
+    base_type* high = &highs[ i * DIM ];
+
+    if ( node.leaf() )
+    {
+      const base_type* block = &coordinates[ node.first * DIM ];
+
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        low[ d ] = std::numeric_limits< base_type >::max();
+        high[ d ] = std::numeric_limits< base_type >::lowest();
+
+        for ( unsigned int j=0; j<node.count; ++j )
+        {
+          const base_type value = block[ d * node.count + j ];
+          low[ d ] = value < low[ d ] ? value : low[ d ];
+          high[ d ] = value > high[ d ] ? value : high[ d ];
+        }
+      }
+
+      counts[ i ] = node.count;
+    }
+    else
+    {
+      const unsigned int lower = i + 1;
+      const unsigned int upper = i + node.right;
+
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        low[ d ] = lows[ lower * DIM + d ] < lows[ upper * DIM + d ] ? lows[ lower * DIM + d ] : lows[ upper * DIM + d ];
+        high[ d ] = highs[ lower * DIM + d ] > highs[ upper * DIM + d ] ? highs[ lower * DIM + d ] : highs[ upper * DIM + d ];
+      }
+
+      counts[ i ] = counts[ lower ] + counts[ upper ];
+    }
+
+    extents[ i ] = 0;
+
+    for ( unsigned int d=0; d<DIM && counts[ i ]; ++d )
+    {
+      extents[ i ] = high[ d ] - low[ d ] > extents[ i ] ? high[ d ] - low[ d ] : extents[ i ];
+    }
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::nearestNeighbours(
+    unsigned int num,
+    IR* neighbours,
+    base_type* distancesSq,
+    ThreadPool& pool
+    )
+{
+  if ( num == 0 || m_queries.size() == 0 || m_references.size() == 0 )
+    return;
+
+  m_num = num;
+  m_bestDistances.assign( size_t( m_queries.size() ) * num, std::numeric_limits< base_type >::max() );
+  m_bestPositions.assign( size_t( m_queries.size() ) * num, ~0u );
+  m_bounds.assign( m_queries.nodeCount(), std::numeric_limits< base_type >::max() );
+
+  TaskGroup group( pool );
+  split( group, 0 );
+  group.wait();
+
+  const IR* points = m_references.points();
+
+  for ( size_t i=0; i<m_bestPositions.size(); ++i )
+  {
+    if ( m_bestPositions[ i ] == ~0u )
+      continue;
+
+    neighbours[ i ] = points[ m_bestPositions[ i ] ];
+    if ( distancesSq )
+      distancesSq[ i ] = m_bestDistances[ i ];
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::split( TaskGroup& group, unsigned int query )
+{
+  const Node< P >& node = m_queries.nodes()[ query ];
+
+  if ( node.leaf() || m_queryBoxes->counts[ query ] <= m_grain )
+  {
+    group.run( new JoinTask( *this, query ) );
+    return;
+  }
+
+  split( group, query + 1 );
+  split( group, query + node.right );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::JoinTask::run()
+{
+  traverse( m_query, 0 );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::JoinTask::traverse( unsigned int query, unsigned int reference )
+{
+  const Node< P >& queryNode = m_join.m_queries.nodes()[ query ];
+  const Node< P >& referenceNode = m_join.m_references.nodes()[ reference ];
+
+  if ( queryNode.leaf() )
+  {
+    queryLeaf( query, reference );
+    return;
+  }
+
+  std::vector< base_type >& bounds = m_join.m_bounds;
+
+  if ( ! referenceNode.leaf()
+      && m_join.m_referenceBoxes.extents[ reference ] > REFERENCE_SPLIT_RATIO * m_join.m_queryBoxes->extents[ query ] )
+  {
+    // Nearer child first so it tightens the bound
+    unsigned int near = reference + 1;
+    unsigned int far = reference + referenceNode.right;
+    base_type nearDistance = m_join.boxDistance( query, near );
+    base_type farDistance = m_join.boxDistance( query, far );
+
+    if ( farDistance < nearDistance )
+    {
+      std::swap( near, far );
+      std::swap( nearDistance, farDistance );
+    }
+
+    if ( nearDistance < bounds[ query ] )
+      traverse( query, near );
+
+    if ( farDistance < bounds[ query ] )
+      traverse( query, far );
+
+    return;
+  }
+
+  // Each child of the query node keeps its own bound
+  const unsigned int lower = query + 1;
+  const unsigned int upper = query + queryNode.right;
+
+  if ( m_join.boxDistance( lower, reference ) < bounds[ lower ] )
+    traverse( lower, reference );
+
+  if ( m_join.boxDistance( upper, reference ) < bounds[ upper ] )
+    traverse( upper, reference );
+
+  bounds[ query ] = bounds[ lower ] > bounds[ upper ] ? bounds[ lower ] : bounds[ upper ];
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::JoinTask::queryLeaf( unsigned int query, unsigned int reference )
+{
+  const Node< P >& queryNode = m_join.m_queries.nodes()[ query ];
+
+  const base_type* queryBlock = &m_join.m_queryCoordinates[ queryNode.first * DIM ];
+  const base_type* referenceLow = m_join.m_referenceBoxes.low( reference );
+  const base_type* referenceHigh = m_join.m_referenceBoxes.high( reference );
+
+  const M& metric = m_join.m_metric;
+  const unsigned int num = m_join.m_num;
+
+  base_type bound( 0 );
+
+  for ( unsigned int j=0; j<queryNode.count; ++j )
+  {
+    m_position = queryNode.first + j;
+    m_bestDistances = &m_join.m_bestDistances[ size_t( m_position ) * num ];
+    m_bestPositions = &m_join.m_bestPositions[ size_t( m_position ) * num ];
+
+    base_type distance( 0 );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      m_target[ d ] = queryBlock[ d * queryNode.count + j ];
+
+      m_offsets[ d ] = m_target[ d ] < referenceLow[ d ] ? m_target[ d ] - referenceLow[ d ]
+        : m_target[ d ] > referenceHigh[ d ] ? m_target[ d ] - referenceHigh[ d ]
+        : base_type( 0 );
+
+      metric.combine( distance, metric.cellTerm( d, m_target[ d ], m_offsets[ d ] ) );
+    }
+
+    // The node as a whole was close enough, this query may not be
+    if ( distance < m_bestDistances[ num - 1 ] )
+      descend( reference, distance );
+
+    bound = m_bestDistances[ num - 1 ] > bound ? m_bestDistances[ num - 1 ] : bound;
+  }
+
+  m_join.m_bounds[ query ] = bound;
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename IQ, typename IR >
+void NeighbourJoin< P, DIM, M, IQ, IR >::JoinTask::descend( unsigned int reference, base_type distance )
+{
+  const Node< P >& node = m_join.m_references.nodes()[ reference ];
+
+  const M& metric = m_join.m_metric;
+  const unsigned int num = m_join.m_num;
+
+  if ( node.leaf() )
+  {
+    if ( m_distances.size() < node.count )
+      m_distances.resize( node.count );
+
+    metric.distances( &m_join.m_referenceCoordinates[ node.first * DIM ], node.count, m_target, DIM, &m_distances[ 0 ] );
+
+    for ( unsigned int i=0; i<node.count; ++i )
+    {
+      const base_type distanceSq = m_distances[ i ];
+
+      if ( distanceSq >= m_bestDistances[ num - 1 ] )
+        continue;
+
+      if ( m_join.m_excludeSelf && node.first + i == m_position )
+        continue;
+
+      unsigned int k = num - 1;
+      for ( ; k > 0 && m_bestDistances[ k - 1 ] > distanceSq; --k )
+      {
+        m_bestDistances[ k ] = m_bestDistances[ k - 1 ];
+        m_bestPositions[ k ] = m_bestPositions[ k - 1 ];
+      }
+
+      m_bestDistances[ k ] = distanceSq;
+      m_bestPositions[ k ] = node.first + i;
+    }
+
+    return;
+  }
+
+  // The offsets start from the tight box of the node the descent began at
+  // and crossing a split only changes the one along its axis
+  const unsigned int dim = node.dim;
+  const bool inLeft = m_target[ dim ] <= node.split;
+  const unsigned int nearNode = inLeft ? reference + 1 : reference + node.right;
+  const unsigned int farNode = inLeft ? reference + node.right : reference + 1;
+
+  const base_type farOffset = m_target[ dim ] - node.split;
+  const base_type farDistance = metric.replace( distance,
+      metric.cellTerm( dim, m_target[ dim ], m_offsets[ dim ] ), metric.cellTerm( dim, m_target[ dim ], farOffset ) );
+
+  descend( nearNode, distance );
+
+  if ( farDistance < m_bestDistances[ num - 1 ] )
+  {
+    const base_type offset = m_offsets[ dim ];
+    m_offsets[ dim ] = farOffset;
+    descend( farNode, farDistance );
+    m_offsets[ dim ] = offset;
+  }
+}
+
+
+}; // namespace kd
+
+#endif // JOIN
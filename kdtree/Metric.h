@@ -0,0 +1,579 @@
+#ifndef METRIC
+#define METRIC
+
+#include "Simd.h"
+
+#include <string.h>
+
+namespace kd
+{
+
+/*! \brief Distance policies for Tree
+ *
+ *  A metric is a template parameter of Tree, so all of its arithmetic is
+ *  inlined into the search. Distances are only ever compared with each
+ *  other, so a metric can use any monotonic function of the true distance
+ *  which is cheaper to work out, the Euclidean metrics work in squared
+ *  distances. Every distance a Data sees, which the Data classes call
+ *  distSq, is in the metric's units.
+ *
+ *  Each metric provides:
+ *
+ *  - term( dim, sep, out ): the contribution of a separation along axis dim,
+ *    written for both scalars and the SIMD vectors the kernels work on.
+ *  - combine( distance, term ): adds a term to a distance.
+ *  - cellTerm( dim, target, offset ): a lower bound on term for the points
+ *    of a cell offset from target by offset along dim.
+ *  - farthestTerm( dim, target, low, high ): an upper bound on term for the
+ *    points between low and high along dim.
+ *  - boxTerm( dim, lowA, highA, lowB, highB ): a lower bound on term between
+ *    any point between lowA and highA and any between lowB and highB along
+ *    dim, which dual-tree searches use to compare two cells.
+ *  - intervalTerm( dim, below, above, out ): a lower bound on term for any
+ *    separation between below and above, for scalars and SIMD vectors, which
+ *    quantized leaves use to bound the distance to a point's code box.
+ *  - replace( distance, oldTerm, newTerm ): updates a cell distance when
+ *    the offset along one axis grows from that of oldTerm to that of newTerm.
+ *  - fromLength( length ): the distance for a separation of length, used to
+ *    turn radii into distances.
+ *  - approximation( epsilon ): the factor a distance grows by when the
+ *    separation grows by ( 1 + epsilon ).
+ *  - distances( block, count, target, dims, distances ): the distances to a
+ *    structure-of-arrays bucket, see distanceSqScalar.
+ *  - setSimdLevel( level ): picks the kernel distances uses.
+ */
+
+
+//! Distance between two points under a metric
+template< typename M, typename P >
+typename P::base_type pointDistance( const M& metric, const P& a, const P& b, unsigned int dims )
+{
+  typedef typename P::base_type T;
+
+  T distance;
+  metric.term( 0, T( a[ 0 ] - b[ 0 ] ), distance );
+
+  for ( unsigned int d=1; d<dims; ++d )
+  {
+    T term;
+    metric.term( d, T( a[ d ] - b[ d ] ), term );
+    metric.combine( distance, term );
+  }
+
+  return distance;
+}
+
+
+/*! \brief Distances to the points from "first" on of a bucket, "width" at a time
+ *
+ *  X is either the coordinate type itself or a vector of them. Returns the
+ *  index of the first point not done, as the last few points may not fill
+ *  a vector.
+ */
+template< typename X, typename T, typename M >
+__attribute__(( always_inline ))
+inline unsigned int metricDistances(
+    const M& metric,
+    const T* block,
+    unsigned int count,
+    unsigned int first,
+    const T* target,
+    unsigned int dims,
+    T* distances
+    )
+{
+  const unsigned int width = sizeof( X ) / sizeof( T );
+  unsigned int j = first;
+
+  for ( ; j + width <= count; j += width )
+  {
+    X coords;
+    memcpy( &coords, block + j, sizeof( X ) );
+
+    X distance;
+    metric.term( 0, X( coords - target[ 0 ] ), distance );
+
+    for ( unsigned int d=1; d<dims; ++d )
+    {
+      memcpy( &coords, block + d * count + j, sizeof( X ) );
+
+      X term;
+      metric.term( d, X( coords - target[ d ] ), term );
+      metric.combine( distance, term );
+    }
+
+    memcpy( distances + j, &distance, sizeof( X ) );
+  }
+
+  return j;
+}
+
+
+#ifdef KD_SIMD_X86
+
+//! Vector of T filling BYTES bytes, using the compiler's generic vectors
+template< typename T, unsigned int BYTES >
+struct SimdVector
+{
+  typedef T Type __attribute__(( vector_size( BYTES ) ));
+};
+
+#endif // KD_SIMD_X86
+
+
+/*! \brief Distance kernels for a metric, one for each instruction set
+ *
+ *  The kernels are all the same code, written once in metricDistances in
+ *  terms of the metric's term and combine, and compiled for vectors of each
+ *  instruction set's width.
+ */
+template< typename M, typename T >
+struct MetricKernel
+{
+  typedef void (*Function)( const M& metric, const T* block, unsigned int count, const T* target, unsigned int dims, T* distances );
+
+  static void scalar( const M& metric, const T* block, unsigned int count, const T* target, unsigned int dims, T* distances )
+  {
+    metricDistances< T >( metric, block, count, 0, target, dims, distances );
+  }
+
+#ifdef KD_SIMD_X86
+
+  __attribute__(( target( "sse2" ) ))
+  static void sse( const M& metric, const T* block, unsigned int count, const T* target, unsigned int dims, T* distances )
+  {
+    unsigned int j = metricDistances< typename SimdVector< T, 16 >::Type >( metric, block, count, 0, target, dims, distances );
+    metricDistances< T >( metric, block, count, j, target, dims, distances );
+  }
+
+  __attribute__(( target( "avx2,fma" ) ))
+  static void avx2( const M& metric, const T* block, unsigned int count, const T* target, unsigned int dims, T* distances )
+  {
+    unsigned int j = metricDistances< typename SimdVector< T, 32 >::Type >( metric, block, count, 0, target, dims, distances );
+    metricDistances< T >( metric, block, count, j, target, dims, distances );
+  }
+
+  __attribute__(( target( "avx512f" ) ))
+  static void avx512( const M& metric, const T* block, unsigned int count, const T* target, unsigned int dims, T* distances )
+  {
+    unsigned int j = metricDistances< typename SimdVector< T, 64 >::Type >( metric, block, count, 0, target, dims, distances );
+    metricDistances< T >( metric, block, count, j, target, dims, distances );
+  }
+
+#endif // KD_SIMD_X86
+
+  static Function select( SimdLevel level )
+  {
+#ifdef KD_SIMD_X86
+    if ( level > detectSimdLevel() )
+      level = detectSimdLevel();
+
+    switch ( level )
+    {
+      case SIMD_AVX512: return &avx512;
+      case SIMD_AVX2: return &avx2;
+      case SIMD_SSE: return &sse;
+      default: return &scalar;
+    }
+#else
+    return &scalar;
+#endif
+  }
+};
+
+
+//! Absolute value of a scalar or vector, written to out as vectors are not returned across calls
+template< typename X >
+__attribute__(( always_inline ))
+inline void absolute( const X& x, X& out )
+{
+  out = x < 0 ? -x : x;
+}
+
+template< typename T >
+inline T absolute( T x )
+{
+  return x < 0 ? -x : x;
+}
+
+//! Largest separation from target of a coordinate between low and high
+template< typename T >
+inline T farthestSeparation( T target, T low, T high )
+{
+  return absolute( target - low ) > absolute( high - target ) ? absolute( target - low ) : absolute( high - target );
+}
+
+//! Smallest separation between a coordinate in [ lowA, highA ] and one in [ lowB, highB ]
+template< typename T >
+inline T boxSeparation( T lowA, T highA, T lowB, T highB )
+{
+  return lowB > highA ? lowB - highA : lowA > highB ? lowA - highB : T( 0 );
+}
+
+//! Smallest term of metric for a separation between below and above, for terms growing with the separation
+template< typename M, typename X >
+__attribute__(( always_inline ))
+inline void nearestEndTerm( const M& metric, unsigned int dim, const X& below, const X& above, X& out )
+{
+  X belowTerm, aboveTerm;
+  metric.term( dim, below, belowTerm );
+  metric.term( dim, above, aboveTerm );
+
+  out = belowTerm < aboveTerm ? belowTerm : aboveTerm;
+  out = below * above <= 0 ? 0 : out;
+}
+
+
+/*! \brief Squared Euclidean distance, the default metric
+ *
+ *  Uses the hand written kernels of DistanceKernel.
+ */
+template< typename T >
+class EuclideanMetric
+{
+public:
+
+  EuclideanMetric() { setSimdLevel( detectSimdLevel() ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void term( unsigned int, const X& sep, X& out ) const { out = sep * sep; }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void intervalTerm( unsigned int dim, const X& below, const X& above, X& out ) const { nearestEndTerm( *this, dim, below, above, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  static void combine( X& distance, const X& term ) { distance += term; }
+
+  T cellTerm( unsigned int, T, T offset ) const { return offset * offset; }
+
+  T farthestTerm( unsigned int, T target, T low, T high ) const
+  {
+    const T sep = farthestSeparation( target, low, high );
+    return sep * sep;
+  }
+
+  T boxTerm( unsigned int, T lowA, T highA, T lowB, T highB ) const
+  {
+    const T sep = boxSeparation( lowA, highA, lowB, highB );
+    return sep * sep;
+  }
+
+  static T replace( T distance, T oldTerm, T newTerm ) { return distance - oldTerm + newTerm; }
+
+  T fromLength( T length ) const { return length * length; }
+
+  T approximation( double epsilon ) const { return T( ( 1.0 + epsilon ) * ( 1.0 + epsilon ) ); }
+
+  void setSimdLevel( SimdLevel level ) { m_kernel = DistanceKernel< T >::select( level ); }
+
+  void distances( const T* block, unsigned int count, const T* target, unsigned int dims, T* distances ) const
+  {
+    m_kernel( block, count, target, dims, distances );
+  }
+
+private:
+
+  typename DistanceKernel< T >::Function m_kernel;
+};
+
+
+/*! \brief Manhattan ( L1 ) distance, the sum of the separations along each axis
+ */
+template< typename T >
+class ManhattanMetric
+{
+public:
+
+  ManhattanMetric() { setSimdLevel( detectSimdLevel() ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void term( unsigned int, const X& sep, X& out ) const { absolute( sep, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void intervalTerm( unsigned int dim, const X& below, const X& above, X& out ) const { nearestEndTerm( *this, dim, below, above, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  static void combine( X& distance, const X& term ) { distance += term; }
+
+  T cellTerm( unsigned int, T, T offset ) const { return absolute( offset ); }
+
+  T farthestTerm( unsigned int, T target, T low, T high ) const { return farthestSeparation( target, low, high ); }
+
+  T boxTerm( unsigned int, T lowA, T highA, T lowB, T highB ) const { return boxSeparation( lowA, highA, lowB, highB ); }
+
+  static T replace( T distance, T oldTerm, T newTerm ) { return distance - oldTerm + newTerm; }
+
+  T fromLength( T length ) const { return length; }
+
+  T approximation( double epsilon ) const { return T( 1.0 + epsilon ); }
+
+  void setSimdLevel( SimdLevel level ) { m_kernel = MetricKernel< ManhattanMetric, T >::select( level ); }
+
+  void distances( const T* block, unsigned int count, const T* target, unsigned int dims, T* distances ) const
+  {
+    m_kernel( *this, block, count, target, dims, distances );
+  }
+
+private:
+
+  typename MetricKernel< ManhattanMetric, T >::Function m_kernel;
+};
+
+
+/*! \brief Chebyshev ( L-infinity ) distance, the largest separation along any axis
+ *
+ *  The offset along an axis only grows as a search moves into smaller cells,
+ *  so a cell's distance can still be updated incrementally by taking the
+ *  larger of it and the new term.
+ */
+template< typename T >
+class ChebyshevMetric
+{
+public:
+
+  ChebyshevMetric() { setSimdLevel( detectSimdLevel() ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void term( unsigned int, const X& sep, X& out ) const { absolute( sep, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void intervalTerm( unsigned int dim, const X& below, const X& above, X& out ) const { nearestEndTerm( *this, dim, below, above, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  static void combine( X& distance, const X& term ) { distance = distance < term ? term : distance; }
+
+  T cellTerm( unsigned int, T, T offset ) const { return absolute( offset ); }
+
+  T farthestTerm( unsigned int, T target, T low, T high ) const { return farthestSeparation( target, low, high ); }
+
+  T boxTerm( unsigned int, T lowA, T highA, T lowB, T highB ) const { return boxSeparation( lowA, highA, lowB, highB ); }
+
+  static T replace( T distance, T, T newTerm ) { return distance < newTerm ? newTerm : distance; }
+
+  T fromLength( T length ) const { return length; }
+
+  T approximation( double epsilon ) const { return T( 1.0 + epsilon ); }
+
+  void setSimdLevel( SimdLevel level ) { m_kernel = MetricKernel< ChebyshevMetric, T >::select( level ); }
+
+  void distances( const T* block, unsigned int count, const T* target, unsigned int dims, T* distances ) const
+  {
+    m_kernel( *this, block, count, target, dims, distances );
+  }
+
+private:
+
+  typename MetricKernel< ChebyshevMetric, T >::Function m_kernel;
+};
+
+
+/*! \brief Squared Euclidean distance with each axis scaled by a weight
+ *
+ *  The weights multiply the squared separations so must not be negative.
+ */
+template< typename T, unsigned int DIM >
+class WeightedEuclideanMetric
+{
+public:
+
+  //! All weights one, the same as EuclideanMetric
+  WeightedEuclideanMetric()
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+      m_weights[ d ] = T( 1 );
+
+    setSimdLevel( detectSimdLevel() );
+  }
+
+  //! Weights for each of the DIM axes
+  WeightedEuclideanMetric( const T* weights )
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+      m_weights[ d ] = weights[ d ];
+
+    setSimdLevel( detectSimdLevel() );
+  }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void term( unsigned int dim, const X& sep, X& out ) const { out = sep * sep * m_weights[ dim ]; }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void intervalTerm( unsigned int dim, const X& below, const X& above, X& out ) const { nearestEndTerm( *this, dim, below, above, out ); }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  static void combine( X& distance, const X& term ) { distance += term; }
+
+  T cellTerm( unsigned int dim, T, T offset ) const { return offset * offset * m_weights[ dim ]; }
+
+  T farthestTerm( unsigned int dim, T target, T low, T high ) const
+  {
+    const T sep = farthestSeparation( target, low, high );
+    return sep * sep * m_weights[ dim ];
+  }
+
+  T boxTerm( unsigned int dim, T lowA, T highA, T lowB, T highB ) const
+  {
+    const T sep = boxSeparation( lowA, highA, lowB, highB );
+    return sep * sep * m_weights[ dim ];
+  }
+
+  static T replace( T distance, T oldTerm, T newTerm ) { return distance - oldTerm + newTerm; }
+
+  T fromLength( T length ) const { return length * length; }
+
+  T approximation( double epsilon ) const { return T( ( 1.0 + epsilon ) * ( 1.0 + epsilon ) ); }
+
+  void setSimdLevel( SimdLevel level ) { m_kernel = MetricKernel< WeightedEuclideanMetric, T >::select( level ); }
+
+  void distances( const T* block, unsigned int count, const T* target, unsigned int dims, T* distances ) const
+  {
+    m_kernel( *this, block, count, target, dims, distances );
+  }
+
+private:
+
+  T m_weights[ DIM ];
+  typename MetricKernel< WeightedEuclideanMetric, T >::Function m_kernel;
+};
+
+
+/*! \brief Squared Euclidean distance on a torus, each axis wrapping around
+ *
+ *  Axis d wraps at origin[ d ] + period[ d ] back to origin[ d ], and all
+ *  of the points and targets must lie in that range.
+ *
+ *  A search only knows a cell's offset from the target along each axis, not
+ *  where the cell's far side is, so the distance around the other way is
+ *  bounded by the distance to the edge of the range beyond the cell. That
+ *  is exact for the cells at the edges, which are the ones wrapping matters
+ *  for.
+ */
+template< typename T, unsigned int DIM >
+class PeriodicMetric
+{
+public:
+
+  //! Every axis wrapping from 1 back to 0
+  PeriodicMetric()
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      m_origin[ d ] = T( 0 );
+      m_period[ d ] = T( 1 );
+    }
+
+    setSimdLevel( detectSimdLevel() );
+  }
+
+  PeriodicMetric( const T* origin, const T* period )
+  {
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      m_origin[ d ] = origin[ d ];
+      m_period[ d ] = period[ d ];
+    }
+
+    setSimdLevel( detectSimdLevel() );
+  }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  void term( unsigned int dim, const X& sep, X& out ) const
+  {
+    X direct;
+    absolute( sep, direct );
+    const X around = m_period[ dim ] - direct;
+    const X shortest = direct < around ? direct : around;
+    out = shortest * shortest;
+  }
+
+  //! Nothing where the separations reach a whole period round, as well as none at all
+  template< typename X >
+  __attribute__(( always_inline ))
+  void intervalTerm( unsigned int dim, const X& below, const X& above, X& out ) const
+  {
+    const T period = m_period[ dim ];
+
+    nearestEndTerm( *this, dim, below, above, out );
+    out = ( below - period ) * ( above - period ) <= 0 ? 0 : out;
+    out = ( below + period ) * ( above + period ) <= 0 ? 0 : out;
+  }
+
+  template< typename X >
+  __attribute__(( always_inline ))
+  static void combine( X& distance, const X& term ) { distance += term; }
+
+  T cellTerm( unsigned int dim, T target, T offset ) const
+  {
+    if ( offset == T( 0 ) )
+      return T( 0 );
+
+    // Past the cell and on to the end of the range, then round from the other end
+    T around = offset > T( 0 ) ? m_origin[ dim ] + m_period[ dim ] - target : target - m_origin[ dim ];
+    if ( around < T( 0 ) )
+      around = T( 0 );
+
+    const T direct = absolute( offset );
+    const T shortest = direct < around ? direct : around;
+    return shortest * shortest;
+  }
+
+  //! No point is ever more than half way round
+  T farthestTerm( unsigned int dim, T target, T low, T high ) const
+  {
+    const T half = m_period[ dim ] / T( 2 );
+    const T sep = farthestSeparation( target, low, high );
+    const T shortest = sep < half ? sep : half;
+    return shortest * shortest;
+  }
+
+  //! Around the other way no pair is closer than the period less the span of both ranges
+  T boxTerm( unsigned int dim, T lowA, T highA, T lowB, T highB ) const
+  {
+    const T direct = boxSeparation( lowA, highA, lowB, highB );
+    const T span = ( highA > highB ? highA : highB ) - ( lowA < lowB ? lowA : lowB );
+
+    T around = m_period[ dim ] - span;
+    if ( around < T( 0 ) )
+      around = T( 0 );
+
+    const T shortest = direct < around ? direct : around;
+    return shortest * shortest;
+  }
+
+  static T replace( T distance, T oldTerm, T newTerm ) { return distance - oldTerm + newTerm; }
+
+  T fromLength( T length ) const { return length * length; }
+
+  T approximation( double epsilon ) const { return T( ( 1.0 + epsilon ) * ( 1.0 + epsilon ) ); }
+
+  void setSimdLevel( SimdLevel level ) { m_kernel = MetricKernel< PeriodicMetric, T >::select( level ); }
+
+  void distances( const T* block, unsigned int count, const T* target, unsigned int dims, T* distances ) const
+  {
+    m_kernel( *this, block, count, target, dims, distances );
+  }
+
+private:
+
+  T m_origin[ DIM ];
+  T m_period[ DIM ];
+  typename MetricKernel< PeriodicMetric, T >::Function m_kernel;
+};
+
+
+}; // namespace kd
+
+#endif // METRIC
@@ -0,0 +1,180 @@
+#ifndef MORTON
+#define MORTON
+
+#include "Bounds.h"
+#include "PointView.h"
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+namespace kd
+{
+
+/*! \brief Space-filling curves points can be ordered along, see curveOrder
+ */
+enum Curve
+{
+  //! Z-order, cheap to compute but with long jumps between some neighbouring codes
+  CURVE_MORTON = 0,
+
+  //! Hilbert order, whose neighbouring codes are always neighbouring cells
+  CURVE_HILBERT
+};
+
+
+/*! \brief Quantises each coordinate of point relative to bounds to a number of bits
+ *
+ *  Returns the bits per coordinate, chosen so all the coordinates fit in 64
+ *  bits. Points outside the bounds are clamped to them. With more than 64
+ *  dimensions only the first 64 are quantised.
+ */
+template< typename P, unsigned int DIM >
+unsigned int curveCell( const P& point, const Bounds< P, DIM >& bounds, unsigned int* cell )
+{
+  const unsigned int dims = DIM < 64 ? DIM : 64;
+  const unsigned int bits = 64 / dims < 21 ? 64 / dims : 21;
+  const double scale = double( ( 1u << bits ) - 1 );
+
+  for ( unsigned int i=0; i<dims; ++i )
+  {
+    double extent = double( bounds.max()[ i ] ) - double( bounds.min()[ i ] );
+    double t = extent > 0.0 ? ( double( point[ i ] ) - double( bounds.min()[ i ] ) ) / extent : 0.0;
+
+    if ( t < 0.0 ) t = 0.0;
+    if ( t > 1.0 ) t = 1.0;
+
+    cell[ i ] = (unsigned int)( t * scale );
+  }
+
+  return bits;
+}
+
+
+//! Interleaves the top bits of each of dims coordinates, the most significant first
+inline unsigned long long interleave( const unsigned int* cell, unsigned int dims, unsigned int bits )
+{
+  unsigned long long code = 0;
+
+  for ( unsigned int b=bits; b-- > 0; )
+  {
+    for ( unsigned int i=0; i<dims; ++i )
+    {
+      code = ( code << 1 ) | ( ( cell[ i ] >> b ) & 1u );
+    }
+  }
+
+  return code;
+}
+
+
+/*! \brief Position of a point along the Z-order curve through some Bounds
+ *
+ *  Each coordinate is quantised relative to the bounds and the bits of all
+ *  the coordinates are interleaved, so points which are close in space tend
+ *  to have close codes. Points outside the bounds are clamped to them. With
+ *  more than 64 dimensions only the first 64 contribute to the code.
+ */
+template< typename P, unsigned int DIM >
+unsigned long long mortonCode( const P& point, const Bounds< P, DIM >& bounds )
+{
+  unsigned int cell[ DIM < 64 ? DIM : 64 ];
+  const unsigned int bits = curveCell( point, bounds, cell );
+
+  return interleave( cell, DIM < 64 ? DIM : 64, bits );
+}
+
+
+/*! \brief Position of a point along the Hilbert curve through some Bounds
+ *
+ *  Quantised as for mortonCode. The cells are turned into the transposed
+ *  Hilbert index with Skilling's method, "Programming the Hilbert curve"
+ *  (2004), which interleaved as for the Z-order gives the code.
+ */
+template< typename P, unsigned int DIM >
+unsigned long long hilbertCode( const P& point, const Bounds< P, DIM >& bounds )
+{
+  const unsigned int dims = DIM < 64 ? DIM : 64;
+
+  unsigned int cell[ DIM < 64 ? DIM : 64 ];
+  const unsigned int bits = curveCell( point, bounds, cell );
+
+  // Undo the rotations and reflections of each level, from the top down
+  for ( unsigned int q=1u << ( bits - 1 ); q > 1; q >>= 1 )
+  {
+    const unsigned int p = q - 1;
+
+    for ( unsigned int i=0; i<dims; ++i )
+    {
+      if ( cell[ i ] & q )
+      {
+        cell[ 0 ] ^= p;
+      }
+      else
+      {
+        const unsigned int t = ( cell[ 0 ] ^ cell[ i ] ) & p;
+        cell[ 0 ] ^= t;
+        cell[ i ] ^= t;
+      }
+    }
+  }
+
+  // Gray encode
+  for ( unsigned int i=1; i<dims; ++i )
+    cell[ i ] ^= cell[ i - 1 ];
+
+  unsigned int t = 0;
+  for ( unsigned int q=1u << ( bits - 1 ); q > 1; q >>= 1 )
+  {
+    if ( cell[ dims - 1 ] & q )
+      t ^= q - 1;
+  }
+
+  for ( unsigned int i=0; i<dims; ++i )
+    cell[ i ] ^= t;
+
+  return interleave( cell, dims, bits );
+}
+
+
+//! Position of a point along curve through some Bounds
+template< typename P, unsigned int DIM >
+unsigned long long curveCode( Curve curve, const P& point, const Bounds< P, DIM >& bounds )
+{
+  return curve == CURVE_HILBERT ? hilbertCode( point, bounds ) : mortonCode( point, bounds );
+}
+
+
+/*! \brief Fills order with the indices of points sorted along curve through bounds
+ *
+ *  points[ order[ 0 ] ] comes first along the curve, so copying the points
+ *  in that order puts points which are close in space close in memory, and
+ *  order[ i ] maps what was found at position i back to the original
+ *  index. Queries run in this order share the parts of a tree in cache,
+ *  and an index tree built over points stored in this order reads them
+ *  with far fewer misses.
+ */
+template< typename P, unsigned int DIM, typename I >
+void curveOrder( const PointView< P >& points, const Bounds< P, DIM >& bounds, Curve curve, std::vector< I >& order )
+{
+  std::vector< std::pair< unsigned long long, I > > codes( points.size() );
+
+  for ( size_t i=0; i<points.size(); ++i )
+  {
+    codes[ i ] = std::make_pair( curveCode( curve, points[ i ], bounds ), I( i ) );
+  }
+
+  std::sort( codes.begin(), codes.end() );
+
+  order.resize( points.size() );
+
+  for ( size_t i=0; i<points.size(); ++i )
+  {
+    order[ i ] = codes[ i ].second;
+  }
+}
+
+
+}; // namespace kd
+
+#endif // MORTON
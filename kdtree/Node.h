@@ -1,155 +1,67 @@
 #ifndef NODE
 #define NODE
 
-#include "Measurer.h"
-#include "Bounds.h"
-#include "Data.h" 
-
 namespace kd
 {
 
-/*! \brief Base class defines searching interfaces
- */
-template< typename P, unsigned int DIM >
-class Node
-{
-public:
-  Node() {};
-  virtual ~Node() {};
-
-  virtual void search(
-      const P& point,
-      Data< P >& data,
-      const Bounds< P, DIM >& bounds
-      ) const = 0;
-
-};
-
-
-
-/*! \brief Represents branch points in the tree
+/*! \brief Compact node of a Tree stored in a flat array
+ *
+ *  Nodes are laid out in depth-first pre-order so the lower child of a split
+ *  node is always the next entry in the array and only the offset to the
+ *  upper child needs to be stored. Being relative, the offsets stay valid
+ *  when a subtree's nodes are copied into place as a block.
+ *
+ *  All of the points are held by leaves, each of which owns a bucket of
+ *  consecutive points in the tree's point array.
  */
-template< typename P, unsigned int DIM >
-class SplitNode : public Node< P, DIM >
+template< typename P >
+struct Node
 {
-public:
-  SplitNode(
-      const P& pivot,
-      unsigned int dim,
-      Node< P, DIM >* left,
-      Node< P, DIM >* right,
-      const Measurer& measurer,
-      const BoundsFactory& boundsFactory
-      )
-   : m_dim( dim ),
-     m_left( left ),
-     m_right( right ),
-     m_pivot( pivot ),
-     m_measurer( measurer ),
-     m_boundsFactory( boundsFactory )
-     {}
+  //! Value of dim for leaves
+  static const unsigned int LEAF = ~0u;
 
-  ~SplitNode()
+  //! Create a split node, its upper child offset is filled in later
+  static Node splitNode( typename P::base_type split, unsigned int dim )
   {
-    delete m_left;
-    delete m_right;
+    Node node;
+    node.split = split;
+    node.dim = dim;
+    node.right = 0;
+    node.count = 0;
+    return node;
   }
 
-  void search(
-      const P& target,
-      Data< P >& data,
-      const Bounds< P, DIM >& bounds
-      ) const
+  //! Create a leaf owning "count" points starting at "first"
+  static Node leafNode( unsigned int first, unsigned int count )
   {
-    // Add the node's pivot if necessary
-    typename P::base_type distanceSq = m_measurer.distanceSq< P, DIM >( m_pivot, target );
-    data.update( m_pivot, distanceSq );
-
-    // Split the bounds based on the node's pivot 
-    BoundsPair< P, DIM > boundsPair = m_boundsFactory.split( bounds, m_pivot, m_dim );
-
-    // Find out which bound half the target is in
-    // and so decide our first bound and node to check
-    bool inLeft = boundsPair.left.contains( target );
-    const Bounds< P, DIM >& leftBounds( inLeft ? boundsPair.left : boundsPair.right );
-    const Bounds< P, DIM >& rightBounds( inLeft ? boundsPair.right : boundsPair.left );
-
-    const Node< P, DIM >* leftNode( inLeft ? m_left : m_right );
-    const Node< P, DIM >* rightNode( inLeft ? m_right : m_left );
-
-    // Find the nearest point in the left bound
-    leftNode->search( target, data, leftBounds );
-
-    // Check if it worth looking in the right bounds
-    // It is worth it if some of the right bounds line within
-    // our current distanceSq radius
-    const P nearestPointInBound = rightBounds.nearestPoint( target );
-
-    distanceSq = m_measurer.distanceSq< P, DIM >( nearestPointInBound, target );
-
-    if ( distanceSq < data.maxDistanceSq() || data.incomplete() )
-    {
-      // Worth checking right bounds
-      rightNode->search( target, data, rightBounds );
-    }
+    Node node;
+    node.split = 0;
+    node.dim = LEAF;
+    node.first = first;
+    node.count = count;
+    return node;
   }
 
+  //! Returns true if the node is a leaf
+  bool leaf() const { return dim == LEAF; }
 
+  //! Coordinate of the split along the split dimension
+  typename P::base_type split;
 
-private:
-
-  const unsigned int m_dim;
+  //! Split dimension, or LEAF
+  unsigned int dim;
 
-  const Node< P, DIM >* m_left;
-  const Node< P, DIM >* m_right;
-
-  const P m_pivot;
-  const Measurer m_measurer;
-  const BoundsFactory m_boundsFactory;
-};
-
-
-/*! \brief Represents an empty terminal node in the tree
- */
-template< typename P, unsigned int DIM >
-class EmptyNode : public Node< P, DIM >
-{
-public:
-  EmptyNode() {}
-
-  void search(
-      const P& target,
-      Data< P >& data,
-      const Bounds< P, DIM >& bounds
-      ) const {}
-};
-
-
-/*! \brief Represents a terminal node with a single point
- */
-template< typename P, unsigned int DIM >
-class SingleNode : public Node< P, DIM >
-{
-public:
-
-  SingleNode( const P& p, const Measurer& measurer )
-   : m_point( p ), m_measurer( measurer ) {}
-
-  void search(
-      const P& target,
-      Data< P >& data,
-      const Bounds< P, DIM >& bounds 
-      ) const
+  union
   {
-    typename P::base_type distanceSq = m_measurer.distanceSq< P, DIM >( m_point, target );
-    data.update( m_point, distanceSq );
-  }
-
+    //! Offset from a split node to its upper child
+    unsigned int right;
 
-private:
+    //! Index of the first point of a leaf
+    unsigned int first;
+  };
 
-  const P m_point;
-  const Measurer m_measurer;
+  //! Number of points in a leaf
+  unsigned int count;
 };
 
 
@@ -0,0 +1,110 @@
+#ifndef POINT_STREAM
+#define POINT_STREAM
+
+#include "PointView.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+namespace kd
+{
+
+/*! \brief Points read in chunks, possibly many more than fit in memory
+ *
+ *  Streams are read from start to end any number of times, see
+ *  ExternalTreeBuilder.
+ */
+template< typename P >
+class PointStream
+{
+public:
+  virtual ~PointStream() {}
+
+  //! Reads up to count points into buffer, returns how many were read, 0 at the end
+  virtual size_t read( P* buffer, size_t count ) = 0;
+
+  //! Start reading from the first point again, returns false if the stream can not
+  virtual bool rewind() = 0;
+};
+
+
+/*! \brief Stream of the points in a file, stored back to back as written by fwrite
+ *
+ *  The file is read unbuffered as the points are asked for in large chunks.
+ */
+template< typename P >
+class FilePointStream : public PointStream< P >
+{
+public:
+
+  explicit FilePointStream( const char* path )
+   : m_file( fopen( path, "rb" ) )
+  {
+    if ( m_file )
+      setvbuf( m_file, 0, _IONBF, 0 );
+  }
+
+  ~FilePointStream()
+  {
+    if ( m_file )
+      fclose( m_file );
+  }
+
+  //! Returns true if the file could be opened
+  bool valid() const { return m_file != 0; }
+
+  size_t read( P* buffer, size_t count )
+  {
+    return m_file ? fread( buffer, sizeof( P ), count, m_file ) : 0;
+  }
+
+  bool rewind()
+  {
+    return m_file && fseek( m_file, 0, SEEK_SET ) == 0;
+  }
+
+private:
+
+  FilePointStream( const FilePointStream& );
+  FilePointStream& operator=( const FilePointStream& );
+
+  FILE* m_file;
+};
+
+
+/*! \brief Stream of points held elsewhere, such as a memory mapped file of them
+ */
+template< typename P >
+class ViewPointStream : public PointStream< P >
+{
+public:
+
+  explicit ViewPointStream( const PointView< P >& points )
+   : m_points( points ), m_position( 0 ) {}
+
+  size_t read( P* buffer, size_t count )
+  {
+    size_t read = 0;
+
+    for ( ; read < count && m_position < m_points.size(); ++read, ++m_position )
+      buffer[ read ] = m_points[ m_position ];
+
+    return read;
+  }
+
+  bool rewind()
+  {
+    m_position = 0;
+    return true;
+  }
+
+private:
+
+  PointView< P > m_points;
+  size_t m_position;
+};
+
+
+}; // namespace kd
+
+#endif // POINT_STREAM
@@ -0,0 +1,88 @@
+#ifndef POINT_VIEW
+#define POINT_VIEW
+
+#include <stddef.h>
+
+namespace kd
+{
+
+/*! \brief Read-only view of points owned by the caller
+ *
+ *  Each point starts stride bytes after the one before, so a view can cover
+ *  a plain array of P or step over data stored between the points. The
+ *  points must outlive any tree built over the view.
+ */
+template< typename P >
+class PointView
+{
+public:
+
+  PointView( const P* first, size_t count, size_t stride = sizeof( P ) )
+   : m_first( reinterpret_cast< const char* >( first ) ), m_count( count ), m_stride( stride ) {}
+
+  const P& operator[]( size_t index ) const
+  {
+    return *reinterpret_cast< const P* >( m_first + index * m_stride );
+  }
+
+  size_t size() const { return m_count; }
+
+  size_t stride() const { return m_stride; }
+
+private:
+
+  const char* m_first;
+  size_t m_count;
+  size_t m_stride;
+};
+
+
+/*! \brief What an index tree holds for each point, its position in a PointView
+ *
+ *  It has a base_type like a point so the Data classes can collect them,
+ *  MultiNeighbourData< PointIndex< unsigned int, float > > gathers the
+ *  indices of the nearest points for example.
+ */
+template< typename I, typename T >
+struct PointIndex
+{
+  typedef T base_type;
+  typedef I index_type;
+
+  PointIndex() : index( 0 ) {}
+
+  explicit PointIndex( I i ) : index( i ) {}
+
+  I index;
+};
+
+
+/*! \brief Reads the point of an item of a tree that holds copies of its points
+ */
+template< typename P >
+struct PointAccess
+{
+  typedef P Item;
+
+  const P& operator()( const P& point ) const { return point; }
+};
+
+
+/*! \brief Reads the point of an item of an index tree from the caller's view
+ */
+template< typename P, typename I >
+struct IndexAccess
+{
+  typedef PointIndex< I, typename P::base_type > Item;
+
+  IndexAccess( const PointView< P >& v ) : view( v ) {}
+
+  const P& operator()( const Item& item ) const { return view[ item.index ]; }
+
+  PointView< P > view;
+};
+
+
+}; // namespace kd
+
+#endif // POINT_VIEW
@@ -0,0 +1,401 @@
+#ifndef QUANTIZED
+#define QUANTIZED
+
+#include "Metric.h"
+#include "Node.h"
+#include "Simd.h"
+#include "Storage.h"
+
+#include <vector>
+#include <limits>
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace kd
+{
+
+/*! \brief How a Tree keeps the coordinates of the points in its leaves
+ */
+enum LeafPrecision
+{
+  //! A full precision structure-of-arrays copy, see Tree::createCoordinates
+  LEAF_EXACT = 0,
+
+  //! 16 bits per coordinate, relative to the range the leaf's points cover
+  LEAF_QUANTIZED_16,
+
+  //! 8 bits per coordinate, relative to the range the leaf's points cover
+  LEAF_QUANTIZED_8
+};
+
+
+/*! \brief Loads the codes of as many points as X holds coordinates, as coordinates
+ */
+template< typename X, typename T, typename C >
+struct CodeLanes;
+
+#ifdef KD_SIMD_X86
+
+template< typename X, typename T, typename C >
+struct CodeLanes
+{
+  typedef typename SimdVector< C, sizeof( X ) / sizeof( T ) * sizeof( C ) >::Type Codes;
+  typedef typename SimdVector< int, sizeof( X ) / sizeof( T ) * sizeof( int ) >::Type Ints;
+
+  __attribute__(( always_inline ))
+  static void load( const C* codes, X& out )
+  {
+    Codes lanes;
+    memcpy( &lanes, codes, sizeof( Codes ) );
+
+    // Compilers only widen vectors well a doubling at a time
+    if ( sizeof( C ) == 1 )
+    {
+      typedef typename SimdVector< short, sizeof( X ) / sizeof( T ) * sizeof( short ) >::Type Shorts;
+      out = __builtin_convertvector( __builtin_convertvector( __builtin_convertvector( lanes, Shorts ), Ints ), X );
+    }
+    else
+    {
+      out = __builtin_convertvector( __builtin_convertvector( lanes, Ints ), X );
+    }
+  }
+};
+
+#endif // KD_SIMD_X86
+
+template< typename T, typename C >
+struct CodeLanes< T, T, C >
+{
+  __attribute__(( always_inline ))
+  static void load( const C* codes, T& out ) { out = T( codes[ 0 ] ); }
+};
+
+
+/*! \brief Lower bound on the term along axis d for "width" quantized points from codes on
+ *
+ *  Each point lies between low + code * step and that plus width along the
+ *  axis, and the metric's intervalTerm bounds the term over the offsets
+ *  from the target to anywhere between the two.
+ */
+template< typename X, typename T, typename C, typename M >
+__attribute__(( always_inline ))
+inline void quantizedTerm( const M& metric, unsigned int d, const C* codes, T low, T step, T width, T target, X& out )
+{
+  X below;
+  CodeLanes< X, T, C >::load( codes, below );
+  below = below * step + ( low - target );
+
+  const X above = below + width;
+
+  metric.intervalTerm( d, below, above, out );
+}
+
+
+/*! \brief Lower bounds on the distances to the points of a quantized bucket
+ *
+ *  Code d * count + j places point j along axis d, see quantizedTerm. X is
+ *  either the coordinate type or a vector of them, as for metricDistances,
+ *  but rather than finishing the last few points one at a time a whole
+ *  vector is always measured. So codes must be readable, and bounds
+ *  writable, up to count rounded up to the width of X.
+ */
+template< typename X, typename T, typename C, typename M >
+__attribute__(( always_inline ))
+inline void quantizedLowerBounds(
+    const M& metric,
+    const C* codes,
+    unsigned int count,
+    const T* lows,
+    const T* steps,
+    const T* widths,
+    const T* target,
+    unsigned int dims,
+    T* bounds
+    )
+{
+  const unsigned int width = sizeof( X ) / sizeof( T );
+
+  for ( unsigned int j=0; j<count; j += width )
+  {
+    X bound;
+    quantizedTerm( metric, 0, codes + j, lows[ 0 ], steps[ 0 ], widths[ 0 ], target[ 0 ], bound );
+
+    for ( unsigned int d=1; d<dims; ++d )
+    {
+      X term;
+      quantizedTerm( metric, d, codes + d * count + j, lows[ d ], steps[ d ], widths[ d ], target[ d ], term );
+      metric.combine( bound, term );
+    }
+
+    memcpy( bounds + j, &bound, sizeof( X ) );
+  }
+}
+
+
+/*! \brief Lower bound kernels for a metric and type of code, one for each instruction set
+ */
+template< typename M, typename T, typename C >
+struct QuantizedKernel
+{
+  typedef void (*Function)( const M& metric, const C* codes, unsigned int count, const T* lows, const T* steps,
+      const T* widths, const T* target, unsigned int dims, T* bounds );
+
+  static void scalar( const M& metric, const C* codes, unsigned int count, const T* lows, const T* steps,
+      const T* widths, const T* target, unsigned int dims, T* bounds )
+  {
+    quantizedLowerBounds< T >( metric, codes, count, lows, steps, widths, target, dims, bounds );
+  }
+
+#ifdef KD_SIMD_X86
+
+  __attribute__(( target( "sse2" ) ))
+  static void sse( const M& metric, const C* codes, unsigned int count, const T* lows, const T* steps,
+      const T* widths, const T* target, unsigned int dims, T* bounds )
+  {
+    quantizedLowerBounds< typename SimdVector< T, 16 >::Type >( metric, codes, count, lows, steps, widths, target, dims, bounds );
+  }
+
+  __attribute__(( target( "avx2,fma" ) ))
+  static void avx2( const M& metric, const C* codes, unsigned int count, const T* lows, const T* steps,
+      const T* widths, const T* target, unsigned int dims, T* bounds )
+  {
+    quantizedLowerBounds< typename SimdVector< T, 32 >::Type >( metric, codes, count, lows, steps, widths, target, dims, bounds );
+  }
+
+  __attribute__(( target( "avx512f" ) ))
+  static void avx512( const M& metric, const C* codes, unsigned int count, const T* lows, const T* steps,
+      const T* widths, const T* target, unsigned int dims, T* bounds )
+  {
+    quantizedLowerBounds< typename SimdVector< T, 64 >::Type >( metric, codes, count, lows, steps, widths, target, dims, bounds );
+  }
+
+#endif // KD_SIMD_X86
+
+  static Function select( SimdLevel level )
+  {
+#ifdef KD_SIMD_X86
+    if ( level > detectSimdLevel() )
+      level = detectSimdLevel();
+
+    switch ( level )
+    {
+      case SIMD_AVX512: return &avx512;
+      case SIMD_AVX2: return &avx2;
+      case SIMD_SSE: return &sse;
+      default: return &scalar;
+    }
+#else
+    return &scalar;
+#endif
+  }
+};
+
+
+/*! \brief The coordinates of each leaf's points, quantized within the leaf
+ *
+ *  Each leaf cuts the range its points cover along each axis into 2^16 or
+ *  2^8 steps and keeps the step each coordinate falls in. That places every
+ *  point in a small box, and the distance to the box is a lower bound on the
+ *  distance to the point. Searches measure those bounds from the codes and
+ *  only read the exact points of the few which could still be neighbours,
+ *  so they find the same neighbours as with LEAF_EXACT while the
+ *  coordinates take a half or a quarter of the memory. The exact distances
+ *  are measured one point at a time, so may round differently to those of
+ *  the vectorised kernels.
+ */
+template< typename P, unsigned int DIM >
+class QuantizedLeaves
+{
+public:
+
+  typedef typename P::base_type base_type;
+
+  //! The kernels measure whole vectors of up to this many points at a time
+  static const unsigned int BOUNDS_ALIGNMENT = 64 / sizeof( base_type );
+
+  QuantizedLeaves() : m_precision( LEAF_EXACT ) {}
+
+  //! Quantize the points of every leaf of nodes, which are in the order of the leaves
+  void create( const Node< P >* nodes, unsigned int nodeCount, const P* points, LeafPrecision precision );
+
+  //! How finely the coordinates are kept
+  LeafPrecision precision() const { return m_precision; }
+
+  /*! \brief Lower bounds on the distances from target to the points of a leaf
+   *
+   *  index is the position of the leaf in the tree's nodes. A bound is
+   *  written for each of its points to bounds, measured with the kernel
+   *  for level, which may also write past them up to the next multiple of
+   *  BOUNDS_ALIGNMENT.
+   */
+  template< typename M >
+  void lowerBounds(
+      const M& metric,
+      SimdLevel level,
+      unsigned int index,
+      const Node< P >& leaf,
+      const base_type* target,
+      base_type* bounds
+      ) const
+  {
+    const unsigned int slot = m_slots[ index ] * DIM;
+
+    if ( m_precision == LEAF_QUANTIZED_8 )
+    {
+      QuantizedKernel< M, base_type, unsigned char >::select( level )( metric, &m_codes8[ leaf.first * DIM ], leaf.count,
+          &m_lows[ slot ], &m_steps[ slot ], &m_widths[ slot ], target, DIM, bounds );
+    }
+    else
+    {
+      QuantizedKernel< M, base_type, unsigned short >::select( level )( metric, &m_codes16[ leaf.first * DIM ], leaf.count,
+          &m_lows[ slot ], &m_steps[ slot ], &m_widths[ slot ], target, DIM, bounds );
+    }
+  }
+
+  //! Bytes taken by the codes and the ranges of the leaves
+  size_t memory() const
+  {
+    return m_slots.size() * sizeof( unsigned int )
+      + ( m_lows.size() + m_steps.size() + m_widths.size() ) * sizeof( base_type )
+      + m_codes8.size() + m_codes16.size() * sizeof( unsigned short );
+  }
+
+private:
+
+  //! Fraction of a step each box is widened by on both sides, to absorb rounding
+  static const unsigned int SLACK = 64;
+
+  //! Quantizes one leaf's points into codes laid out as Tree::createCoordinates does
+  template< typename C >
+  void quantize( const Node< P >& leaf, const P* points, unsigned int slot, C* codes );
+
+  LeafPrecision m_precision;
+
+  //! Which leaf each node is, the index of its ranges in the lists below
+  std::vector< unsigned int > m_slots;
+
+  //! Per leaf and axis, the bottom of the box of code 0, its step and its width
+  std::vector< base_type > m_lows;
+  std::vector< base_type > m_steps;
+  std::vector< base_type > m_widths;
+
+  //! One of these holds the codes, DIM per point in the order of the points
+  std::vector< unsigned char > m_codes8;
+  std::vector< unsigned short > m_codes16;
+};
+
+
+/*! \brief Storage for a tree whose leaves are quantized, see QuantizedLeaves
+ *
+ *  Holds copies of the points, which searches re-rank with, but no exact
+ *  structure-of-arrays coordinates.
+ */
+template< typename P, unsigned int DIM >
+class QuantizedStorage : public TreeStorage
+{
+public:
+
+  std::vector< Node< P > > nodes;
+  std::vector< P > points;
+  QuantizedLeaves< P, DIM > leaves;
+};
+
+
+template< typename P, unsigned int DIM >
+void QuantizedLeaves< P, DIM >::create( const Node< P >* nodes, unsigned int nodeCount, const P* points, LeafPrecision precision )
+{
+  m_precision = precision;
+  m_slots.assign( nodeCount, ~0u );
+
+  unsigned int leaves = 0;
+  unsigned int pointCount = 0;
+
+  for ( unsigned int i=0; i<nodeCount; ++i )
+  {
+    if ( nodes[ i ].leaf() )
+    {
+      m_slots[ i ] = leaves++;
+      pointCount += nodes[ i ].count;
+    }
+  }
+
+  m_lows.resize( leaves * DIM );
+  m_steps.resize( leaves * DIM );
+  m_widths.resize( leaves * DIM );
+
+  // The last leaf's last codes are read a whole vector at a time
+  if ( precision == LEAF_QUANTIZED_8 )
+    m_codes8.resize( pointCount * DIM + BOUNDS_ALIGNMENT );
+  else
+    m_codes16.resize( pointCount * DIM + BOUNDS_ALIGNMENT );
+
+  for ( unsigned int i=0; i<nodeCount; ++i )
+  {
+    const Node< P >& node = nodes[ i ];
+
+    if ( ! node.leaf() )
+      continue;
+
+    if ( precision == LEAF_QUANTIZED_8 )
+      quantize( node, points, m_slots[ i ] * DIM, &m_codes8[ node.first * DIM ] );
+    else
+      quantize( node, points, m_slots[ i ] * DIM, &m_codes16[ node.first * DIM ] );
+  }
+}
+
+
+template< typename P, unsigned int DIM >
+template< typename C >
+void QuantizedLeaves< P, DIM >::quantize( const Node< P >& leaf, const P* points, unsigned int slot, C* codes )
+{
+  const unsigned int levels = (unsigned int)( std::numeric_limits< C >::max() ) + 1;
+  const P* first = &points[ leaf.first ];
+
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    base_type low = first[ 0 ][ d ];
+    base_type high = low;
+
+    for ( unsigned int j=1; j<leaf.count; ++j )
+    {
+      low = first[ j ][ d ] < low ? first[ j ][ d ] : low;
+      high = first[ j ][ d ] > high ? first[ j ][ d ] : high;
+    }
+
+    // Rounding when a search rebuilds a box is relative to the size of the
+    // coordinates rather than of the step, so allow for both
+    const base_type step = ( high - low ) / base_type( levels );
+    const base_type slack = step / base_type( SLACK )
+      + ( fabs( low ) + fabs( high ) ) * 4 * std::numeric_limits< base_type >::epsilon();
+
+    m_lows[ slot + d ] = low - slack;
+    m_steps[ slot + d ] = step;
+    m_widths[ slot + d ] = step + 2 * slack;
+
+    C* column = &codes[ d * leaf.count ];
+
+    for ( unsigned int j=0; j<leaf.count; ++j )
+    {
+      const base_type value = first[ j ][ d ];
+      unsigned int code = step > base_type( 0 ) ? (unsigned int)( ( value - low ) / step ) : 0;
+      code = code < levels ? code : levels - 1;
+
+      // Make sure the box is built around the value the same way it will be
+      // when searching
+      while ( code > 0 && value < m_lows[ slot + d ] + base_type( code ) * step )
+        --code;
+
+      while ( code < levels - 1 && value > m_lows[ slot + d ] + base_type( code ) * step + m_widths[ slot + d ] )
+        ++code;
+
+      column[ j ] = C( code );
+    }
+  }
+}
+
+
+}; // namespace kd
+
+#endif // QUANTIZED
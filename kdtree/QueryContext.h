@@ -0,0 +1,63 @@
+#ifndef QUERY_CONTEXT
+#define QUERY_CONTEXT
+
+#include "Data.h"
+#include "Search.h"
+
+#include <vector>
+
+namespace kd
+{
+
+/*! \brief Working memory for the searches of one thread, reused from query to query
+ *
+ *  Holds the buffer the neighbours of a query are collected in, the stack
+ *  of a depth-first traversal and the queue of a best-first one. All of
+ *  them keep their memory between queries, so once they have grown to fit
+ *  the largest query asked of them a search through the context allocates
+ *  nothing. See Tree::nearestNeighbours.
+ *
+ *  A context serves one search at a time, so each thread needs its own, as
+ *  does a search started from inside a visitor.
+ */
+template< typename T, typename I >
+class QueryContext
+{
+public:
+
+  typedef typename MultiNeighbourData< I >::PointDistance PointDistance;
+
+  //! Sized up front for queries of up to num neighbours and a stack of depth cells
+  explicit QueryContext( unsigned int num = 1, unsigned int depth = 64 )
+   : m_neighbours( num )
+  {
+    m_stack.reserve( depth );
+    m_queue.reserve( depth );
+  }
+
+  //! Buffer of at least num neighbours, valid until the next call
+  PointDistance* neighbours( unsigned int num )
+  {
+    if ( m_neighbours.size() < num )
+      m_neighbours.resize( num );
+
+    return m_neighbours.data();
+  }
+
+  //! Stack for a depth-first search
+  SearchStack< T >& stack() { return m_stack; }
+
+  //! Queue for a best-first search
+  SearchQueue< T >& queue() { return m_queue; }
+
+private:
+
+  std::vector< PointDistance > m_neighbours;
+  SearchStack< T > m_stack;
+  SearchQueue< T > m_queue;
+};
+
+
+}; // namespace kd
+
+#endif // QUERY_CONTEXT
@@ -0,0 +1,347 @@
+#ifndef SEARCH
+#define SEARCH
+
+#include <vector>
+#include <algorithm>
+
+namespace kd
+{
+
+/*! \brief Orders in which a search can visit the cells of a Tree
+ */
+enum Traversal
+{
+  //! Finish the near side of each split before the far side
+  TRAVERSAL_DEPTH_FIRST = 0,
+
+  //! Always continue with the closest cell not yet searched
+  TRAVERSAL_BEST_FIRST
+};
+
+
+/*! \brief Settings trading the accuracy of a search for speed
+ *
+ *  With the defaults a search is exact. A positive epsilon skips any cell
+ *  which is not ( 1 + epsilon ) times closer than the current distance, so
+ *  every neighbour found is within a factor of ( 1 + epsilon ) of the
+ *  distance to the true neighbour of the same rank. maxLeaves stops the
+ *  search once that many leaves have been checked, after which the result
+ *  has no guarantee at all. As best-first traversals check the closest
+ *  leaves first they make much better use of a limited number of leaves.
+ */
+struct SearchOptions
+{
+  SearchOptions()
+    : epsilon( 0.0 ), maxLeaves( ~0u ), traversal( TRAVERSAL_DEPTH_FIRST ) {}
+
+  SearchOptions( double e, unsigned int leaves = ~0u, Traversal t = TRAVERSAL_DEPTH_FIRST )
+    : epsilon( e ), maxLeaves( leaves ), traversal( t ) {}
+
+  double epsilon;
+  unsigned int maxLeaves;
+  Traversal traversal;
+};
+
+
+/*! \brief Work done by a search
+ */
+struct SearchStats
+{
+  SearchStats()
+    : nodes( 0 ), leaves( 0 ), points( 0 ), farCells( 0 ), refined( 0 ) {}
+
+  //! Nodes visited, including the leaves
+  unsigned int nodes;
+
+  //! Leaves whose points were checked
+  unsigned int leaves;
+
+  //! Distances measured to the points of those leaves
+  unsigned int points;
+
+  //! Cells on the far side of a split which were searched after the near side
+  unsigned int farCells;
+
+  //! Points of quantized leaves measured exactly, see LeafPrecision
+  unsigned int refined;
+};
+
+
+/*! \brief Counts the work of one search, adding it to a SearchStats once done
+ *
+ *  Searches are compiled once with this and once with NoSearchCounter, so
+ *  a search not asked for stats does no counting at all.
+ */
+class SearchCounter
+{
+public:
+
+  explicit SearchCounter( SearchStats* stats )
+    : m_stats( stats ), m_nodes( 0 ), m_leaves( 0 ), m_points( 0 ), m_farCells( 0 ), m_refined( 0 ) {}
+
+  void node() { ++m_nodes; }
+
+  void leaf( unsigned int points ) { ++m_leaves; m_points += points; }
+
+  void farCell() { ++m_farCells; }
+
+  void refined() { ++m_refined; }
+
+  void finish() const
+  {
+    m_stats->nodes += m_nodes;
+    m_stats->leaves += m_leaves;
+    m_stats->points += m_points;
+    m_stats->farCells += m_farCells;
+    m_stats->refined += m_refined;
+  }
+
+private:
+
+  SearchStats* m_stats;
+
+  unsigned int m_nodes;
+  unsigned int m_leaves;
+  unsigned int m_points;
+  unsigned int m_farCells;
+  unsigned int m_refined;
+};
+
+
+/*! \brief Counts nothing, for searches not asked for stats
+ */
+class NoSearchCounter
+{
+public:
+
+  void node() {}
+
+  void leaf( unsigned int ) {}
+
+  void farCell() {}
+
+  void refined() {}
+
+  void finish() const {}
+};
+
+
+/*! \brief Cells skipped by a depth-first traversal, to come back to once the near side is done
+ *
+ *  Like SearchQueue clearing keeps the memory, so a stack reused from one
+ *  search to the next stops allocating once it has grown.
+ */
+template< typename T >
+class SearchStack
+{
+public:
+
+  /*! \brief A cell still to be checked once the nearer cells are done
+   *
+   *  Entries for RESTORE instead put back the target's offset along dim
+   *  once a far cell and everything below it has been searched.
+   */
+  struct Entry
+  {
+    static const unsigned int RESTORE = ~0u;
+
+    Entry( unsigned int n, unsigned int d, T o, T r )
+      : node( n ), dim( d ), offset( o ), distanceSq( r ) {}
+
+    unsigned int node;
+    unsigned int dim;
+
+    //! Offset from the cell to the target along dim
+    T offset;
+
+    //! Distance squared from the target to the cell
+    T distanceSq;
+  };
+
+  SearchStack() {}
+
+  void reserve( unsigned int size ) { m_entries.reserve( size ); }
+
+  void clear() { m_entries.clear(); }
+
+  bool empty() const { return m_entries.empty(); }
+
+  void push( const Entry& entry ) { m_entries.push_back( entry ); }
+
+  Entry pop()
+  {
+    const Entry entry = m_entries.back();
+    m_entries.pop_back();
+    return entry;
+  }
+
+private:
+
+  std::vector< Entry > m_entries;
+};
+
+
+/*! \brief Nodes left to visit by a traversal which needs no distances, such as Tree::withinBox
+ *
+ *  The first DEPTH entries are held in the stack itself, which is enough
+ *  for any tree no deeper than DEPTH when only one child of each split is
+ *  pushed, so searches allocate nothing. Only deeper trees, which very
+ *  skewed points split by a sliding midpoint can give, spill into a vector.
+ */
+class NodeStack
+{
+public:
+
+  static const unsigned int DEPTH = 64;
+
+  NodeStack() : m_size( 0 ) {}
+
+  bool empty() const { return m_size == 0; }
+
+  void push( unsigned int node )
+  {
+    if ( m_size < DEPTH )
+      m_nodes[ m_size ] = node;
+    else
+      m_overflow.push_back( node );
+
+    ++m_size;
+  }
+
+  unsigned int pop()
+  {
+    --m_size;
+
+    if ( m_size < DEPTH )
+      return m_nodes[ m_size ];
+
+    const unsigned int node = m_overflow.back();
+    m_overflow.pop_back();
+    return node;
+  }
+
+private:
+
+  unsigned int m_nodes[ DEPTH ];
+  unsigned int m_size;
+  std::vector< unsigned int > m_overflow;
+};
+
+
+/*! \brief Cells waiting to be searched by a best-first traversal, closest first
+ *
+ *  The offsets from a cell to the target along each axis are needed to
+ *  carry on updating the cell distance incrementally when the search moves
+ *  on to it. Rather than copy all of them for every cell queued, each entry
+ *  records the one offset its cell changed and the entry it was reached
+ *  from, and the rest are found by following that chain back to the root.
+ *
+ *  Clearing keeps the memory, so a queue reused from one search to the next
+ *  stops allocating once it has grown.
+ */
+template< typename T >
+class SearchQueue
+{
+public:
+
+  //! Path of the root cell, which has no changed offsets
+  static const unsigned int ROOT = ~0u;
+
+  struct Entry
+  {
+    T distanceSq;
+    unsigned int node;
+
+    //! Change to the offsets giving this cell, which leads back to the root
+    unsigned int path;
+  };
+
+  SearchQueue() {}
+
+  void reserve( unsigned int size )
+  {
+    m_entries.reserve( size );
+    m_paths.reserve( size );
+  }
+
+  void clear()
+  {
+    m_entries.clear();
+    m_paths.clear();
+  }
+
+  bool empty() const { return m_entries.empty(); }
+
+  const Entry& top() const { return m_entries.front(); }
+
+  //! Queue a cell reached from the cell of "path" by changing its offset along dim
+  void push( unsigned int node, T distanceSq, unsigned int path, unsigned int dim, T offset )
+  {
+    Path change;
+    change.offset = offset;
+    change.dim = dim;
+    change.parent = path;
+
+    Entry entry;
+    entry.distanceSq = distanceSq;
+    entry.node = node;
+    entry.path = m_paths.size();
+
+    m_paths.push_back( change );
+    m_entries.push_back( entry );
+    std::push_heap( m_entries.begin(), m_entries.end(), Further() );
+  }
+
+  void pop()
+  {
+    std::pop_heap( m_entries.begin(), m_entries.end(), Further() );
+    m_entries.pop_back();
+  }
+
+  /*! \brief Works out the offsets of the cell of "path" from those of the root
+   *
+   *  Cells further along a path lie inside the earlier ones, so an offset
+   *  along an axis only ever grows and the largest change to each is kept.
+   */
+  void offsets( unsigned int path, const T* root, T* offsets, unsigned int dims ) const
+  {
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      offsets[ d ] = root[ d ];
+    }
+
+    for ( ; path != ROOT; path = m_paths[ path ].parent )
+    {
+      const Path& change = m_paths[ path ];
+
+      if ( change.offset * change.offset > offsets[ change.dim ] * offsets[ change.dim ] )
+        offsets[ change.dim ] = change.offset;
+    }
+  }
+
+private:
+
+  struct Path
+  {
+    T offset;
+    unsigned int dim;
+    unsigned int parent;
+  };
+
+  //! Makes a min-heap on distance, a functor so the heap operations inline it
+  struct Further
+  {
+    bool operator()( const Entry& a, const Entry& b ) const
+    {
+      return a.distanceSq > b.distanceSq;
+    }
+  };
+
+  std::vector< Entry > m_entries;
+  std::vector< Path > m_paths;
+};
+
+
+}; // namespace kd
+
+#endif // SEARCH
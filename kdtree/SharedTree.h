@@ -0,0 +1,183 @@
+#ifndef SHARED_TREE
+#define SHARED_TREE
+
+#include "Tree.h"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace kd
+{
+
+/*! \brief The current Tree of a service, searched by any number of threads while a new one is installed
+ *
+ *  Readers take a Snapshot, which keeps the tree current at the time alive
+ *  until it is released. Taking and releasing one are a few atomic
+ *  operations on a slot of the calling thread's own and never wait for a
+ *  writer, nor for each other.
+ *
+ *  install swaps in a new tree at once, so snapshots taken afterwards see
+ *  it, then waits out a grace period before deleting the old one: the
+ *  epoch is advanced and install waits until every snapshot taken in the
+ *  epoch before has been released. Snapshots taken meanwhile count against
+ *  the new epoch and do not hold the writer up.
+ *
+ *  \code
+ *  // Readers
+ *  kd::SharedTree< P, DIM >::Snapshot tree = shared.snapshot();
+ *  tree->nearestNeighbours( num, target, context );
+ *
+ *  // Writer, on a thread of its own
+ *  shared.install( factory.create< P, DIM >( points ) );
+ *  \endcode
+ *
+ *  A thread holding a Snapshot must not install, as it would wait for itself.
+ */
+template< typename P, unsigned int DIM, typename M = EuclideanMetric< typename P::base_type >, typename I = P >
+class SharedTree
+{
+public:
+
+  typedef Tree< P, DIM, M, I > TreeType;
+
+  //! Threads taking snapshots without sharing a slot
+  static const unsigned int SLOTS = 64;
+
+  /*! \brief Keeps a tree alive while it is searched, until released or destroyed
+   */
+  class Snapshot
+  {
+  public:
+
+    Snapshot( Snapshot&& other )
+      : m_readers( other.m_readers ), m_tree( other.m_tree )
+    {
+      other.m_readers = 0;
+      other.m_tree = 0;
+    }
+
+    ~Snapshot() { release(); }
+
+    const TreeType* get() const { return m_tree; }
+    const TreeType* operator->() const { return m_tree; }
+    const TreeType& operator*() const { return *m_tree; }
+
+    //! Let the tree go before the snapshot is destroyed, after which it is null
+    void release()
+    {
+      if ( m_readers )
+        m_readers->fetch_sub( 1, std::memory_order_release );
+
+      m_readers = 0;
+      m_tree = 0;
+    }
+
+  private:
+
+    friend class SharedTree;
+
+    Snapshot( std::atomic< unsigned int >* readers, const TreeType* tree )
+      : m_readers( readers ), m_tree( tree ) {}
+
+    Snapshot( const Snapshot& );
+    Snapshot& operator=( const Snapshot& );
+
+    std::atomic< unsigned int >* m_readers;
+    const TreeType* m_tree;
+  };
+
+  //! Share tree, which may be null until one is installed, and take ownership of it
+  explicit SharedTree( TreeType* tree = 0 )
+    : m_tree( tree ), m_epoch( 0 )
+  {
+    for ( unsigned int s=0; s<SLOTS; ++s )
+    {
+      m_slots[ s ].readers[ 0 ].store( 0, std::memory_order_relaxed );
+      m_slots[ s ].readers[ 1 ].store( 0, std::memory_order_relaxed );
+    }
+  }
+
+  //! Deletes the current tree, no snapshot may still be held
+  ~SharedTree()
+  {
+    delete m_tree.load( std::memory_order_relaxed );
+  }
+
+  //! The current tree, kept alive until the snapshot is released
+  Snapshot snapshot() const
+  {
+    Slot& slot = m_slots[ threadSlot( SLOTS ) ];
+
+    for ( ;; )
+    {
+      const unsigned long long epoch = m_epoch.load();
+      std::atomic< unsigned int >& readers = slot.readers[ epoch & 1 ];
+
+      readers.fetch_add( 1 );
+
+      // Had install moved on meanwhile it may not have seen this reader, so count it again in the new epoch
+      if ( m_epoch.load() == epoch )
+        return Snapshot( &readers, m_tree.load() );
+
+      readers.fetch_sub( 1, std::memory_order_release );
+    }
+  }
+
+  /*! \brief Make tree the current one and delete the one it replaces once no snapshot holds it
+   *
+   *  Takes ownership of tree. Installs from several threads are taken one
+   *  at a time.
+   */
+  void install( TreeType* tree )
+  {
+    std::lock_guard< std::mutex > lock( m_install );
+
+    TreeType* old = m_tree.exchange( tree );
+    synchronise();
+    delete old;
+  }
+
+  //! Number of installs so far, each of which starts a new epoch
+  unsigned long long epoch() const { return m_epoch.load( std::memory_order_relaxed ); }
+
+private:
+
+  SharedTree( const SharedTree& );
+  SharedTree& operator=( const SharedTree& );
+
+  struct alignas( 64 ) Slot
+  {
+    //! Snapshots held, by the parity of the epoch they were taken in
+    std::atomic< unsigned int > readers[ 2 ];
+  };
+
+  /*! \brief Waits until every snapshot taken before the tree was swapped is released
+   *
+   *  Readers count themselves before loading the tree and the swap comes
+   *  before the scan, so a reader either loaded the new tree or is seen.
+   */
+  void synchronise()
+  {
+    const unsigned long long epoch = m_epoch.load( std::memory_order_relaxed );
+    m_epoch.store( epoch + 1 );
+
+    for ( unsigned int s=0; s<SLOTS; ++s )
+    {
+      while ( m_slots[ s ].readers[ epoch & 1 ].load() != 0 )
+        std::this_thread::yield();
+    }
+  }
+
+  std::atomic< TreeType* > m_tree;
+  std::atomic< unsigned long long > m_epoch;
+  std::mutex m_install;
+
+  mutable Slot m_slots[ SLOTS ];
+};
+
+
+}; // namespace kd
+
+#endif // SHARED_TREE
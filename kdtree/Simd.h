@@ -0,0 +1,273 @@
+#ifndef SIMD
+#define SIMD
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define KD_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace kd
+{
+
+/*! \brief Instruction sets the distance kernels are written for
+ */
+enum SimdLevel
+{
+  SIMD_SCALAR = 0,
+  SIMD_SSE,
+  SIMD_AVX2,
+  SIMD_AVX512
+};
+
+
+//! Returns the best instruction set supported by the CPU we are running on
+inline SimdLevel detectSimdLevel()
+{
+#ifdef KD_SIMD_X86
+  static const SimdLevel level =
+    __builtin_cpu_supports( "avx512f" ) ? SIMD_AVX512 :
+    ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ) ? SIMD_AVX2 :
+    __builtin_cpu_supports( "sse2" ) ? SIMD_SSE :
+    SIMD_SCALAR;
+
+  return level;
+#else
+  return SIMD_SCALAR;
+#endif
+}
+
+//! Name of an instruction set for reports
+inline const char* simdLevelName( SimdLevel level )
+{
+  switch ( level )
+  {
+    case SIMD_SSE: return "sse";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+
+/*! \brief Squared distances from target to a bucket of points
+ *
+ *  The bucket is stored structure-of-arrays, coordinate d of point j being
+ *  block[ d * count + j ].
+ */
+template< typename T >
+void distanceSqScalar( const T* block, unsigned int count, const T* target, unsigned int dims, T* distancesSq )
+{
+  for ( unsigned int j=0; j<count; ++j )
+    distancesSq[ j ] = T( 0 );
+
+  for ( unsigned int d=0; d<dims; ++d )
+  {
+    const T* coords = block + d * count;
+    const T t = target[ d ];
+
+    for ( unsigned int j=0; j<count; ++j )
+    {
+      T sep = coords[ j ] - t;
+      distancesSq[ j ] += sep * sep;
+    }
+  }
+}
+
+
+//! Scalar distances for the points from "first" on that did not fill a vector
+template< typename T >
+inline void distanceSqTail( const T* block, unsigned int count, unsigned int first, const T* target, unsigned int dims, T* distancesSq )
+{
+  for ( unsigned int j=first; j<count; ++j )
+  {
+    T acc = T( 0 );
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      T sep = block[ d * count + j ] - target[ d ];
+      acc += sep * sep;
+    }
+    distancesSq[ j ] = acc;
+  }
+}
+
+
+#ifdef KD_SIMD_X86
+
+__attribute__(( target( "sse2" ) ))
+inline void distanceSqSse( const float* block, unsigned int count, const float* target, unsigned int dims, float* distancesSq )
+{
+  unsigned int j = 0;
+
+  for ( ; j + 4 <= count; j += 4 )
+  {
+    __m128 acc = _mm_setzero_ps();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m128 sep = _mm_sub_ps( _mm_loadu_ps( block + d * count + j ), _mm_set1_ps( target[ d ] ) );
+      acc = _mm_add_ps( acc, _mm_mul_ps( sep, sep ) );
+    }
+    _mm_storeu_ps( distancesSq + j, acc );
+  }
+
+  distanceSqTail( block, count, j, target, dims, distancesSq );
+}
+
+__attribute__(( target( "sse2" ) ))
+inline void distanceSqSse( const double* block, unsigned int count, const double* target, unsigned int dims, double* distancesSq )
+{
+  unsigned int j = 0;
+
+  for ( ; j + 2 <= count; j += 2 )
+  {
+    __m128d acc = _mm_setzero_pd();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m128d sep = _mm_sub_pd( _mm_loadu_pd( block + d * count + j ), _mm_set1_pd( target[ d ] ) );
+      acc = _mm_add_pd( acc, _mm_mul_pd( sep, sep ) );
+    }
+    _mm_storeu_pd( distancesSq + j, acc );
+  }
+
+  distanceSqTail( block, count, j, target, dims, distancesSq );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+inline void distanceSqAvx2( const float* block, unsigned int count, const float* target, unsigned int dims, float* distancesSq )
+{
+  unsigned int j = 0;
+
+  for ( ; j + 8 <= count; j += 8 )
+  {
+    __m256 acc = _mm256_setzero_ps();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m256 sep = _mm256_sub_ps( _mm256_loadu_ps( block + d * count + j ), _mm256_set1_ps( target[ d ] ) );
+      acc = _mm256_fmadd_ps( sep, sep, acc );
+    }
+    _mm256_storeu_ps( distancesSq + j, acc );
+  }
+
+  distanceSqTail( block, count, j, target, dims, distancesSq );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+inline void distanceSqAvx2( const double* block, unsigned int count, const double* target, unsigned int dims, double* distancesSq )
+{
+  unsigned int j = 0;
+
+  for ( ; j + 4 <= count; j += 4 )
+  {
+    __m256d acc = _mm256_setzero_pd();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m256d sep = _mm256_sub_pd( _mm256_loadu_pd( block + d * count + j ), _mm256_set1_pd( target[ d ] ) );
+      acc = _mm256_fmadd_pd( sep, sep, acc );
+    }
+    _mm256_storeu_pd( distancesSq + j, acc );
+  }
+
+  distanceSqTail( block, count, j, target, dims, distancesSq );
+}
+
+__attribute__(( target( "avx512f" ) ))
+inline void distanceSqAvx512( const float* block, unsigned int count, const float* target, unsigned int dims, float* distancesSq )
+{
+  for ( unsigned int j=0; j<count; j+=16 )
+  {
+    // Masked loads and stores handle the partial vector at the end
+    const __mmask16 mask = count - j >= 16 ? __mmask16( 0xffff ) : __mmask16( ( 1u << ( count - j ) ) - 1 );
+
+    __m512 acc = _mm512_setzero_ps();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m512 sep = _mm512_sub_ps( _mm512_maskz_loadu_ps( mask, block + d * count + j ), _mm512_set1_ps( target[ d ] ) );
+      acc = _mm512_fmadd_ps( sep, sep, acc );
+    }
+    _mm512_mask_storeu_ps( distancesSq + j, mask, acc );
+  }
+}
+
+__attribute__(( target( "avx512f" ) ))
+inline void distanceSqAvx512( const double* block, unsigned int count, const double* target, unsigned int dims, double* distancesSq )
+{
+  for ( unsigned int j=0; j<count; j+=8 )
+  {
+    const __mmask8 mask = count - j >= 8 ? __mmask8( 0xff ) : __mmask8( ( 1u << ( count - j ) ) - 1 );
+
+    __m512d acc = _mm512_setzero_pd();
+    for ( unsigned int d=0; d<dims; ++d )
+    {
+      __m512d sep = _mm512_sub_pd( _mm512_maskz_loadu_pd( mask, block + d * count + j ), _mm512_set1_pd( target[ d ] ) );
+      acc = _mm512_fmadd_pd( sep, sep, acc );
+    }
+    _mm512_mask_storeu_pd( distancesSq + j, mask, acc );
+  }
+}
+
+#endif // KD_SIMD_X86
+
+
+/*! \brief Picks the distance kernel for a coordinate type and instruction set
+ *
+ *  Only float and double have vectorised kernels, other types always use
+ *  the scalar one.
+ */
+template< typename T >
+struct DistanceKernel
+{
+  typedef void (*Function)( const T* block, unsigned int count, const T* target, unsigned int dims, T* distancesSq );
+
+  static Function select( SimdLevel )
+  {
+    return &distanceSqScalar< T >;
+  }
+};
+
+#ifdef KD_SIMD_X86
+
+template<>
+struct DistanceKernel< float >
+{
+  typedef void (*Function)( const float* block, unsigned int count, const float* target, unsigned int dims, float* distancesSq );
+
+  static Function select( SimdLevel level )
+  {
+    if ( level > detectSimdLevel() )
+      level = detectSimdLevel();
+
+    switch ( level )
+    {
+      case SIMD_AVX512: return &distanceSqAvx512;
+      case SIMD_AVX2: return &distanceSqAvx2;
+      case SIMD_SSE: return &distanceSqSse;
+      default: return &distanceSqScalar< float >;
+    }
+  }
+};
+
+template<>
+struct DistanceKernel< double >
+{
+  typedef void (*Function)( const double* block, unsigned int count, const double* target, unsigned int dims, double* distancesSq );
+
+  static Function select( SimdLevel level )
+  {
+    if ( level > detectSimdLevel() )
+      level = detectSimdLevel();
+
+    switch ( level )
+    {
+      case SIMD_AVX512: return &distanceSqAvx512;
+      case SIMD_AVX2: return &distanceSqAvx2;
+      case SIMD_SSE: return &distanceSqSse;
+      default: return &distanceSqScalar< double >;
+    }
+  }
+};
+
+#endif // KD_SIMD_X86
+
+
+}; // namespace kd
+
+#endif // SIMD
@@ -0,0 +1,332 @@
+#ifndef STATISTICS
+#define STATISTICS
+
+#include "Tree.h"
+#include "Search.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <utility>
+
+namespace kd
+{
+
+/*! \brief Shape of a Tree, to tell how well its parameters suit the points
+ *
+ *  Depths count the splits above a leaf, so a tree of a single leaf has
+ *  depth 0. balance is the mean depth of the leaves over the depth of a
+ *  perfectly balanced tree with as many leaves, so it is 1 for a balanced
+ *  tree and grows as the splits leave the leaves at uneven depths.
+ */
+struct TreeShape
+{
+  TreeShape()
+    : nodes( 0 ), leaves( 0 ), points( 0 ),
+      minDepth( 0 ), maxDepth( 0 ), meanDepth( 0.0 ),
+      minOccupancy( 0 ), maxOccupancy( 0 ), meanOccupancy( 0.0 ),
+      emptyLeaves( 0 ), balance( 1.0 ) {}
+
+  unsigned int nodes;
+  unsigned int leaves;
+  unsigned int points;
+
+  unsigned int minDepth;
+  unsigned int maxDepth;
+  double meanDepth;
+
+  //! Fewest points in a leaf
+  unsigned int minOccupancy;
+
+  //! Most points in a leaf
+  unsigned int maxOccupancy;
+
+  //! Mean points per leaf
+  double meanOccupancy;
+
+  //! Leaves holding no points at all
+  unsigned int emptyLeaves;
+
+  double balance;
+};
+
+
+//! Measure the shape of tree by walking its nodes
+template< typename P, unsigned int DIM, typename M, typename I >
+TreeShape treeShape( const Tree< P, DIM, M, I >& tree )
+{
+  TreeShape shape;
+
+  shape.nodes = tree.nodeCount();
+  shape.points = tree.size();
+
+  if ( tree.nodeCount() == 0 )
+    return shape;
+
+  const Node< P >* nodes = tree.nodes();
+
+  unsigned long long depthSum = 0;
+  shape.minDepth = ~0u;
+  shape.minOccupancy = ~0u;
+
+  // Node index and depth of the upper children still to walk
+  std::vector< std::pair< unsigned int, unsigned int > > stack;
+  stack.push_back( std::make_pair( 0u, 0u ) );
+
+  while ( ! stack.empty() )
+  {
+    unsigned int index = stack.back().first;
+    unsigned int depth = stack.back().second;
+    stack.pop_back();
+
+    while ( ! nodes[ index ].leaf() )
+    {
+      ++depth;
+      stack.push_back( std::make_pair( index + nodes[ index ].right, depth ) );
+      ++index;
+    }
+
+    const unsigned int count = nodes[ index ].count;
+
+    ++shape.leaves;
+    depthSum += depth;
+    shape.minDepth = std::min( shape.minDepth, depth );
+    shape.maxDepth = std::max( shape.maxDepth, depth );
+    shape.minOccupancy = std::min( shape.minOccupancy, count );
+    shape.maxOccupancy = std::max( shape.maxOccupancy, count );
+
+    if ( count == 0 )
+      ++shape.emptyLeaves;
+  }
+
+  shape.meanDepth = double( depthSum ) / shape.leaves;
+  shape.meanOccupancy = double( shape.points ) / shape.leaves;
+
+  if ( shape.leaves > 1 )
+    shape.balance = shape.meanDepth / std::log2( double( shape.leaves ) );
+
+  return shape;
+}
+
+
+/*! \brief Totals of a QueryStatistics at one moment, for monitoring to scrape
+ *
+ *  Bucket b of the latency histogram counts the queries which took from
+ *  2^b up to 2^( b + 1 ) nanoseconds, the first bucket also counting any
+ *  quicker ones and the last any slower ones.
+ */
+struct StatisticsSnapshot
+{
+  static const unsigned int LATENCY_BUCKETS = 32;
+
+  StatisticsSnapshot()
+    : queries( 0 ), nodes( 0 ), leaves( 0 ), points( 0 ), farCells( 0 ), refined( 0 ), latency( 0 )
+  {
+    for ( unsigned int b=0; b<LATENCY_BUCKETS; ++b )
+      histogram[ b ] = 0;
+  }
+
+  //! Mean nanoseconds per query
+  double meanLatency() const { return queries ? double( latency ) / queries : 0.0; }
+
+  /*! \brief Nanoseconds within which a fraction q of the queries finished
+   *
+   *  Only as fine as the histogram, so this is the upper end of the bucket
+   *  holding the query of that rank.
+   */
+  double percentile( double q ) const
+  {
+    if ( queries == 0 )
+      return 0.0;
+
+    const double rank = q * queries;
+    unsigned long long seen = 0;
+
+    for ( unsigned int b=0; b<LATENCY_BUCKETS; ++b )
+    {
+      seen += histogram[ b ];
+
+      if ( seen >= rank && seen > 0 )
+        return std::ldexp( 1.0, b + 1 );
+    }
+
+    return std::ldexp( 1.0, LATENCY_BUCKETS );
+  }
+
+  unsigned long long queries;
+
+  //! Summed SearchStats of the queries
+  unsigned long long nodes;
+  unsigned long long leaves;
+  unsigned long long points;
+  unsigned long long farCells;
+  unsigned long long refined;
+
+  //! Summed nanoseconds of the queries
+  unsigned long long latency;
+
+  unsigned long long histogram[ LATENCY_BUCKETS ];
+};
+
+
+/*! \brief Counters and latencies of queries, gathered from any number of threads
+ *
+ *  Each thread adds to a slot of its own, each slot on its own cache lines,
+ *  so recording a query takes a few relaxed atomic additions and no locks.
+ *  Should more threads record than there are slots they share slots, which
+ *  stays correct and only costs some contention. snapshot sums the slots.
+ *
+ *  Nothing is gathered unless a search is given a SearchStats, see
+ *  QueryRecorder, so searches not being watched pay nothing.
+ */
+class QueryStatistics
+{
+public:
+
+  static const unsigned int LATENCY_BUCKETS = StatisticsSnapshot::LATENCY_BUCKETS;
+
+  //! Threads recording without sharing a slot
+  static const unsigned int SLOTS = 64;
+
+  QueryStatistics() { reset(); }
+
+  //! Add one query, which did the work in stats and took the given nanoseconds
+  void record( const SearchStats& stats, unsigned long long latency )
+  {
+    Slot& slot = m_slots[ threadSlot( SLOTS ) ];
+
+    add( slot.queries, 1 );
+    add( slot.nodes, stats.nodes );
+    add( slot.leaves, stats.leaves );
+    add( slot.points, stats.points );
+    add( slot.farCells, stats.farCells );
+    add( slot.refined, stats.refined );
+    add( slot.latency, latency );
+    add( slot.histogram[ bucket( latency ) ], 1 );
+  }
+
+  //! Totals of the queries recorded so far
+  StatisticsSnapshot snapshot() const
+  {
+    StatisticsSnapshot totals;
+
+    for ( unsigned int s=0; s<SLOTS; ++s )
+    {
+      const Slot& slot = m_slots[ s ];
+
+      totals.queries += load( slot.queries );
+      totals.nodes += load( slot.nodes );
+      totals.leaves += load( slot.leaves );
+      totals.points += load( slot.points );
+      totals.farCells += load( slot.farCells );
+      totals.refined += load( slot.refined );
+      totals.latency += load( slot.latency );
+
+      for ( unsigned int b=0; b<LATENCY_BUCKETS; ++b )
+        totals.histogram[ b ] += load( slot.histogram[ b ] );
+    }
+
+    return totals;
+  }
+
+  //! Start counting again from zero, queries recorded meanwhile may be partly kept
+  void reset()
+  {
+    for ( unsigned int s=0; s<SLOTS; ++s )
+    {
+      Slot& slot = m_slots[ s ];
+
+      slot.queries.store( 0, std::memory_order_relaxed );
+      slot.nodes.store( 0, std::memory_order_relaxed );
+      slot.leaves.store( 0, std::memory_order_relaxed );
+      slot.points.store( 0, std::memory_order_relaxed );
+      slot.farCells.store( 0, std::memory_order_relaxed );
+      slot.refined.store( 0, std::memory_order_relaxed );
+      slot.latency.store( 0, std::memory_order_relaxed );
+
+      for ( unsigned int b=0; b<LATENCY_BUCKETS; ++b )
+        slot.histogram[ b ].store( 0, std::memory_order_relaxed );
+    }
+  }
+
+  //! Histogram bucket of a latency in nanoseconds
+  static unsigned int bucket( unsigned long long latency )
+  {
+    if ( latency < 2 )
+      return 0;
+
+    const unsigned int b = 63 - __builtin_clzll( latency );
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+  }
+
+private:
+
+  typedef std::atomic< unsigned long long > Counter;
+
+  struct alignas( 64 ) Slot
+  {
+    Counter queries;
+    Counter nodes;
+    Counter leaves;
+    Counter points;
+    Counter farCells;
+    Counter refined;
+    Counter latency;
+    Counter histogram[ LATENCY_BUCKETS ];
+  };
+
+  static void add( Counter& counter, unsigned long long value )
+  {
+    counter.fetch_add( value, std::memory_order_relaxed );
+  }
+
+  static unsigned long long load( const Counter& counter )
+  {
+    return counter.load( std::memory_order_relaxed );
+  }
+
+  Slot m_slots[ SLOTS ];
+};
+
+
+/*! \brief Times one query and records it into a QueryStatistics when it goes out of scope
+ *
+ *  \code
+ *  {
+ *    kd::QueryRecorder recorder( statistics );
+ *    tree->nearestNeighbours( num, target, tree->bounds(), options, recorder.stats() );
+ *  }
+ *  \endcode
+ */
+class QueryRecorder
+{
+public:
+
+  explicit QueryRecorder( QueryStatistics& statistics )
+    : m_statistics( statistics ), m_start( std::chrono::steady_clock::now() ) {}
+
+  ~QueryRecorder()
+  {
+    const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - m_start;
+    m_statistics.record( m_stats, std::chrono::duration_cast< std::chrono::nanoseconds >( elapsed ).count() );
+  }
+
+  //! Stats to hand to the search
+  SearchStats* stats() { return &m_stats; }
+
+private:
+
+  QueryRecorder( const QueryRecorder& );
+  QueryRecorder& operator=( const QueryRecorder& );
+
+  QueryStatistics& m_statistics;
+  SearchStats m_stats;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+
+}; // namespace kd
+
+#endif // STATISTICS
@@ -0,0 +1,182 @@
+#ifndef STORAGE
+#define STORAGE
+
+#include "Node.h"
+
+#include <vector>
+#include <type_traits>
+
+#include <stddef.h>
+
+#include <sys/mman.h>
+
+namespace kd
+{
+
+/*! \brief Owns the memory a Tree's nodes, points and coordinates live in
+ *
+ *  A Tree only refers to its arrays through pointers so they can live in
+ *  whatever memory suits, the storage is deleted along with the Tree.
+ */
+class TreeStorage
+{
+public:
+  TreeStorage() {}
+  virtual ~TreeStorage() {}
+};
+
+
+/*! \brief Storage for a tree built in memory
+ *
+ *  I is what the tree holds for each point, see Tree.
+ */
+template< typename P, typename I = P >
+class VectorStorage : public TreeStorage
+{
+public:
+
+  typedef std::vector< Node< P > > NodeList;
+  typedef std::vector< I > PointList;
+  typedef std::vector< typename P::base_type > CoordinateList;
+
+  NodeList nodes;
+  PointList points;
+  CoordinateList coordinates;
+};
+
+
+/*! \brief Storage for a tree built in memory as a single block
+ *
+ *  Arrays are handed out of one anonymous mapping by bumping an offset, so
+ *  the whole tree is released with a single munmap however many points it
+ *  holds and its size is exactly what the arrays need. Nothing allocated
+ *  is ever destructed, so only plain data may be kept in it.
+ *
+ *  When huge pages are asked for the mapping is backed by them if the
+ *  system has any reserved, otherwise transparent huge pages are requested
+ *  for it. Either way searches over a large tree miss the TLB far less.
+ */
+class ArenaStorage : public TreeStorage
+{
+public:
+
+  //! Every allocation starts on a cache line
+  static const size_t ALIGNMENT = 64;
+
+  //! Size the mapping is rounded up to when huge pages are asked for
+  static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+  ArenaStorage( size_t capacity, bool hugePages = false )
+   : m_address( 0 ), m_length( 0 ), m_used( 0 ), m_hugePages( false )
+  {
+    if ( capacity == 0 )
+      return;
+
+    size_t length = hugePages ? ( capacity + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ) : capacity;
+    void* address = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if ( hugePages )
+    {
+      address = mmap( 0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+      m_hugePages = address != MAP_FAILED;
+    }
+#endif
+
+    if ( address == MAP_FAILED )
+    {
+      address = mmap( 0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+#ifdef MADV_HUGEPAGE
+      if ( hugePages && address != MAP_FAILED )
+        m_hugePages = madvise( address, length, MADV_HUGEPAGE ) == 0;
+#endif
+    }
+
+    if ( address != MAP_FAILED )
+    {
+      m_address = address;
+      m_length = length;
+    }
+  }
+
+  ~ArenaStorage()
+  {
+    if ( m_address )
+      munmap( m_address, m_length );
+  }
+
+  /*! \brief Space for count objects of type T, constructed by the caller
+   *
+   *  Returns 0 once the arena is full, or if it could not be mapped.
+   */
+  template< typename T >
+  T* allocate( size_t count )
+  {
+    static_assert( std::is_trivially_destructible< T >::value, "Objects in an ArenaStorage are never destructed" );
+
+    const size_t offset = ( m_used + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 );
+    const size_t size = count * sizeof( T );
+
+    if ( ! m_address || offset > m_length || size > m_length - offset )
+      return 0;
+
+    m_used = offset + size;
+    return reinterpret_cast< T* >( static_cast< char* >( m_address ) + offset );
+  }
+
+  //! Bytes needed to allocate count objects of type T after used bytes
+  template< typename T >
+  static size_t extent( size_t used, size_t count )
+  {
+    return ( ( used + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 ) ) + count * sizeof( T );
+  }
+
+  //! Size of the mapping, zero if it could not be made
+  size_t length() const { return m_length; }
+
+  //! Bytes handed out so far, including alignment
+  size_t used() const { return m_used; }
+
+  //! Returns true if the mapping is backed by huge pages, as far as can be told
+  bool hugePages() const { return m_hugePages; }
+
+private:
+
+  ArenaStorage( const ArenaStorage& );
+  ArenaStorage& operator=( const ArenaStorage& );
+
+  void* m_address;
+  size_t m_length;
+  size_t m_used;
+  bool m_hugePages;
+};
+
+
+/*! \brief Storage for a tree in a memory mapped file, unmapped on deletion
+ */
+class MappedStorage : public TreeStorage
+{
+public:
+
+  MappedStorage( void* address, size_t length )
+   : m_address( address ), m_length( length ) {}
+
+  ~MappedStorage()
+  {
+    munmap( m_address, m_length );
+  }
+
+  const char* address() const { return static_cast< const char* >( m_address ); }
+  size_t length() const { return m_length; }
+
+private:
+
+  void* m_address;
+  size_t m_length;
+};
+
+
+}; // namespace kd
+
+#endif // STORAGE
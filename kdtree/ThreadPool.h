@@ -0,0 +1,226 @@
+#ifndef THREADPOOL
+#define THREADPOOL
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+namespace kd
+{
+
+class TaskGroup;
+
+/*! \brief Which of a number of slots the calling thread should use, for counters kept per thread
+ *
+ *  Threads are numbered in the order they first ask, so the first threads
+ *  to ask, up to the number of slots, never share one.
+ */
+inline unsigned int threadSlot( unsigned int slots )
+{
+  static std::atomic< unsigned int > next( 0 );
+  static thread_local unsigned int index = next.fetch_add( 1, std::memory_order_relaxed );
+  return index % slots;
+}
+
+
+/*! \brief Unit of work run by a ThreadPool
+ */
+class Task
+{
+public:
+  Task() : m_group( 0 ) {}
+  virtual ~Task() {}
+
+  virtual void run() = 0;
+
+private:
+  friend class TaskGroup;
+  friend class ThreadPool;
+
+  //! Group waiting on this task, if any
+  TaskGroup* m_group;
+};
+
+
+/*! \brief Fixed set of worker threads sharing a queue of tasks
+ *
+ *  A pool of n threads starts n - 1 workers. The remaining thread is the
+ *  caller, which runs queued tasks while it waits on a TaskGroup, so a pool
+ *  of one thread simply runs everything on the calling thread.
+ */
+class ThreadPool
+{
+public:
+
+  //! Create a pool of the given size, or one per hardware thread when 0
+  explicit ThreadPool( unsigned int threads = 0 )
+   : m_stop( false )
+  {
+    if ( threads == 0 )
+      threads = std::thread::hardware_concurrency();
+
+    for ( unsigned int i=1; i<threads; ++i )
+      m_workers.push_back( std::thread( &ThreadPool::work, this ) );
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard< std::mutex > lock( m_mutex );
+      m_stop = true;
+    }
+    m_ready.notify_all();
+
+    for ( unsigned int i=0; i<m_workers.size(); ++i )
+      m_workers[ i ].join();
+  }
+
+  //! Number of threads working on tasks, including the waiting caller
+  unsigned int threads() const { return m_workers.size() + 1; }
+
+  //! Queue a task, the pool deletes it once it has run
+  void push( Task* task )
+  {
+    {
+      std::lock_guard< std::mutex > lock( m_mutex );
+      m_tasks.push_back( task );
+    }
+    m_ready.notify_one();
+    m_progress.notify_all();
+  }
+
+  //! Run a single queued task on the calling thread, returns false if there were none
+  bool runOne()
+  {
+    Task* task = 0;
+    {
+      std::lock_guard< std::mutex > lock( m_mutex );
+      if ( m_tasks.empty() )
+        return false;
+
+      task = m_tasks.front();
+      m_tasks.pop_front();
+    }
+
+    execute( task );
+    return true;
+  }
+
+  /*! \brief Blocks until pending is zero or a task is queued
+   *
+   *  Whoever brings pending to zero must call finished afterwards.
+   */
+  void idle( const std::atomic< unsigned int >& pending )
+  {
+    std::unique_lock< std::mutex > lock( m_mutex );
+    while ( pending.load() != 0 && m_tasks.empty() )
+      m_progress.wait( lock );
+  }
+
+private:
+
+  //! Wakes threads in idle once the count they wait on has reached zero
+  void finished()
+  {
+    std::lock_guard< std::mutex > lock( m_mutex );
+    m_progress.notify_all();
+  }
+
+  void work()
+  {
+    for ( ;; )
+    {
+      Task* task = 0;
+      {
+        std::unique_lock< std::mutex > lock( m_mutex );
+        while ( ! m_stop && m_tasks.empty() )
+          m_ready.wait( lock );
+
+        if ( m_tasks.empty() )
+          return;
+
+        task = m_tasks.front();
+        m_tasks.pop_front();
+      }
+
+      execute( task );
+    }
+  }
+
+  inline void execute( Task* task );
+
+private:
+
+  std::vector< std::thread > m_workers;
+  std::deque< Task* > m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_progress;
+  bool m_stop;
+};
+
+
+/*! \brief Tracks a set of tasks so that they can be waited on together
+ *
+ *  Tasks may add further tasks to their own group while running.
+ */
+class TaskGroup
+{
+public:
+
+  TaskGroup( ThreadPool& pool )
+   : m_pool( pool ), m_pending( 0 ) {}
+
+  ~TaskGroup() { wait(); }
+
+  ThreadPool& pool() const { return m_pool; }
+
+  //! Queue a task as part of this group
+  void run( Task* task )
+  {
+    task->m_group = this;
+    m_pending.fetch_add( 1 );
+    m_pool.push( task );
+  }
+
+  /*! \brief Wait for every task in the group, helping to run queued tasks meanwhile
+   *
+   *  When there is nothing queued the caller sleeps until either a task is
+   *  queued or the last task of the group has finished.
+   */
+  void wait()
+  {
+    while ( m_pending.load() != 0 )
+    {
+      if ( ! m_pool.runOne() )
+        m_pool.idle( m_pending );
+    }
+  }
+
+private:
+  friend class ThreadPool;
+
+  ThreadPool& m_pool;
+  std::atomic< unsigned int > m_pending;
+};
+
+
+void ThreadPool::execute( Task* task )
+{
+  task->run();
+
+  TaskGroup* group = task->m_group;
+  delete task;
+
+  // The group may be gone as soon as its count reaches zero, only the pool is used after
+  if ( group && group->m_pending.fetch_sub( 1 ) == 1 )
+    finished();
+}
+
+
+}; // namespace kd
+
+#endif // THREADPOOL
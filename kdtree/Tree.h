@@ -3,80 +3,1081 @@
 
 #include "Bounds.h"
 #include "Node.h"
+#include "QueryContext.h"
+#include "Data.h"
 #include "Measurer.h"
+#include "Metric.h"
+#include "Morton.h"
+#include "Quantized.h"
+#include "Search.h"
+#include "Simd.h"
+#include "Storage.h"
+#include "ThreadPool.h"
 
 #include <vector>
+#include <algorithm>
+#include <limits>
 
-namespace kd 
+namespace kd
 {
 
-//! \brief Tree which provides search interface
-template< typename P, unsigned int DIM >
+/*! \brief Tree which provides search interface
+ *
+ *  M is the metric distances are measured with, see Metric.h. All of the
+ *  distances the tree reports are in its units, which for the default are
+ *  squared Euclidean distances.
+ *
+ *  I is what the tree holds for each point and what searches report. By
+ *  default that is a copy of the point, while an IndexTree only holds a
+ *  PointIndex into points the caller keeps, see TreeFactory::createIndexed.
+ */
+template< typename P, unsigned int DIM, typename M = EuclideanMetric< typename P::base_type >, typename I = P >
 class Tree
 {
 public:
 
-  Tree( Node< P, DIM >* node, const Measurer& measurer, const BoundsFactory& boundsFactory )
-   : m_node( node ), m_measurer( measurer ), m_boundsFactory( boundsFactory ) {}
+  typedef typename VectorStorage< P, I >::NodeList NodeList;
+  typedef typename VectorStorage< P, I >::PointList PointList;
+  typedef typename VectorStorage< P, I >::CoordinateList CoordinateList;
+
+  //! What the tree holds for each point
+  typedef I Item;
+
+  //! Working memory for searching the tree without allocating, see QueryContext
+  typedef QueryContext< typename P::base_type, I > Context;
+
+  //! Largest number of points a leaf may hold
+  static const unsigned int MAX_BUCKET_SIZE = 256;
+
+  /*! \brief Create a Tree from flattened nodes and the points of their leaves
+   *
+   *  The contents of nodes and points are swapped into the tree, leaving the
+   *  provided lists empty. The bounds should enclose all of the points. Only
+   *  for trees holding copies of their points.
+   */
+  Tree(
+      NodeList& nodes,
+      PointList& points,
+      const Bounds< P, DIM >& bounds,
+      const Measurer& measurer,
+      const BoundsFactory& boundsFactory,
+      const M& metric = M()
+      )
+   : m_bounds( bounds ), m_metric( metric ), m_measurer( measurer ), m_boundsFactory( boundsFactory )
+  {
+    VectorStorage< P, I >* storage = new VectorStorage< P, I >;
+    storage->nodes.swap( nodes );
+    storage->points.swap( points );
+    createCoordinates( storage->nodes, storage->points, storage->coordinates );
+
+    m_storage = storage;
+    m_nodes = storage->nodes.data();
+    m_nodeCount = storage->nodes.size();
+    m_points = storage->points.data();
+    m_pointCount = storage->points.size();
+    m_coordinates = storage->coordinates.data();
+    m_quantized = 0;
+
+    setSimdLevel( detectSimdLevel() );
+  }
+
+  /*! \brief Create a Tree over arrays held elsewhere, such as in a mapped file
+   *
+   *  The tree takes ownership of the storage, which must keep the arrays
+   *  alive. The coordinates are the points of each leaf structure-of-arrays,
+   *  as laid out by createCoordinates. A tree holding copies of its points
+   *  may be given quantized leaves in place of the coordinates, which must
+   *  then be null.
+   */
+  Tree(
+      TreeStorage* storage,
+      const Node< P >* nodes,
+      unsigned int nodeCount,
+      const I* points,
+      unsigned int pointCount,
+      const typename P::base_type* coordinates,
+      const Bounds< P, DIM >& bounds,
+      const Measurer& measurer,
+      const BoundsFactory& boundsFactory,
+      const M& metric = M(),
+      const QuantizedLeaves< P, DIM >* quantized = 0
+      )
+   : m_storage( storage ),
+     m_nodes( nodes ), m_nodeCount( nodeCount ),
+     m_points( points ), m_pointCount( pointCount ),
+     m_coordinates( coordinates ), m_quantized( quantized ),
+     m_bounds( bounds ), m_metric( metric ), m_measurer( measurer ), m_boundsFactory( boundsFactory )
+  {
+    setSimdLevel( detectSimdLevel() );
+  }
 
   ~Tree()
   {
-    delete m_node;
+    delete m_storage;
   }
 
+  /*! \brief Fill in the structure-of-arrays copy of each leaf's points
+   *
+   *  Each leaf's block starts at DIM times the index of its first point.
+   */
+  static void createCoordinates( const NodeList& nodes, const PointList& points, CoordinateList& coordinates );
+
+  /*! \brief As above for arrays held elsewhere, coordinates must have room for DIM per point
+   *
+   *  access reads the point of each item, see PointAccess and IndexAccess.
+   */
+  template< typename A >
+  static void createCoordinates(
+      const Node< P >* nodes,
+      unsigned int nodeCount,
+      const I* points,
+      typename P::base_type* coordinates,
+      const A& access
+      );
+
   //! Find nearest neighbour to given point
-  NeighbourData< P > nearestNeighbour( const P& target, const Bounds< P, DIM >& bounds ) const;
+  NeighbourData< I > nearestNeighbour( const P& target, const Bounds< P, DIM >& bounds ) const;
 
   //! Find "num" nearest neighbours to the given point
-  MultiNeighbourData< P > nearestNeighbours(
+  MultiNeighbourData< I > nearestNeighbours(
       unsigned int num,
       const P& target,
       const Bounds< P, DIM >& bounds
       ) const;
 
+  /*! \brief Find an approximate nearest neighbour to the given point
+   *
+   *  See SearchOptions for the error allowed. When stats is given the work
+   *  done is added to it.
+   */
+  NeighbourData< I > nearestNeighbour(
+      const P& target,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      SearchStats* stats = 0
+      ) const;
+
+  //! Find approximate "num" nearest neighbours to the given point
+  MultiNeighbourData< I > nearestNeighbours(
+      unsigned int num,
+      const P& target,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      SearchStats* stats = 0
+      ) const;
+
+  /*! \brief Find the nearest neighbour to target with the working memory of context
+   *
+   *  Searches the whole tree, starting without a radius rather than working
+   *  one out from bounds. Once the context has grown to fit, no memory is
+   *  allocated.
+   */
+  NeighbourData< I > nearestNeighbour(
+      const P& target,
+      Context& context,
+      const SearchOptions& options = SearchOptions(),
+      SearchStats* stats = 0
+      ) const
+  {
+    NeighbourData< I > data( std::numeric_limits< typename P::base_type >::max() );
+    search( target, data, context, options, stats );
+    return data;
+  }
+
+  /*! \brief Find "num" nearest neighbours to target, collecting them in context
+   *
+   *  The list points into the context and is only valid until its next
+   *  query.
+   */
+  typename MultiNeighbourData< I >::PointDistanceList nearestNeighbours(
+      unsigned int num,
+      const P& target,
+      Context& context,
+      const SearchOptions& options = SearchOptions(),
+      SearchStats* stats = 0
+      ) const
+  {
+    MultiNeighbourData< I > data( num, std::numeric_limits< typename P::base_type >::max(), context.neighbours( num ) );
+    search( target, data, context, options, stats );
+    return data.points();
+  }
+
+  /*! \brief Find the nearest neighbour of each of "count" targets using a pool of threads
+   *
+   *  See the batch version of nearestNeighbours.
+   */
+  void nearestNeighbour(
+      const P* targets,
+      unsigned int count,
+      I* neighbours,
+      typename P::base_type* distancesSq,
+      ThreadPool& pool
+      ) const
+  {
+    nearestNeighbours( 1, targets, count, neighbours, distancesSq, pool );
+  }
+
+  /*! \brief Find "num" nearest neighbours of each of "count" targets using a pool of threads
+   *
+   *  The neighbours of targets[ i ] are written nearest first from
+   *  neighbours[ i * num ] onwards and their distances squared to the same
+   *  positions of distancesSq, which may be null. When the tree holds fewer
+   *  than num points the remaining entries are left untouched.
+   *
+   *  The targets are searched in Morton order so that each thread works
+   *  through queries that are close together and so share the parts of the
+   *  tree in cache.
+   */
+  void nearestNeighbours(
+      unsigned int num,
+      const P* targets,
+      unsigned int count,
+      I* neighbours,
+      typename P::base_type* distancesSq,
+      ThreadPool& pool
+      ) const;
+
+  /*! \brief Calls visitor( point, distanceSq ) for each point closer than radius to target
+   *
+   *  Returning false from the visitor ends the search early.
+   */
+  template< typename V >
+  void withinRadius( const P& target, typename P::base_type radius, V& visitor ) const
+  {
+    RadiusData< I, V > data( m_metric.fromLength( radius ), visitor );
+    search( target, data, m_bounds );
+  }
+
+  /*! \brief Copies up to "capacity" of the points closer than radius to target into points
+   *
+   *  Returns how many points are within the radius, which may be more than
+   *  were copied.
+   */
+  unsigned int withinRadius( const P& target, typename P::base_type radius, I* points, unsigned int capacity ) const
+  {
+    BufferVisitor< I > visitor( points, capacity );
+    withinRadius( target, radius, visitor );
+    return visitor.count();
+  }
+
+  //! Count the points closer than radius to target, stopping once limit are found
+  unsigned int countWithinRadius( const P& target, typename P::base_type radius, unsigned int limit = ~0u ) const
+  {
+    if ( limit == 0 )
+      return 0;
+
+    CountVisitor< I > visitor( limit );
+    withinRadius( target, radius, visitor );
+    return visitor.count();
+  }
+
+  /*! \brief Calls visitor( point ) for each point inside box, including its boundary
+   *
+   *  Returning false from the visitor ends the search early.
+   */
+  template< typename V >
+  void withinBox( const Bounds< P, DIM >& box, V& visitor ) const;
+
+  /*! \brief Copies up to "capacity" of the points inside box into points
+   *
+   *  Returns how many points are inside the box, which may be more than
+   *  were copied.
+   */
+  unsigned int withinBox( const Bounds< P, DIM >& box, I* points, unsigned int capacity ) const
+  {
+    BufferVisitor< I > visitor( points, capacity );
+    withinBox( box, visitor );
+    return visitor.count();
+  }
+
+  //! Count the points inside box, stopping once limit are found
+  unsigned int countWithinBox( const Bounds< P, DIM >& box, unsigned int limit = ~0u ) const
+  {
+    if ( limit == 0 )
+      return 0;
+
+    CountVisitor< I > visitor( limit );
+    withinBox( box, visitor );
+    return visitor.count();
+  }
+
+  /*! \brief Visit the points which could improve data, nearest cells first
+   *
+   *  The search is compiled for the type of data it is given, so for the
+   *  final Data classes, and any other type with the same members, the calls
+   *  to update the data are inlined into the traversal. Passing a Data< I >&
+   *  searches through its virtual functions instead.
+   */
+  template< typename D >
+  void search( const P& target, D& data, const Bounds< P, DIM >& bounds ) const
+  {
+    search( target, data, bounds, SearchOptions() );
+  }
+
+  /*! \brief Visit the points which could improve data within the error allowed by options
+   *
+   *  The options also pick the order cells are visited in. When stats is
+   *  given the work done is added to it.
+   */
+  template< typename D >
+  void search(
+      const P& target,
+      D& data,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      SearchStats* stats = 0
+      ) const
+  {
+    SearchStack< typename P::base_type > stack;
+
+    if ( stats )
+    {
+      SearchCounter counter( stats );
+      traverse( target, data, bounds, options, counter, stack, threadQueue() );
+    }
+    else
+    {
+      NoSearchCounter counter;
+      traverse( target, data, bounds, options, counter, stack, threadQueue() );
+    }
+  }
+
+  //! Search the whole tree with the working memory of context, see QueryContext
+  template< typename D >
+  void search(
+      const P& target,
+      D& data,
+      Context& context,
+      const SearchOptions& options = SearchOptions(),
+      SearchStats* stats = 0
+      ) const
+  {
+    if ( stats )
+    {
+      SearchCounter counter( stats );
+      traverse( target, data, m_bounds, options, counter, context.stack(), context.queue() );
+    }
+    else
+    {
+      NoSearchCounter counter;
+      traverse( target, data, m_bounds, options, counter, context.stack(), context.queue() );
+    }
+  }
+
+  //! Number of points in the tree
+  unsigned int size() const { return m_pointCount; }
+
+  /*! \brief The points in the tree, or their indices, in the order of the leaves they belong to
+   *
+   *  The leaves are in depth-first order, so the points of neighbouring
+   *  leaves are next to each other. The indices of an index tree are the
+   *  permutation which would store the caller's points the same way.
+   */
+  const I* points() const { return m_points; }
+
+  //! Number of nodes in the tree
+  unsigned int nodeCount() const { return m_nodeCount; }
+
+  //! The nodes of the tree in pre-order
+  const Node< P >* nodes() const { return m_nodes; }
+
+  //! Coordinates of the points, see createCoordinates. Null when the leaves are quantized
+  const typename P::base_type* coordinates() const { return m_coordinates; }
+
+  //! How the coordinates of the points in the leaves are kept, see TreeFactory::setLeafPrecision
+  LeafPrecision leafPrecision() const { return m_quantized ? m_quantized->precision() : LEAF_EXACT; }
+
+  //! Bounds enclosing all of the points in the tree
+  const Bounds< P, DIM >& bounds() const { return m_bounds; }
+
+  //! Bytes taken by the nodes, points and the coordinates or quantized leaves
+  size_t memory() const
+  {
+    return size_t( m_nodeCount ) * sizeof( Node< P > ) + size_t( m_pointCount ) * sizeof( I )
+      + ( m_quantized ? m_quantized->memory() : size_t( m_pointCount ) * DIM * sizeof( typename P::base_type ) );
+  }
+
+  /*! \brief Choose the instruction set used to measure distances to the points of leaves
+   *
+   *  The best one supported by the CPU is used by default, asking for a
+   *  better one than that has no effect.
+   */
+  void setSimdLevel( SimdLevel level )
+  {
+    m_simdLevel = level < detectSimdLevel() ? level : detectSimdLevel();
+    m_metric.setSimdLevel( m_simdLevel );
+  }
+
+  //! Instruction set used to measure distances to the points of leaves
+  SimdLevel simdLevel() const { return m_simdLevel; }
+
+  //! The metric distances are measured with
+  const M& metric() const { return m_metric; }
+
 private:
 
-  Node< P, DIM >* m_node;
+  // Trees own their storage so are not copied
+  Tree( const Tree& );
+  Tree& operator=( const Tree& );
+
+  //! Number of batch queries given to a thread at a time
+  static const unsigned int BATCH_GRAIN = 256;
+
+  /*! \brief Searches part of a batch of queries
+   */
+  class BatchTask : public Task
+  {
+  public:
+
+    BatchTask(
+        const Tree& tree,
+        unsigned int num,
+        const P* targets,
+        const unsigned int* order,
+        unsigned int count,
+        I* neighbours,
+        typename P::base_type* distancesSq
+        )
+     : m_tree( tree ), m_num( num ), m_targets( targets ), m_order( order ), m_count( count ),
+       m_neighbours( neighbours ), m_distancesSq( distancesSq ) {}
+
+    void run();
+
+  private:
+
+    const Tree& m_tree;
+    const unsigned int m_num;
+    const P* m_targets;
+    const unsigned int* m_order;
+    const unsigned int m_count;
+    I* m_neighbours;
+    typename P::base_type* m_distancesSq;
+  };
+
+  /*! \brief Runs the traversal options ask for, counting its work with counter
+   *
+   *  C is SearchCounter or NoSearchCounter, see SearchCounter.
+   */
+  template< typename D, typename C >
+  void traverse(
+      const P& target,
+      D& data,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      C& counter,
+      SearchStack< typename P::base_type >& stack,
+      SearchQueue< typename P::base_type >& queue
+      ) const
+  {
+    if ( options.traversal == TRAVERSAL_BEST_FIRST )
+      searchBestFirst( target, data, bounds, options, counter, queue );
+    else
+      searchDepthFirst( target, data, bounds, options, counter, stack );
+
+    counter.finish();
+  }
+
+  //! Search finishing the near side of each split before the far side
+  template< typename D, typename C >
+  void searchDepthFirst(
+      const P& target,
+      D& data,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      C& counter,
+      SearchStack< typename P::base_type >& stack
+      ) const;
+
+  //! Search always carrying on from the closest cell not yet searched
+  template< typename D, typename C >
+  void searchBestFirst(
+      const P& target,
+      D& data,
+      const Bounds< P, DIM >& bounds,
+      const SearchOptions& options,
+      C& counter,
+      SearchQueue< typename P::base_type >& queue
+      ) const;
+
+  /*! \brief Hands the points of a leaf which could improve data to it
+   *
+   *  index is the position of the leaf in the nodes and distancesSq has room
+   *  for MAX_BUCKET_SIZE points, a whole number of any kernel's vectors. A
+   *  quantized leaf is first measured from its codes, then only the points
+   *  whose lower bound beats the radius are measured exactly.
+   */
+  template< typename D, typename C >
+  void searchLeaf(
+      unsigned int index,
+      const Node< P >& leaf,
+      const P& target,
+      const typename P::base_type* coords,
+      D& data,
+      C& counter,
+      typename P::base_type* distancesSq
+      ) const
+  {
+    counter.leaf( leaf.count );
+
+    if ( ! m_quantized )
+    {
+      // Measure the whole bucket at once and hand it over in one go
+      m_metric.distances( &m_coordinates[ leaf.first * DIM ], leaf.count, coords, DIM, distancesSq );
+      data.updateBulk( &m_points[ leaf.first ], distancesSq, leaf.count );
+      return;
+    }
+
+    m_quantized->lowerBounds( m_metric, m_simdLevel, index, leaf, coords, distancesSq );
+
+    for ( unsigned int j=0; j<leaf.count; ++j )
+    {
+      if ( distancesSq[ j ] < data.maxDistanceSq() || data.incomplete() )
+      {
+        counter.refined();
+
+        // Only updateBulk is asked of the data, as for exact leaves
+        const typename P::base_type distanceSq = exactDistance( target, m_points[ leaf.first + j ] );
+        data.updateBulk( &m_points[ leaf.first + j ], &distanceSq, 1 );
+      }
+    }
+  }
+
+  //! Distance to a point the tree holds a copy of, to re-rank quantized leaves with
+  typename P::base_type exactDistance( const P& target, const P& point ) const
+  {
+    return pointDistance( m_metric, target, point, DIM );
+  }
+
+  //! Index trees are never quantized, they have no copies of the points to re-rank with
+  template< typename X >
+  typename P::base_type exactDistance( const P&, const X& ) const
+  {
+    return std::numeric_limits< typename P::base_type >::max();
+  }
+
+  //! Coordinate d of a point the tree holds a copy of
+  static typename P::base_type itemCoordinate( const P& point, unsigned int d ) { return point[ d ]; }
+
+  //! Index trees are never quantized, so always have their coordinates
+  template< typename X >
+  static typename P::base_type itemCoordinate( const X&, unsigned int ) { return typename P::base_type( 0 ); }
+
+  //! Distance from target to the farthest point the bounds could hold
+  typename P::base_type farthestDistance( const P& target, const Bounds< P, DIM >& bounds ) const
+  {
+    typename P::base_type distance( 0 );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      m_metric.combine( distance, m_metric.farthestTerm( d, target[ d ], bounds.min()[ d ], bounds.max()[ d ] ) );
+    }
+
+    return distance;
+  }
+
+  /*! \brief Offsets from bounds to target along each axis
+   *
+   *  Returns the distance to the bounds they add up to.
+   */
+  typename P::base_type cellOffsets(
+      const typename P::base_type* target,
+      const Bounds< P, DIM >& bounds,
+      typename P::base_type* offsets
+      ) const;
+
+  //! The best-first queue of the calling thread, reused by all its searches
+  static SearchQueue< typename P::base_type >& threadQueue()
+  {
+    static thread_local SearchQueue< typename P::base_type > queue;
+    return queue;
+  }
+
+  TreeStorage* m_storage;
+
+  const Node< P >* m_nodes;
+  unsigned int m_nodeCount;
+
+  const I* m_points;
+  unsigned int m_pointCount;
+
+  //! Coordinates of the points, a structure-of-arrays block per leaf
+  const typename P::base_type* m_coordinates;
+
+  //! The leaves quantized in place of the coordinates, owned by the storage
+  const QuantizedLeaves< P, DIM >* m_quantized;
+
+  const Bounds< P, DIM > m_bounds;
+
+  SimdLevel m_simdLevel;
+  M m_metric;
+
   const Measurer m_measurer;
   const BoundsFactory m_boundsFactory;
 
 };
 
-template< typename P, unsigned int DIM >
-NeighbourData< P > Tree< P, DIM >::nearestNeighbour(
+template< typename P, unsigned int DIM, typename M, typename I >
+NeighbourData< I > Tree< P, DIM, M, I >::nearestNeighbour(
     const P& target,
     const Bounds< P, DIM >& bounds
     ) const
 {
-  P farthest = bounds.farthestPoint( target );
-  typename P::base_type maxDistanceSq = m_measurer.distanceSq< P, DIM >( farthest, target );
-  NeighbourData< P > data( maxDistanceSq );
+  typename P::base_type maxDistanceSq = farthestDistance( target, bounds );
+  NeighbourData< I > data( maxDistanceSq );
 
-  m_node->search( target, data, bounds );
+  search( target, data, bounds );
 
   return data;
 }
 
 
-template< typename P, unsigned int DIM >
-MultiNeighbourData< P > Tree< P, DIM >::nearestNeighbours(
+template< typename P, unsigned int DIM, typename M, typename I >
+MultiNeighbourData< I > Tree< P, DIM, M, I >::nearestNeighbours(
     unsigned int num,
     const P& target,
     const Bounds< P, DIM >& bounds
     ) const
 {
-  P farthest = bounds.farthestPoint( target );
-  typename P::base_type maxDistanceSq = m_measurer.distanceSq< P, DIM >( farthest, target );
-  MultiNeighbourData< P > data( num, maxDistanceSq );
+  typename P::base_type maxDistanceSq = farthestDistance( target, bounds );
+  MultiNeighbourData< I > data( num, maxDistanceSq );
+
+  search( target, data, bounds );
+
+  return data;
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+NeighbourData< I > Tree< P, DIM, M, I >::nearestNeighbour(
+    const P& target,
+    const Bounds< P, DIM >& bounds,
+    const SearchOptions& options,
+    SearchStats* stats
+    ) const
+{
+  typename P::base_type maxDistanceSq = farthestDistance( target, bounds );
+  NeighbourData< I > data( maxDistanceSq );
+
+  search( target, data, bounds, options, stats );
+
+  return data;
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+MultiNeighbourData< I > Tree< P, DIM, M, I >::nearestNeighbours(
+    unsigned int num,
+    const P& target,
+    const Bounds< P, DIM >& bounds,
+    const SearchOptions& options,
+    SearchStats* stats
+    ) const
+{
+  typename P::base_type maxDistanceSq = farthestDistance( target, bounds );
+  MultiNeighbourData< I > data( num, maxDistanceSq );
 
-  m_node->search( target, data, bounds );
+  search( target, data, bounds, options, stats );
 
   return data;
 }
 
 
+template< typename P, unsigned int DIM, typename M, typename I >
+void Tree< P, DIM, M, I >::nearestNeighbours(
+    unsigned int num,
+    const P* targets,
+    unsigned int count,
+    I* neighbours,
+    typename P::base_type* distancesSq,
+    ThreadPool& pool
+    ) const
+{
+  if ( count == 0 || num == 0 )
+    return;
+
+  // Hilbert order keeps consecutive queries a little closer, but the
+  // searches run no faster for it and the codes take longer to compute
+  std::vector< unsigned int > order;
+  curveOrder( PointView< P >( targets, count ), m_bounds, CURVE_MORTON, order );
+
+  TaskGroup group( pool );
+
+  for ( unsigned int i=0; i<count; i+=BATCH_GRAIN )
+  {
+    const unsigned int n = count - i < BATCH_GRAIN ? count - i : BATCH_GRAIN;
+    group.run( new BatchTask( *this, num, targets, &order[ i ], n, neighbours, distancesSq ) );
+  }
+
+  group.wait();
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+void Tree< P, DIM, M, I >::BatchTask::run()
+{
+  // Every query starts with an unbounded radius rather than one from the
+  // bounds as the search quickly finds its first candidates anyway, and
+  // they all share one context so the task only allocates up front
+  Context context( m_num );
+
+  for ( unsigned int i=0; i<m_count; ++i )
+  {
+    const unsigned int query = m_order[ i ];
+    const unsigned int first = query * m_num;
+
+    if ( m_num == 1 )
+    {
+      const NeighbourData< I > data = m_tree.nearestNeighbour( m_targets[ query ], context );
+
+      if ( data.incomplete() )
+        continue;
+
+      m_neighbours[ first ] = data.point();
+      if ( m_distancesSq )
+        m_distancesSq[ first ] = data.maxDistanceSq();
+    }
+    else
+    {
+      const typename MultiNeighbourData< I >::PointDistanceList neighbours = m_tree.nearestNeighbours( m_num, m_targets[ query ], context );
+
+      typename MultiNeighbourData< I >::PointDistanceList::const_iterator it = neighbours.begin();
+
+      for ( unsigned int j=first; it != neighbours.end(); ++it, ++j )
+      {
+        m_neighbours[ j ] = it->point;
+        if ( m_distancesSq )
+          m_distancesSq[ j ] = it->distSq;
+      }
+    }
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+template< typename V >
+void Tree< P, DIM, M, I >::withinBox( const Bounds< P, DIM >& box, V& visitor ) const
+{
+  if ( m_nodeCount == 0 )
+    return;
+
+  NodeStack stack;
+  stack.push( 0 );
+
+  while ( ! stack.empty() )
+  {
+    unsigned int index = stack.pop();
+
+    // Follow the lower side of each split straight down, only the upper sides wait on the stack
+    while ( ! m_nodes[ index ].leaf() )
+    {
+      const Node< P >& node = m_nodes[ index ];
+      const bool lower = box.min()[ node.dim ] <= node.split;
+      const bool upper = box.max()[ node.dim ] >= node.split;
+
+      if ( lower && upper )
+        stack.push( index + node.right );
+
+      if ( ! lower && ! upper )
+        break;
+
+      index = lower ? index + 1 : index + node.right;
+    }
+
+    const Node< P >& node = m_nodes[ index ];
+
+    if ( node.leaf() )
+    {
+      // Test the coordinates rather than the points, which an index tree
+      // does not hold. A quantized tree has no coordinates but does hold
+      // its points
+      const typename P::base_type* block = m_coordinates ? &m_coordinates[ node.first * DIM ] : 0;
+
+      for ( unsigned int j=0; j<node.count; ++j )
+      {
+        bool inside = true;
+
+        for ( unsigned int d=0; d<DIM && inside; ++d )
+        {
+          const typename P::base_type value = block ? block[ d * node.count + j ] : itemCoordinate( m_points[ node.first + j ], d );
+          inside = box.min()[ d ] <= value && value <= box.max()[ d ];
+        }
+
+        if ( inside && ! visitor( m_points[ node.first + j ] ) )
+          return;
+      }
+    }
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+void Tree< P, DIM, M, I >::createCoordinates( const NodeList& nodes, const PointList& points, CoordinateList& coordinates )
+{
+  coordinates.resize( points.size() * DIM );
+
+  createCoordinates( nodes.data(), nodes.size(), points.data(), coordinates.data(), PointAccess< P >() );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+template< typename A >
+void Tree< P, DIM, M, I >::createCoordinates(
+    const Node< P >* nodes,
+    unsigned int nodeCount,
+    const I* points,
+    typename P::base_type* coordinates,
+    const A& access
+    )
+{
+  for ( unsigned int i=0; i<nodeCount; ++i )
+  {
+    const Node< P >& node = nodes[ i ];
+
+    if ( ! node.leaf() )
+      continue;
+
+    typename P::base_type* block = &coordinates[ node.first * DIM ];
+
+    for ( unsigned int j=0; j<node.count; ++j )
+    {
+      const P& point = access( points[ node.first + j ] );
+
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        block[ d * node.count + j ] = point[ d ];
+      }
+    }
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+typename P::base_type Tree< P, DIM, M, I >::cellOffsets(
+    const typename P::base_type* target,
+    const Bounds< P, DIM >& bounds,
+    typename P::base_type* offsets
+    ) const
+{
+  typename P::base_type cellDistanceSq( 0 );
+
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    offsets[ d ] = target[ d ] < bounds.min()[ d ] ? target[ d ] - bounds.min()[ d ]
+      : target[ d ] > bounds.max()[ d ] ? target[ d ] - bounds.max()[ d ]
+      : typename P::base_type( 0 );
+
+    m_metric.combine( cellDistanceSq, m_metric.cellTerm( d, target[ d ], offsets[ d ] ) );
+  }
+
+  return cellDistanceSq;
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+template< typename D, typename C >
+void Tree< P, DIM, M, I >::searchDepthFirst(
+    const P& target,
+    D& data,
+    const Bounds< P, DIM >& bounds,
+    const SearchOptions& options,
+    C& counter,
+    SearchStack< typename P::base_type >& stack
+    ) const
+{
+  if ( m_nodeCount == 0 || options.maxLeaves == 0 )
+    return;
+
+  // Cells are compared against the current radius shrunk by ( 1 + epsilon ),
+  // which is the same as growing their distance by it. One for exact searches
+  const typename P::base_type scale = m_metric.approximation( options.epsilon );
+
+  unsigned int leaves = 0;
+
+  typename P::base_type coords[ DIM ];
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    coords[ d ] = target[ d ];
+  }
+
+  typename P::base_type distancesSq[ MAX_BUCKET_SIZE ];
+
+  // Offsets from the current cell to the target along each axis and the
+  // squared distance they add up to. Descending to the near side of a split
+  // changes neither, and crossing to the far side only changes the offset
+  // along the split axis, so each step is O(1) rather than building Bounds.
+  typename P::base_type offsets[ DIM ];
+  typename P::base_type cellDistanceSq = cellOffsets( coords, bounds, offsets );
+
+  typedef typename SearchStack< typename P::base_type >::Entry SearchEntry;
+
+  stack.clear();
+  unsigned int index = 0;
+
+  for ( ;; )
+  {
+    const Node< P >& node = m_nodes[ index ];
+    counter.node();
+
+    if ( node.leaf() )
+    {
+      searchLeaf( index, node, target, coords, data, counter, distancesSq );
+
+      if ( ++leaves == options.maxLeaves )
+        break;
+    }
+    else
+    {
+      // Find out which side of the split the target is in and so decide
+      // which child to descend into first
+      const unsigned int dim = node.dim;
+      const bool inLeft = coords[ dim ] <= node.split;
+      const unsigned int nearNode = inLeft ? index + 1 : index + node.right;
+      const unsigned int farNode = inLeft ? index + node.right : index + 1;
+
+      const typename P::base_type farOffset = coords[ dim ] - node.split;
+      const typename P::base_type farDistanceSq = m_metric.replace( cellDistanceSq,
+          m_metric.cellTerm( dim, coords[ dim ], offsets[ dim ] ), m_metric.cellTerm( dim, coords[ dim ], farOffset ) );
+
+      stack.push( SearchEntry( farNode, dim, farOffset, farDistanceSq ) );
+
+      index = nearNode;
+      continue;
+    }
+
+    // Check if it is worth looking in any of the cells we skipped. It is
+    // worth it if some of the cell lies within our current distanceSq radius
+    bool found = false;
+
+    while ( ! found && ! stack.empty() )
+    {
+      const SearchEntry entry = stack.pop();
+
+      if ( entry.node == SearchEntry::RESTORE )
+      {
+        offsets[ entry.dim ] = entry.offset;
+        continue;
+      }
+
+      if ( entry.distanceSq * scale < data.maxDistanceSq() || data.incomplete() )
+      {
+        // Remember the offset to put back when this cell is finished with
+        stack.push( SearchEntry( SearchEntry::RESTORE, entry.dim, offsets[ entry.dim ], 0 ) );
+
+        offsets[ entry.dim ] = entry.offset;
+        cellDistanceSq = entry.distanceSq;
+        index = entry.node;
+        found = true;
+
+        counter.farCell();
+      }
+    }
+
+    if ( ! found )
+      break;
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename I >
+template< typename D, typename C >
+void Tree< P, DIM, M, I >::searchBestFirst(
+    const P& target,
+    D& data,
+    const Bounds< P, DIM >& bounds,
+    const SearchOptions& options,
+    C& counter,
+    SearchQueue< typename P::base_type >& queue
+    ) const
+{
+  if ( m_nodeCount == 0 || options.maxLeaves == 0 )
+    return;
+
+  const typename P::base_type scale = m_metric.approximation( options.epsilon );
+
+  unsigned int leaves = 0;
+
+  typename P::base_type coords[ DIM ];
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    coords[ d ] = target[ d ];
+  }
+
+  typename P::base_type distancesSq[ MAX_BUCKET_SIZE ];
+
+  typename P::base_type rootOffsets[ DIM ];
+  typename P::base_type offsets[ DIM ];
+  typename P::base_type cellDistanceSq = cellOffsets( coords, bounds, rootOffsets );
+
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    offsets[ d ] = rootOffsets[ d ];
+  }
+
+  queue.clear();
+
+  // The data only changes at leaves, so ask it for its radius once per leaf
+  // rather than at every split
+  typename P::base_type radiusSq = data.maxDistanceSq();
+  bool incomplete = data.incomplete();
+
+  unsigned int index = 0;
+  unsigned int path = SearchQueue< typename P::base_type >::ROOT;
+
+  for ( ;; )
+  {
+    // Descend to the leaf on the target's side, queueing the far cells
+    // which could still hold something closer
+    const Node< P >* node = &m_nodes[ index ];
+
+    while ( ! node->leaf() )
+    {
+      counter.node();
+
+      const unsigned int dim = node->dim;
+      const bool inLeft = coords[ dim ] <= node->split;
+      const unsigned int nearNode = inLeft ? index + 1 : index + node->right;
+      const unsigned int farNode = inLeft ? index + node->right : index + 1;
+
+      const typename P::base_type farOffset = coords[ dim ] - node->split;
+      const typename P::base_type farDistanceSq = m_metric.replace( cellDistanceSq,
+          m_metric.cellTerm( dim, coords[ dim ], offsets[ dim ] ), m_metric.cellTerm( dim, coords[ dim ], farOffset ) );
+
+      if ( incomplete || farDistanceSq * scale < radiusSq )
+        queue.push( farNode, farDistanceSq, path, dim, farOffset );
+
+      index = nearNode;
+      node = &m_nodes[ index ];
+    }
+
+    counter.node();
+
+    searchLeaf( index, *node, target, coords, data, counter, distancesSq );
+
+    radiusSq = data.maxDistanceSq();
+    incomplete = data.incomplete();
+
+    if ( ++leaves == options.maxLeaves || queue.empty() )
+      break;
+
+    // The closest cell left is too far away, so are all the others
+    const typename SearchQueue< typename P::base_type >::Entry entry = queue.top();
+
+    if ( ! ( incomplete || entry.distanceSq * scale < radiusSq ) )
+      break;
+
+    queue.pop();
+    counter.farCell();
+
+    queue.offsets( entry.path, rootOffsets, offsets, DIM );
+
+    path = entry.path;
+    index = entry.node;
+    cellDistanceSq = entry.distanceSq;
+  }
+}
+
+
 
 };
 
 #endif // KDTREE
-
@@ -2,13 +2,71 @@
 #define KDTREEFACTORY
 
 #include "Tree.h"
+#include "ThreadPool.h"
+#include "PointView.h"
 
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+#include <math.h>
 
 
 namespace kd {
 
+template< typename P, unsigned int DIM >
+class ExternalBuild;
+
+
+/*! \brief Memory a TreeFactory keeps the trees it builds in
+ */
+enum TreeAllocation
+{
+  //! A vector each for the nodes, points and coordinates, see VectorStorage
+  ALLOCATE_VECTORS = 0,
+
+  //! One block for the whole tree, see ArenaStorage. Points which need destructing are kept in vectors
+  ALLOCATE_ARENA,
+
+  //! One block backed by huge pages where the system allows
+  ALLOCATE_HUGE_PAGES
+};
+
+
+/*! \brief Ways a TreeFactory can choose where to split a cell
+ */
+enum SplitRule
+{
+  //! The median along the longest side of the cell
+  SPLIT_LONGEST_SIDE = 0,
+
+  //! The median along the axis the points spread furthest along
+  SPLIT_MAX_SPREAD,
+
+  //! The median along the axis the points vary most along
+  SPLIT_MAX_VARIANCE,
+
+  /*! The middle of the longest side of the cell, moved to the nearest point
+   *  when all of them are to one side. Leaves are unbalanced but their cells
+   *  stay fat, which suits clustered points
+   */
+  SPLIT_SLIDING_MIDPOINT,
+
+  /*! As SPLIT_MAX_SPREAD, unless one of a few quantiles along some axis is
+   *  crossed by far fewer nearest neighbour searches, as estimated from a
+   *  sample of the points, when the split is made there instead
+   */
+  SPLIT_SAMPLED_COST
+};
+
+
+/*! \brief Tree holding indices of type I into points the caller keeps
+ */
+template< typename P, unsigned int DIM, typename I = unsigned int, typename M = EuclideanMetric< typename P::base_type > >
+using IndexTree = Tree< P, DIM, M, PointIndex< I, typename P::base_type > >;
+
 
 /*! \brief Creates the Tree objects from a set of points
  */
@@ -17,107 +75,802 @@ class TreeFactory
 public:
 
   TreeFactory( const Measurer& measurer, const BoundsFactory& boundsFactory )
-  : m_measurer( measurer ), m_boundsFactory( boundsFactory ) {};
-
-  template< typename P, unsigned int DIM >
-  Tree< P, DIM >* create( const std::vector< P >& points );
+  : m_measurer( measurer ), m_boundsFactory( boundsFactory ),
+    m_threads( 1 ), m_grainSize( 65536 ), m_bucketSize( 16 ), m_allocation( ALLOCATE_VECTORS ),
+    m_splitRule( SPLIT_LONGEST_SIDE ), m_leafPrecision( LEAF_EXACT ) {};
+
+  /*! \brief Builds a Tree over a copy of points
+   *
+   *  The metric only changes how the tree is searched, not how it is built.
+   */
+  template< typename P, unsigned int DIM, typename M = EuclideanMetric< typename P::base_type > >
+  Tree< P, DIM, M >* create( const std::vector< P >& points, const M& metric = M() );
+
+  /*! \brief Builds a Tree over points the caller keeps, holding only their indices
+   *
+   *  Searches report PointIndex< I > items, the positions of the points in
+   *  the view, rather than copies of the points. Besides the indices the
+   *  tree only keeps the DIM coordinates of each point, so for points
+   *  carrying other data it is far smaller than one made by create. The
+   *  points must not move or change while the tree is in use.
+   *
+   *  Returns 0 if there are more points than I can index. Nodes count
+   *  points in unsigned ints, so no more than UINT_MAX points can be
+   *  indexed however wide I is.
+   *
+   *  The build reads the points in the order the tree splits them, which
+   *  for points stored in no particular order misses the cache at nearly
+   *  every read. Storing them along a curve first, see curveOrder, about
+   *  halves the build time and keeps the points found by a search close
+   *  together in memory as well.
+   */
+  template< typename P, unsigned int DIM, typename I = unsigned int, typename M = EuclideanMetric< typename P::base_type > >
+  IndexTree< P, DIM, I, M >* createIndexed( const PointView< P >& points, const M& metric = M() );
+
+  /*! \brief Set the number of threads used to build trees
+   *
+   *  0 uses one thread per hardware thread. The trees built are identical
+   *  whatever the number of threads.
+   */
+  void setThreads( unsigned int threads ) { m_threads = threads; }
+
+  //! Set the size below which subtrees are built on a single thread
+  void setGrainSize( unsigned int grainSize ) { m_grainSize = grainSize; }
+
+  /*! \brief Set the largest number of points held by a leaf
+   *
+   *  Clamped to between 1 and Tree::MAX_BUCKET_SIZE when building.
+   */
+  void setBucketSize( unsigned int bucketSize ) { m_bucketSize = bucketSize; }
+
+  /*! \brief Set the memory trees are kept in once built
+   *
+   *  Trees fall back to vectors if an arena can not be mapped.
+   */
+  void setAllocation( TreeAllocation allocation ) { m_allocation = allocation; }
+
+  //! Set how cells are split, trees built with any rule answer queries the same
+  void setSplitRule( SplitRule rule ) { m_splitRule = rule; }
+
+  /*! \brief Set how the coordinates of the points in the leaves are kept
+   *
+   *  Quantized trees answer queries exactly as others do, see
+   *  QuantizedLeaves, but have no coordinates() so can not be written to a
+   *  TreeFile or joined. They are always kept in vectors. Only applies to
+   *  trees of floating point coordinates built by create, index trees have
+   *  no copy of their points to re-rank with so always keep exact ones.
+   */
+  void setLeafPrecision( LeafPrecision precision ) { m_leafPrecision = precision; }
 
 private:
 
+  //! Points sampled from a cell by SPLIT_SAMPLED_COST
+  static const unsigned int SPLIT_SAMPLES = 64;
+
+  //! SPLIT_SAMPLED_COST tries the quantiles 1 / SPLIT_QUANTILES up to ( SPLIT_QUANTILES - 1 ) / SPLIT_QUANTILES
+  static const unsigned int SPLIT_QUANTILES = 8;
+
+  /*! \brief Chooses the split of items[ begin, end ) and partitions them around it
+   *
+   *  Returns the index of the first item of the upper side and sets dim and
+   *  split. Items before it are no greater than split along dim and the rest
+   *  no less. Both sides are left with at least one item.
+   */
+  template< typename P, unsigned int DIM, typename A >
+  unsigned int partition(
+      std::vector< typename A::Item >& items,
+      unsigned int begin,
+      unsigned int end,
+      const Bounds< P, DIM >& bounds,
+      unsigned int bucketSize,
+      const A& access,
+      unsigned int& dim,
+      typename P::base_type& split
+      ) const;
+
+  //! Axis along which the points of items[ begin, end ) spread furthest
+  template< typename P, unsigned int DIM, typename A >
+  static unsigned int spreadDimension( const std::vector< typename A::Item >& items, unsigned int begin, unsigned int end, const A& access );
+
+  //! Axis along which the points of items[ begin, end ) vary most
+  template< typename P, unsigned int DIM, typename A >
+  static unsigned int varianceDimension( const std::vector< typename A::Item >& items, unsigned int begin, unsigned int end, const A& access );
+
+  /*! \brief Picks the axis and rank of the cheapest sampled quantile split
+   *
+   *  A search has to look on both sides of a split when its ball crosses
+   *  it, so the sampled points are used as queries and the split crossed
+   *  by the fewest of their estimated nearest neighbour balls is found.
+   *  Returns false unless it is crossed by under a quarter as many as the
+   *  best median split, when the median along the widest axis is as good.
+   */
+  template< typename P, unsigned int DIM, typename A >
+  static bool sampledCostSplit(
+      const std::vector< typename A::Item >& items,
+      unsigned int begin,
+      unsigned int end,
+      unsigned int bucketSize,
+      const A& access,
+      unsigned int& dim,
+      unsigned int& rank
+      );
+
+  /*! \brief Partitions items into leaves, appending the nodes in pre-order
+   *
+   *  access reads the point of each item, see PointAccess and IndexAccess.
+   */
+  template< typename P, unsigned int DIM, typename A >
+  void build(
+      std::vector< typename A::Item >& items,
+      const Bounds< P, DIM >& bounds,
+      typename Tree< P, DIM >::NodeList& nodes,
+      const A& access
+      ) const;
+
+  //! Moves built nodes and items into the storage chosen by setAllocation
+  template< typename P, unsigned int DIM, typename M, typename A >
+  Tree< P, DIM, M, typename A::Item >* store(
+      typename Tree< P, DIM >::NodeList& nodes,
+      std::vector< typename A::Item >& items,
+      const Bounds< P, DIM >& bounds,
+      const M& metric,
+      const A& access
+      ) const;
+
+  //! Moves built nodes and points into a QuantizedStorage
+  template< typename P, unsigned int DIM, typename M >
+  Tree< P, DIM, M >* storeQuantized(
+      typename Tree< P, DIM >::NodeList& nodes,
+      typename Tree< P, DIM >::PointList& points,
+      const Bounds< P, DIM >& bounds,
+      const M& metric
+      ) const;
+
+  //! Moves a built tree into a single ArenaStorage, returns 0 if it can not be mapped
+  template< typename P, unsigned int DIM, typename M, typename A >
+  Tree< P, DIM, M, typename A::Item >* createInArena(
+      const typename Tree< P, DIM >::NodeList& nodes,
+      std::vector< typename A::Item >& items,
+      const Bounds< P, DIM >& bounds,
+      const M& metric,
+      const A& access,
+      std::true_type trivial
+      ) const;
+
+  //! Items which need destructing can not be kept in an arena, returns 0
+  template< typename P, unsigned int DIM, typename M, typename A >
+  Tree< P, DIM, M, typename A::Item >* createInArena(
+      const typename Tree< P, DIM >::NodeList&,
+      std::vector< typename A::Item >&,
+      const Bounds< P, DIM >&,
+      const M&,
+      const A&,
+      std::false_type
+      ) const { return 0; }
+
+  template< typename P, unsigned int DIM, typename A >
+  friend class SubTreeTask;
+
   template< typename P, unsigned int DIM >
-  Node< P, DIM >* createSubTree( std::vector< P >* points, Bounds< P, DIM >& bounds );
+  friend class ExternalBuild;
+
+  template< typename P, unsigned int DIM, typename A >
+  void createSubTree(
+      std::vector< typename A::Item >& items,
+      unsigned int begin,
+      unsigned int end,
+      const Bounds< P, DIM >& bounds,
+      typename Tree< P, DIM >::NodeList& nodes,
+      ThreadPool* pool,
+      const A& access
+      ) const;
 
 private:
 
   const Measurer m_measurer;
   const BoundsFactory m_boundsFactory;
+
+  unsigned int m_threads;
+  unsigned int m_grainSize;
+  unsigned int m_bucketSize;
+  TreeAllocation m_allocation;
+  SplitRule m_splitRule;
+  LeafPrecision m_leafPrecision;
 };
 
 
-/*! \brief Comparison class for sorting points by dimension
+/*! \brief Builds one subtree of a tree on a thread pool
  */
-template< typename P >
+template< typename P, unsigned int DIM, typename A >
+class SubTreeTask : public Task
+{
+public:
+
+  SubTreeTask(
+      const TreeFactory& factory,
+      std::vector< typename A::Item >& items,
+      unsigned int begin,
+      unsigned int end,
+      const Bounds< P, DIM >& bounds,
+      typename Tree< P, DIM >::NodeList& nodes,
+      ThreadPool& pool,
+      const A& access
+      )
+   : m_factory( factory ), m_items( items ), m_begin( begin ), m_end( end ),
+     m_bounds( bounds ), m_nodes( nodes ), m_pool( pool ), m_access( access ) {}
+
+  void run()
+  {
+    m_factory.createSubTree< P, DIM >( m_items, m_begin, m_end, m_bounds, m_nodes, &m_pool, m_access );
+  }
+
+private:
+
+  const TreeFactory& m_factory;
+  std::vector< typename A::Item >& m_items;
+  const unsigned int m_begin;
+  const unsigned int m_end;
+  const Bounds< P, DIM > m_bounds;
+  typename Tree< P, DIM >::NodeList& m_nodes;
+  ThreadPool& m_pool;
+  const A& m_access;
+};
+
+
+/*! \brief Comparison class for sorting points, or the items holding them, by dimension
+ */
+template< typename P, typename A = PointAccess< P > >
 struct PointCompare
 {
-  PointCompare( const unsigned int dimension )
+  PointCompare( const unsigned int dimension, const A& a = A() )
+    : dim( dimension ), access( a ) {}
+
+  bool operator()( const typename A::Item& a, const typename A::Item& b ) const
+  {
+    return access( a )[ dim ] < access( b )[ dim ];
+  }
+
+  unsigned int dim;
+  A access;
+};
+
+
+/*! \brief Orders sampled points by dimension
+ */
+template< typename P >
+struct SampleCompare
+{
+  SampleCompare( const unsigned int dimension )
     : dim( dimension ) {}
 
-  bool operator()( const P& a, const P& b ) const
+  bool operator()( const P* a, const P* b ) const
   {
-    return a[ dim ] < b[ dim ];
+    return (*a)[ dim ] < (*b)[ dim ];
   }
 
   unsigned int dim;
 };
 
 
+/*! \brief Tells if the point of an item is below a value along a dimension
+ */
+template< typename P, typename A >
+struct BelowSplit
+{
+  BelowSplit( const unsigned int dimension, typename P::base_type v, const A& a )
+    : dim( dimension ), value( v ), access( a ) {}
 
-template< typename P, unsigned int DIM >
-Node< P, DIM >* TreeFactory::createSubTree( std::vector< P >* subset, Bounds< P, DIM >& bounds )
+  bool operator()( const typename A::Item& item ) const
+  {
+    return access( item )[ dim ] < value;
+  }
+
+  unsigned int dim;
+  typename P::base_type value;
+  const A& access;
+};
+
+
+
+template< typename P, unsigned int DIM, typename A >
+unsigned int TreeFactory::partition(
+    std::vector< typename A::Item >& items,
+    unsigned int begin,
+    unsigned int end,
+    const Bounds< P, DIM >& bounds,
+    unsigned int bucketSize,
+    const A& access,
+    unsigned int& dim,
+    typename P::base_type& split
+    ) const
+{
+  typename std::vector< typename A::Item >::iterator first = items.begin();
+  unsigned int rank = begin + ( end - begin ) / 2;
+
+  switch ( m_splitRule )
+  {
+  case SPLIT_MAX_SPREAD:
+    dim = spreadDimension< P, DIM >( items, begin, end, access );
+    break;
+
+  case SPLIT_MAX_VARIANCE:
+    dim = varianceDimension< P, DIM >( items, begin, end, access );
+    break;
+
+  case SPLIT_SAMPLED_COST:
+    // Once a cell holds only a few leaves' worth of points the reach of a
+    // search is as large as the cell, every split costs much the same and
+    // the sample only adds noise
+    if ( end - begin < SPLIT_SAMPLES * bucketSize
+        || ! sampledCostSplit< P, DIM >( items, begin, end, bucketSize, access, dim, rank ) )
+    {
+      dim = spreadDimension< P, DIM >( items, begin, end, access );
+    }
+    break;
+
+  case SPLIT_SLIDING_MIDPOINT:
+  {
+    dim = bounds.longestDimension();
+
+    typename P::base_type low = access( items[ begin ] )[ dim ];
+    typename P::base_type high = low;
+
+    for ( unsigned int i=begin + 1; i<end; ++i )
+    {
+      const typename P::base_type value = access( items[ i ] )[ dim ];
+      low = value < low ? value : low;
+      high = value > high ? value : high;
+    }
+
+    // Sliding along an axis the points do not spread along would peel them
+    // off one at a time, so split those at the median of the best axis
+    if ( low == high )
+    {
+      dim = spreadDimension< P, DIM >( items, begin, end, access );
+      break;
+    }
+
+    split = ( bounds.min()[ dim ] + bounds.max()[ dim ] ) / 2;
+
+    if ( split <= low )
+    {
+      // Slide down to the lowest point, leaving it alone on the lower side
+      std::nth_element( first + begin, first + begin, first + end, PointCompare< P, A >( dim, access ) );
+      split = low;
+      return begin + 1;
+    }
+
+    if ( split > high )
+    {
+      std::nth_element( first + begin, first + end - 1, first + end, PointCompare< P, A >( dim, access ) );
+      split = high;
+      return end - 1;
+    }
+
+    return std::partition( first + begin, first + end, BelowSplit< P, A >( dim, split, access ) ) - first;
+  }
+
+  default:
+    dim = bounds.longestDimension();
+  }
+
+  std::nth_element( first + begin, first + rank, first + end, PointCompare< P, A >( dim, access ) );
+  split = access( items[ rank ] )[ dim ];
+
+  return rank;
+}
+
+
+template< typename P, unsigned int DIM, typename A >
+unsigned int TreeFactory::spreadDimension( const std::vector< typename A::Item >& items, unsigned int begin, unsigned int end, const A& access )
 {
-  if ( subset->size() == 0 )
+  typename P::base_type low[ DIM ];
+  typename P::base_type high[ DIM ];
+
+  for ( unsigned int d=0; d<DIM; ++d )
   {
-    // Clean up subset
-    delete subset;
-    return new EmptyNode< P, DIM >();
+    low[ d ] = high[ d ] = access( items[ begin ] )[ d ];
   }
 
-  if ( subset->size() == 1 )
+  for ( unsigned int i=begin + 1; i<end; ++i )
   {
-    // Clean up subset
-    P point = (*subset)[ 0 ];
-    delete subset;
-    return new SingleNode< P, DIM >( point, m_measurer );
+    const P& point = access( items[ i ] );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      low[ d ] = point[ d ] < low[ d ] ? point[ d ] : low[ d ];
+      high[ d ] = point[ d ] > high[ d ] ? point[ d ] : high[ d ];
+    }
+  }
+
+  unsigned int dim = 0;
+
+  for ( unsigned int d=1; d<DIM; ++d )
+  {
+    if ( high[ d ] - low[ d ] > high[ dim ] - low[ dim ] )
+      dim = d;
   }
 
-  unsigned int dim = bounds.longestDimension();
-  PointCompare< P > cmp( dim );
-  std::sort( subset->begin(), subset->end(), cmp );
+  return dim;
+}
 
-  typename std::vector< P >::iterator it = subset->begin();
-  typename std::vector< P >::iterator end = subset->end();
 
-  int medianIdx = int( subset->size() / 2.0f );
+template< typename P, unsigned int DIM, typename A >
+unsigned int TreeFactory::varianceDimension( const std::vector< typename A::Item >& items, unsigned int begin, unsigned int end, const A& access )
+{
+  // Sums are taken relative to the first point to keep the rounding down
+  const P& origin = access( items[ begin ] );
 
-  P medianPoint = (*subset)[ medianIdx ];
+  double sum[ DIM ] = { 0 };
+  double sumSq[ DIM ] = { 0 };
 
-  // TODO: Compress creation and copy into creation from iterators
-  std::vector< P >* left = new std::vector< P >( medianIdx );
-  std::vector< P >* right = new std::vector< P >( subset->size() - ( medianIdx + 1 ) );
+  for ( unsigned int i=begin + 1; i<end; ++i )
+  {
+    const P& point = access( items[ i ] );
+
+    for ( unsigned int d=0; d<DIM; ++d )
+    {
+      const double value = double( point[ d ] ) - double( origin[ d ] );
+      sum[ d ] += value;
+      sumSq[ d ] += value * value;
+    }
+  }
 
-  // TODO: Check for overrunning indicies
-  std::copy( subset->begin(), subset->begin() + medianIdx, left->begin() );
-  std::copy( subset->begin() + medianIdx + 1, subset->end(), right->begin() );
+  const double count = end - begin;
+  unsigned int dim = 0;
+  double largest = -1.0;
 
-  // Clean up previous subset
-  delete subset;
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    const double variance = sumSq[ d ] / count - ( sum[ d ] / count ) * ( sum[ d ] / count );
 
-  BoundsPair< P, DIM > boundsPair = m_boundsFactory.split( bounds, medianPoint, dim );
+    if ( variance > largest )
+    {
+      largest = variance;
+      dim = d;
+    }
+  }
 
-  return new SplitNode< P, DIM >(
-      medianPoint,
-      dim,
-      createSubTree< P, DIM >( left, boundsPair.left ),
-      createSubTree< P, DIM >( right, boundsPair.right ),
-      m_measurer,
-      m_boundsFactory
-      );
+  return dim;
 }
 
-template< typename P, unsigned int DIM >
-Tree< P, DIM >* TreeFactory::create( const std::vector< P >& points )
+
+template< typename P, unsigned int DIM, typename A >
+bool TreeFactory::sampledCostSplit(
+    const std::vector< typename A::Item >& items,
+    unsigned int begin,
+    unsigned int end,
+    unsigned int bucketSize,
+    const A& access,
+    unsigned int& dim,
+    unsigned int& rank
+    )
+{
+  const unsigned int size = end - begin;
+  const unsigned int samples = size < SPLIT_SAMPLES ? size : SPLIT_SAMPLES;
+
+  // The range is in no particular order, so evenly spaced items are a fair sample
+  const P* sample[ SPLIT_SAMPLES ];
+  for ( unsigned int k=0; k<samples; ++k )
+  {
+    sample[ k ] = &access( items[ begin + (unsigned long long)( k ) * size / samples ] );
+  }
+
+  // Each sampled point stands for a query. Its ball starts out reaching a
+  // leaf's worth of points, which is its nearest neighbour in the sample
+  // scaled to the density of the range
+  const double scale = pow( double( samples ) * bucketSize / size, 2.0 / DIM );
+  double reachSq[ SPLIT_SAMPLES ];
+
+  for ( unsigned int k=0; k<samples; ++k )
+  {
+    reachSq[ k ] = std::numeric_limits< double >::max();
+
+    for ( unsigned int j=0; j<samples; ++j )
+    {
+      double distanceSq = 0.0;
+      for ( unsigned int d=0; d<DIM; ++d )
+      {
+        const double offset = double( (*sample[ k ])[ d ] ) - double( (*sample[ j ])[ d ] );
+        distanceSq += offset * offset;
+      }
+
+      if ( j != k && distanceSq > 0.0 && distanceSq < reachSq[ k ] )
+        reachSq[ k ] = distanceSq;
+    }
+
+    reachSq[ k ] *= scale;
+  }
+
+  // Best of all the splits, and best of those at the median
+  unsigned int bestCrossings = ~0u;
+  unsigned int bestDim = 0;
+  unsigned int bestCut = 0;
+  unsigned int medianCrossings = ~0u;
+
+  for ( unsigned int d=0; d<DIM; ++d )
+  {
+    std::sort( sample, sample + samples, SampleCompare< P >( d ) );
+
+    if ( (*sample[ 0 ])[ d ] == (*sample[ samples - 1 ])[ d ] )
+      continue;
+
+    for ( unsigned int q=1; q<SPLIT_QUANTILES; ++q )
+    {
+      const unsigned int cut = q * samples / SPLIT_QUANTILES;
+
+      if ( cut == 0 || cut == samples )
+        continue;
+
+      const double split = (*sample[ cut ])[ d ];
+      unsigned int crossings = 0;
+
+      for ( unsigned int k=0; k<samples; ++k )
+      {
+        const double offset = double( (*sample[ k ])[ d ] ) - split;
+
+        if ( offset * offset < reachSq[ k ] )
+          ++crossings;
+      }
+
+      if ( crossings < bestCrossings )
+      {
+        bestCrossings = crossings;
+        bestDim = d;
+        bestCut = cut;
+      }
+
+      if ( 2 * q == SPLIT_QUANTILES && crossings < medianCrossings )
+        medianCrossings = crossings;
+    }
+  }
+
+  if ( bestCrossings == ~0u )
+    return false;
+
+  // Uneven splits make the tree deeper and the sample is small, so only
+  // move off the median to cut through a clear gap in the points
+  if ( 4 * bestCrossings >= medianCrossings )
+    return false;
+
+  dim = bestDim;
+  rank = begin + (unsigned long long)( bestCut ) * size / samples;
+
+  return true;
+}
+
+
+/*! \brief Builds the subtree for items[ begin, end ) in place
+ *
+ *  The range is split as setSplitRule chooses rather than sorted, so every
+ *  subtree only ever touches its own range of items and the points of each
+ *  leaf end up next to each other. The subtree's nodes are appended to nodes
+ *  in pre-order. When a pool is given the upper half of a large range is
+ *  built by another thread into its own list and copied in afterwards.
+ */
+template< typename P, unsigned int DIM, typename A >
+void TreeFactory::createSubTree(
+    std::vector< typename A::Item >& items,
+    unsigned int begin,
+    unsigned int end,
+    const Bounds< P, DIM >& bounds,
+    typename Tree< P, DIM >::NodeList& nodes,
+    ThreadPool* pool,
+    const A& access
+    ) const
+{
+  const unsigned int size = end - begin;
+  const unsigned int bucketSize = m_bucketSize < 1 ? 1
+    : m_bucketSize > Tree< P, DIM >::MAX_BUCKET_SIZE ? Tree< P, DIM >::MAX_BUCKET_SIZE : m_bucketSize;
+
+  if ( size <= bucketSize )
+  {
+    nodes.push_back( Node< P >::leafNode( begin, size ) );
+    return;
+  }
+
+  unsigned int dim;
+  typename P::base_type split;
+  const unsigned int median = partition< P, DIM >( items, begin, end, bounds, bucketSize, access, dim, split );
+
+  const unsigned int index = nodes.size();
+
+  nodes.push_back( Node< P >::splitNode( split, dim ) );
+
+  BoundsPair< P, DIM > boundsPair = m_boundsFactory.split( bounds, split, dim );
+
+  if ( pool && size > m_grainSize )
+  {
+    typename Tree< P, DIM >::NodeList upper;
+
+    TaskGroup group( *pool );
+    group.run( new SubTreeTask< P, DIM, A >( *this, items, median, end, boundsPair.right, upper, *pool, access ) );
+
+    createSubTree< P, DIM >( items, begin, median, boundsPair.left, nodes, pool, access );
+    group.wait();
+
+    nodes[ index ].right = nodes.size() - index;
+    nodes.insert( nodes.end(), upper.begin(), upper.end() );
+  }
+  else
+  {
+    createSubTree< P, DIM >( items, begin, median, boundsPair.left, nodes, pool, access );
+
+    nodes[ index ].right = nodes.size() - index;
+    createSubTree< P, DIM >( items, median, end, boundsPair.right, nodes, pool, access );
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename A >
+void TreeFactory::build(
+    std::vector< typename A::Item >& items,
+    const Bounds< P, DIM >& bounds,
+    typename Tree< P, DIM >::NodeList& nodes,
+    const A& access
+    ) const
 {
-  // Dynamically allocate it so we can clean up the memory 
-  // faster than it might otherwise be cleaned
-  std::vector< P >* p = new std::vector< P >( points );
-  Bounds< P, DIM > bounds = m_boundsFactory.createBounds< P, DIM >( *p );
+  nodes.reserve( 2 * items.size() / ( m_bucketSize ? m_bucketSize : 1 ) + 1 );
+
+  if ( items.empty() )
+    return;
 
   // Create the tree!
-  return new Tree< P, DIM >( createSubTree< P, DIM >( p, bounds ), m_measurer, m_boundsFactory );
+  if ( m_threads == 1 || items.size() <= m_grainSize )
+  {
+    createSubTree< P, DIM >( items, 0, items.size(), bounds, nodes, 0, access );
+  }
+  else
+  {
+    ThreadPool pool( m_threads );
+    createSubTree< P, DIM >( items, 0, items.size(), bounds, nodes, &pool, access );
+  }
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+Tree< P, DIM, M >* TreeFactory::create( const std::vector< P >& points, const M& metric )
+{
+  // The only copy of the points made, they are partitioned in place from here
+  typename Tree< P, DIM >::PointList leafPoints( points );
+  typename Tree< P, DIM >::NodeList nodes;
+
+  Bounds< P, DIM > bounds = m_boundsFactory.createBounds< P, DIM >( leafPoints );
+
+  build< P, DIM >( leafPoints, bounds, nodes, PointAccess< P >() );
+
+  if ( m_leafPrecision != LEAF_EXACT && ! std::numeric_limits< typename P::base_type >::is_integer )
+    return storeQuantized< P, DIM >( nodes, leafPoints, bounds, metric );
+
+  return store< P, DIM >( nodes, leafPoints, bounds, metric, PointAccess< P >() );
+}
+
+
+template< typename P, unsigned int DIM, typename I, typename M >
+IndexTree< P, DIM, I, M >* TreeFactory::createIndexed( const PointView< P >& points, const M& metric )
+{
+  typedef IndexAccess< P, I > Access;
+
+  const size_t limit = std::min< unsigned long long >( std::numeric_limits< unsigned int >::max(), std::numeric_limits< I >::max() );
+  if ( points.size() > limit )
+    return 0;
+
+  const Access access( points );
+
+  std::vector< typename Access::Item > items( points.size() );
+  for ( size_t i=0; i<points.size(); ++i )
+  {
+    items[ i ] = typename Access::Item( I( i ) );
+  }
+
+  typename Tree< P, DIM >::NodeList nodes;
+
+  Bounds< P, DIM > bounds = m_boundsFactory.createBounds< P, DIM >( points );
+
+  build< P, DIM >( items, bounds, nodes, access );
+
+  return store< P, DIM >( nodes, items, bounds, metric, access );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename A >
+Tree< P, DIM, M, typename A::Item >* TreeFactory::store(
+    typename Tree< P, DIM >::NodeList& nodes,
+    std::vector< typename A::Item >& items,
+    const Bounds< P, DIM >& bounds,
+    const M& metric,
+    const A& access
+    ) const
+{
+  typedef Tree< P, DIM, M, typename A::Item > TreeType;
+
+  if ( m_allocation != ALLOCATE_VECTORS )
+  {
+    TreeType* tree = createInArena< P, DIM >( nodes, items, bounds, metric, access,
+        std::is_trivially_destructible< typename A::Item >() );
+
+    if ( tree )
+      return tree;
+  }
+
+  VectorStorage< P, typename A::Item >* storage = new VectorStorage< P, typename A::Item >;
+  storage->nodes.swap( nodes );
+  storage->points.swap( items );
+  storage->coordinates.resize( storage->points.size() * DIM );
+
+  TreeType::createCoordinates( storage->nodes.data(), storage->nodes.size(), storage->points.data(),
+      storage->coordinates.data(), access );
+
+  return new TreeType(
+      storage, storage->nodes.data(), storage->nodes.size(), storage->points.data(), storage->points.size(),
+      storage->coordinates.data(), bounds, m_measurer, m_boundsFactory, metric );
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+Tree< P, DIM, M >* TreeFactory::storeQuantized(
+    typename Tree< P, DIM >::NodeList& nodes,
+    typename Tree< P, DIM >::PointList& points,
+    const Bounds< P, DIM >& bounds,
+    const M& metric
+    ) const
+{
+  QuantizedStorage< P, DIM >* storage = new QuantizedStorage< P, DIM >;
+  storage->nodes.swap( nodes );
+  storage->points.swap( points );
+  storage->leaves.create( storage->nodes.data(), storage->nodes.size(), storage->points.data(), m_leafPrecision );
+
+  return new Tree< P, DIM, M >(
+      storage, storage->nodes.data(), storage->nodes.size(), storage->points.data(), storage->points.size(),
+      0, bounds, m_measurer, m_boundsFactory, metric, &storage->leaves );
+}
+
+
+template< typename P, unsigned int DIM, typename M, typename A >
+Tree< P, DIM, M, typename A::Item >* TreeFactory::createInArena(
+    const typename Tree< P, DIM >::NodeList& nodes,
+    std::vector< typename A::Item >& items,
+    const Bounds< P, DIM >& bounds,
+    const M& metric,
+    const A& access,
+    std::true_type
+    ) const
+{
+  typedef typename P::base_type base_type;
+  typedef typename A::Item Item;
+
+  size_t capacity = ArenaStorage::extent< Node< P > >( 0, nodes.size() );
+  capacity = ArenaStorage::extent< Item >( capacity, items.size() );
+  capacity = ArenaStorage::extent< base_type >( capacity, items.size() * DIM );
+
+  ArenaStorage* arena = new ArenaStorage( capacity, m_allocation == ALLOCATE_HUGE_PAGES );
+
+  Node< P >* arenaNodes = arena->allocate< Node< P > >( nodes.size() );
+  Item* arenaItems = arena->allocate< Item >( items.size() );
+  base_type* arenaCoordinates = arena->allocate< base_type >( items.size() * DIM );
+
+  if ( ! arenaNodes || ! arenaItems || ! arenaCoordinates )
+  {
+    delete arena;
+    return 0;
+  }
+
+  std::uninitialized_copy( nodes.begin(), nodes.end(), arenaNodes );
+  std::uninitialized_copy( items.begin(), items.end(), arenaItems );
+
+  const unsigned int itemCount = items.size();
+
+  // Hand back the build's copy of the items before the coordinates are added
+  std::vector< Item >().swap( items );
+
+  Tree< P, DIM, M, Item >::createCoordinates( arenaNodes, nodes.size(), arenaItems, arenaCoordinates, access );
+
+  return new Tree< P, DIM, M, Item >(
+      arena, arenaNodes, nodes.size(), arenaItems, itemCount, arenaCoordinates,
+      bounds, m_measurer, m_boundsFactory, metric );
 }
 
 
 }; // namespace kd
 
 #endif // KDTREEFACTORY
-
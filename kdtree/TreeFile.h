@@ -0,0 +1,329 @@
+#ifndef TREE_FILE
+#define TREE_FILE
+
+#include "Tree.h"
+#include "Storage.h"
+
+#include <limits>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace kd
+{
+
+/*! \brief Header at the start of a tree file
+ *
+ *  Every section is aligned to SECTION_ALIGNMENT bytes from the start of the
+ *  file so that a mapped file can be used in place. Files are only readable
+ *  on machines with the same byte order and structure layout as the writer,
+ *  which is what the endian marker and the recorded sizes check.
+ */
+struct TreeFileHeader
+{
+  static const unsigned int MAGIC = 0x4545524b; // "KREE" read little endian
+  static const unsigned int VERSION = 1;
+  static const unsigned int ENDIAN = 0x01020304;
+  static const unsigned int SECTION_ALIGNMENT = 64;
+
+  unsigned int magic;
+  unsigned int version;
+  unsigned int endian;
+  unsigned int dim;
+
+  //! Description of P::base_type
+  unsigned int baseSize;
+  unsigned int baseInteger;
+  unsigned int baseSigned;
+
+  unsigned int pointSize;
+  unsigned int nodeSize;
+  unsigned int reserved;
+
+  unsigned long long nodeCount;
+  unsigned long long pointCount;
+
+  //! Byte offsets of each section from the start of the file
+  unsigned long long boundsOffset;
+  unsigned long long nodesOffset;
+  unsigned long long pointsOffset;
+  unsigned long long coordinatesOffset;
+  unsigned long long fileSize;
+
+  //! FNV-1a hash of everything after the header
+  unsigned long long checksum;
+};
+
+
+/*! \brief Writes Trees to disk and maps them back read-only
+ *
+ *  A mapped tree answers queries straight from the file's pages so opening
+ *  one costs a few system calls rather than a rebuild, and processes mapping
+ *  the same file share a single copy through the page cache. Only points
+ *  which are plain data, with no pointers or virtual functions, can be
+ *  stored.
+ */
+class TreeFile
+{
+public:
+
+  TreeFile( const Measurer& measurer, const BoundsFactory& boundsFactory )
+   : m_measurer( measurer ), m_boundsFactory( boundsFactory ) {}
+
+  /*! \brief Writes the tree to path, returns false if the file could not be written
+   *
+   *  Trees with quantized leaves can not be written, see LeafPrecision.
+   */
+  template< typename P, unsigned int DIM, typename M >
+  bool write( const Tree< P, DIM, M >& tree, const char* path ) const;
+
+  /*! \brief Maps the tree stored at path
+   *
+   *  Returns 0 if the file can not be mapped, was not written for a
+   *  Tree< P, DIM > on this platform or holds nodes which would lead a
+   *  search outside the file, see validNodes. When verify is true the
+   *  checksum is also checked, which reads the whole file. Without it the
+   *  split values, points and coordinates are trusted as they are. The
+   *  metric is not stored, a tree can be searched with any metric.
+   */
+  template< typename P, unsigned int DIM, typename M = EuclideanMetric< typename P::base_type > >
+  Tree< P, DIM, M >* map( const char* path, bool verify = false, const M& metric = M() ) const;
+
+  //! FNV-1a hash of size bytes, continuing from hash
+  static unsigned long long checksum( const char* data, size_t size, unsigned long long hash = 14695981039346656037ull )
+  {
+    for ( size_t i=0; i<size; ++i )
+    {
+      hash ^= (unsigned char)( data[ i ] );
+      hash *= 1099511628211ull;
+    }
+
+    return hash;
+  }
+
+private:
+
+  template< typename P, unsigned int DIM >
+  friend class ExternalBuild;
+
+  //! Fills in everything but the checksum for a tree of the given size
+  template< typename P, unsigned int DIM >
+  static TreeFileHeader header( unsigned long long nodeCount, unsigned long long pointCount );
+
+  static unsigned long long align( unsigned long long offset )
+  {
+    const unsigned long long mask = TreeFileHeader::SECTION_ALIGNMENT - 1;
+    return ( offset + mask ) & ~mask;
+  }
+
+  //! Writes size bytes at offset, padding from the current position
+  static bool writeSection( FILE* file, unsigned long long& position, unsigned long long offset,
+                            const void* data, size_t size, unsigned long long& hash );
+
+  /*! \brief Returns true if every node only refers to nodes and points within the tree
+   *
+   *  Split nodes must be along one of the DIM axes with their upper child
+   *  after their lower one and within the nodes, leaves must hold no more
+   *  than Tree::MAX_BUCKET_SIZE points, all within the points. Children
+   *  always come after their parents, so any search of such nodes stays in
+   *  bounds and comes to an end.
+   */
+  template< typename P, unsigned int DIM >
+  static bool validNodes( const Node< P >* nodes, unsigned int nodeCount, unsigned int pointCount );
+
+  const Measurer m_measurer;
+  const BoundsFactory m_boundsFactory;
+};
+
+
+template< typename P, unsigned int DIM >
+TreeFileHeader TreeFile::header( unsigned long long nodeCount, unsigned long long pointCount )
+{
+  typedef typename P::base_type base_type;
+
+  TreeFileHeader header;
+  memset( &header, 0, sizeof( header ) );
+
+  header.magic = TreeFileHeader::MAGIC;
+  header.version = TreeFileHeader::VERSION;
+  header.endian = TreeFileHeader::ENDIAN;
+  header.dim = DIM;
+  header.baseSize = sizeof( base_type );
+  header.baseInteger = std::numeric_limits< base_type >::is_integer;
+  header.baseSigned = std::numeric_limits< base_type >::is_signed;
+  header.pointSize = sizeof( P );
+  header.nodeSize = sizeof( Node< P > );
+  header.nodeCount = nodeCount;
+  header.pointCount = pointCount;
+
+  header.boundsOffset = align( sizeof( TreeFileHeader ) );
+  header.nodesOffset = align( header.boundsOffset + 2 * sizeof( P ) );
+  header.pointsOffset = align( header.nodesOffset + nodeCount * sizeof( Node< P > ) );
+  header.coordinatesOffset = align( header.pointsOffset + pointCount * sizeof( P ) );
+  header.fileSize = header.coordinatesOffset + pointCount * DIM * sizeof( base_type );
+
+  return header;
+}
+
+
+inline bool TreeFile::writeSection( FILE* file, unsigned long long& position, unsigned long long offset,
+                                    const void* data, size_t size, unsigned long long& hash )
+{
+  static const char padding[ TreeFileHeader::SECTION_ALIGNMENT ] = { 0 };
+
+  // Padding is part of the checksum so the whole payload can be hashed in one go
+  size_t pad = size_t( offset - position );
+  if ( pad && fwrite( padding, 1, pad, file ) != pad )
+    return false;
+  hash = checksum( padding, pad, hash );
+
+  if ( size && fwrite( data, 1, size, file ) != size )
+    return false;
+  hash = checksum( static_cast< const char* >( data ), size, hash );
+
+  position = offset + size;
+  return true;
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+bool TreeFile::write( const Tree< P, DIM, M >& tree, const char* path ) const
+{
+  typedef typename P::base_type base_type;
+
+  if ( tree.size() && ! tree.coordinates() )
+    return false;
+
+  TreeFileHeader head = header< P, DIM >( tree.nodeCount(), tree.size() );
+
+  FILE* file = fopen( path, "wb" );
+  if ( ! file )
+    return false;
+
+  // The header goes in last, once the checksum is known
+  bool ok = fseek( file, long( sizeof( TreeFileHeader ) ), SEEK_SET ) == 0;
+
+  unsigned long long position = sizeof( TreeFileHeader );
+  unsigned long long hash = checksum( 0, 0 );
+
+  P corners[ 2 ] = { tree.bounds().min(), tree.bounds().max() };
+
+  ok = ok && writeSection( file, position, head.boundsOffset, corners, sizeof( corners ), hash );
+  ok = ok && writeSection( file, position, head.nodesOffset, tree.nodes(), tree.nodeCount() * sizeof( Node< P > ), hash );
+  ok = ok && writeSection( file, position, head.pointsOffset, tree.points(), tree.size() * sizeof( P ), hash );
+  ok = ok && writeSection( file, position, head.coordinatesOffset, tree.coordinates(), size_t( tree.size() ) * DIM * sizeof( base_type ), hash );
+
+  head.checksum = hash;
+
+  ok = ok && fseek( file, 0, SEEK_SET ) == 0;
+  ok = ok && fwrite( &head, sizeof( head ), 1, file ) == 1;
+
+  if ( fclose( file ) != 0 )
+    ok = false;
+
+  if ( ! ok )
+    unlink( path );
+
+  return ok;
+}
+
+
+template< typename P, unsigned int DIM >
+bool TreeFile::validNodes( const Node< P >* nodes, unsigned int nodeCount, unsigned int pointCount )
+{
+  for ( unsigned int i=0; i<nodeCount; ++i )
+  {
+    const Node< P >& node = nodes[ i ];
+
+    if ( node.leaf() )
+    {
+      if ( node.count > Tree< P, DIM >::MAX_BUCKET_SIZE || (unsigned long long)( node.first ) + node.count > pointCount )
+        return false;
+    }
+    else if ( node.dim >= DIM || node.right < 2 || node.right >= nodeCount - i )
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+template< typename P, unsigned int DIM, typename M >
+Tree< P, DIM, M >* TreeFile::map( const char* path, bool verify, const M& metric ) const
+{
+  typedef typename P::base_type base_type;
+
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 )
+    return 0;
+
+  struct stat info;
+  if ( fstat( fd, &info ) != 0 || size_t( info.st_size ) < sizeof( TreeFileHeader ) )
+  {
+    close( fd );
+    return 0;
+  }
+
+  const size_t length = size_t( info.st_size );
+  void* address = mmap( 0, length, PROT_READ, MAP_SHARED, fd, 0 );
+
+  // The mapping holds its own reference to the file
+  close( fd );
+
+  if ( address == MAP_FAILED )
+    return 0;
+
+  MappedStorage* storage = new MappedStorage( address, length );
+  const char* base = storage->address();
+
+  TreeFileHeader stored;
+  memcpy( &stored, base, sizeof( stored ) );
+
+  TreeFileHeader expected = header< P, DIM >( stored.nodeCount, stored.pointCount );
+  expected.checksum = stored.checksum;
+
+  bool ok = memcmp( &stored, &expected, sizeof( stored ) ) == 0
+    && stored.fileSize == length
+    && stored.nodeCount <= std::numeric_limits< unsigned int >::max()
+    && stored.pointCount <= std::numeric_limits< unsigned int >::max();
+
+  if ( ok && verify )
+  {
+    ok = checksum( base + sizeof( TreeFileHeader ), length - sizeof( TreeFileHeader ) ) == stored.checksum;
+  }
+
+  ok = ok && validNodes< P, DIM >( reinterpret_cast< const Node< P >* >( base + stored.nodesOffset ),
+      (unsigned int)( stored.nodeCount ), (unsigned int)( stored.pointCount ) );
+
+  if ( ! ok )
+  {
+    delete storage;
+    return 0;
+  }
+
+  const P* corners = reinterpret_cast< const P* >( base + stored.boundsOffset );
+
+  return new Tree< P, DIM, M >(
+      storage,
+      reinterpret_cast< const Node< P >* >( base + stored.nodesOffset ),
+      (unsigned int)( stored.nodeCount ),
+      reinterpret_cast< const P* >( base + stored.pointsOffset ),
+      (unsigned int)( stored.pointCount ),
+      reinterpret_cast< const base_type* >( base + stored.coordinatesOffset ),
+      Bounds< P, DIM >( corners[ 0 ], corners[ 1 ] ),
+      m_measurer,
+      m_boundsFactory,
+      metric
+      );
+}
+
+
+}; // namespace kd
+
+#endif // TREE_FILE
@@ -28,5 +28,30 @@ public:
   float data[ 2 ];
 };
 
+
+class Point3
+{
+public:
+
+  typedef float base_type;
+
+  Point3( float coords[3] ) { data[0] = coords[0]; data[1] = coords[1]; data[2] = coords[2]; }
+  Point3() { data[0] = 0.0f; data[1] = 0.0f; data[2] = 0.0f; }
+
+  float& operator[]( int index )
+  {
+    return data[ index ];
+  }
+
+  float operator[]( int index ) const
+  {
+    return data[ index ];
+  }
+
+public:
+
+  float data[ 3 ];
+};
+
 #endif // POINT2
 
@@ -1,9 +1,24 @@
 
 #include <kdtree/TreeFactory.h>
+#include <kdtree/TreeFile.h>
+#include <kdtree/Forest.h>
+#include <kdtree/Join.h>
+#include <kdtree/Statistics.h>
+#include <kdtree/ExternalTreeBuilder.h>
+#include <kdtree/SharedTree.h>
 #include "Point.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
 #include <memory>
+#include <list>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <new>
 
 #include <iostream>
 
@@ -23,6 +38,2119 @@ typedef std::list< PointDistance > PointDistanceList;
 #define POINT_COUNT 1000
 
 
+//! Calls to operator new so far, on any thread
+static std::atomic< unsigned long long > allocationCount( 0 );
+
+// Every form of operator new and delete is replaced, so all of them allocate with malloc and free
+// with free. GCC still flags free once the replacement delete is inlined, though the pair matches
+#if defined( __GNUC__ ) && ! defined( __clang__ ) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static void* countedAllocation( size_t size )
+{
+  ++allocationCount;
+  return malloc( size ? size : 1 );
+}
+
+void* operator new( size_t size )
+{
+  void* memory = countedAllocation( size );
+  if ( ! memory )
+    throw std::bad_alloc();
+
+  return memory;
+}
+
+void* operator new[]( size_t size )
+{
+  void* memory = countedAllocation( size );
+  if ( ! memory )
+    throw std::bad_alloc();
+
+  return memory;
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept { return countedAllocation( size ); }
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept { return countedAllocation( size ); }
+
+void operator delete( void* memory ) noexcept { free( memory ); }
+void operator delete[]( void* memory ) noexcept { free( memory ); }
+void operator delete( void* memory, size_t ) noexcept { free( memory ); }
+void operator delete[]( void* memory, size_t ) noexcept { free( memory ); }
+void operator delete( void* memory, const std::nothrow_t& ) noexcept { free( memory ); }
+void operator delete[]( void* memory, const std::nothrow_t& ) noexcept { free( memory ); }
+
+#if defined( __GNUC__ ) && ! defined( __clang__ ) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+
+/*! \brief Checks that building on several threads gives the same tree as one thread
+ */
+void testParallelBuild( const std::vector< Point2 >& points )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > serial( treeFactory.create< Point2, 2 >( points ) );
+
+  treeFactory.setThreads( 4 );
+  treeFactory.setGrainSize( 16 );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > parallel( treeFactory.create< Point2, 2 >( points ) );
+
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    if ( serial->points()[ i ][ 0 ] != parallel->points()[ i ][ 0 ]
+        || serial->points()[ i ][ 1 ] != parallel->points()[ i ][ 1 ] )
+    {
+      std::cerr << "Error - Parallel build differs from serial build at " << i << std::endl;
+      return;
+    }
+  }
+}
+
+
+/*! \brief Compares distances allowing for the rounding of vectorised distance kernels
+ */
+bool sameDistance( float a, float b )
+{
+  return fabs( a - b ) <= 1e-5f * ( fabs( a ) > fabs( b ) ? fabs( a ) : fabs( b ) );
+}
+
+
+/*! \brief Checks each vectorised distance kernel against the scalar one
+ */
+template< typename T >
+void testDistanceKernels()
+{
+  std::vector< T > block( 40 * 9 );
+  for ( unsigned int i=0; i<block.size(); ++i )
+    block[ i ] = T( drand48() );
+
+  T target[ 9 ];
+  for ( unsigned int d=0; d<9; ++d )
+    target[ d ] = T( drand48() );
+
+  T expected[ 40 ];
+  T result[ 40 ];
+
+  for ( int level=kd::SIMD_SCALAR; level<=kd::detectSimdLevel(); ++level )
+  {
+    typename kd::DistanceKernel< T >::Function kernel = kd::DistanceKernel< T >::select( kd::SimdLevel( level ) );
+
+    for ( unsigned int dims=1; dims<=9; ++dims )
+    {
+      for ( unsigned int count=1; count<=40; ++count )
+      {
+        kd::distanceSqScalar( &block[ 0 ], count, target, dims, expected );
+        kernel( &block[ 0 ], count, target, dims, result );
+
+        for ( unsigned int j=0; j<count; ++j )
+        {
+          if ( fabs( double( result[ j ] - expected[ j ] ) ) > 1e-5 * fabs( double( expected[ j ] ) ) )
+          {
+            std::cerr << "Error - " << kd::simdLevelName( kd::SimdLevel( level ) ) << " distance kernel"
+              " differs ( dims " << dims << " count " << count << " point " << j << " )" << std::endl;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks trees with different leaf sizes and kernels against a brute force search
+ */
+void testBucketSizes( const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const unsigned int sizes[] = { 1, 3, 16, 64, 1000 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    treeFactory.setBucketSize( sizes[ s ] );
+    std::unique_ptr< kd::Tree< Point2, 2 > > tree( treeFactory.create< Point2, 2 >( points ) );
+
+    for ( int level=kd::SIMD_SCALAR; level<=kd::detectSimdLevel(); ++level )
+    {
+      tree->setSimdLevel( kd::SimdLevel( level ) );
+
+      for ( unsigned int i=0; i<targets.size(); i+=50 )
+      {
+        float nearestSq = measurer.distanceSq< Point2, 2 >( targets[ i ], points[ 0 ] );
+        for ( unsigned int j=1; j<points.size(); ++j )
+        {
+          float distSq = measurer.distanceSq< Point2, 2 >( targets[ i ], points[ j ] );
+          nearestSq = distSq < nearestSq ? distSq : nearestSq;
+        }
+
+        kd::NeighbourData< Point2 > neighbourData = tree->nearestNeighbour( targets[ i ], tree->bounds() );
+
+        if ( neighbourData.incomplete() || ! sameDistance( neighbourData.maxDistanceSq(), nearestSq ) )
+        {
+          std::cerr << "Error - Found incorrect point for lookup " << i << " with buckets of "
+            << sizes[ s ] << " and " << kd::simdLevelName( kd::SimdLevel( level ) ) << std::endl;
+        }
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks groups of neighbours of several sizes against a brute force search
+ *
+ *  Covers both the sorted and the heap storage of MultiNeighbourData along
+ *  with collecting into a caller owned buffer.
+ */
+void testNeighbourGroups( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::Measurer measurer;
+
+  const unsigned int sizes[] = { 1, 8, 9, 32, 100 };
+
+  for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+  {
+    const unsigned int num = sizes[ s ];
+    std::vector< kd::MultiNeighbourData< Point2 >::PointDistance > buffer( num );
+
+    for ( unsigned int i=0; i<targets.size(); i+=10 )
+    {
+      std::vector< float > distances;
+      for ( unsigned int j=0; j<points.size(); ++j )
+      {
+        distances.push_back( measurer.distanceSq< Point2, 2 >( targets[ i ], points[ j ] ) );
+      }
+      std::sort( distances.begin(), distances.end() );
+
+      kd::MultiNeighbourData< Point2 > owned = tree.nearestNeighbours( num, targets[ i ], tree.bounds() );
+
+      kd::MultiNeighbourData< Point2 > supplied( num, 200.0f, &buffer[ 0 ] );
+      tree.search( targets[ i ], supplied, tree.bounds() );
+
+      if ( owned.points().size() != num || supplied.points().size() != num )
+      {
+        std::cerr << "Error - Failed to find " << num << " nearest neighbours for lookup " << i << std::endl;
+        continue;
+      }
+
+      for ( unsigned int j=0; j<num; ++j )
+      {
+        if ( ! sameDistance( owned.points()[ j ].distSq, distances[ j ] ) || ! sameDistance( supplied.points()[ j ].distSq, distances[ j ] ) )
+        {
+          std::cerr << "Error - Found incorrect neighbour group for lookup ( " << i << ":" << j << " of " << num << " )" << std::endl;
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks radius and box queries against a brute force search
+ */
+void testRangeQueries( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::Measurer measurer;
+
+  const float radii[] = { 0.0f, 0.01f, 0.05f, 0.2f, 2.0f };
+  std::vector< Point2 > found( points.size() );
+
+  for ( unsigned int r=0; r<sizeof( radii ) / sizeof( radii[ 0 ] ); ++r )
+  {
+    const float radiusSq = radii[ r ] * radii[ r ];
+
+    for ( unsigned int i=0; i<targets.size(); i+=20 )
+    {
+      // Points right on the radius may go either way with the rounding of
+      // the distance kernels
+      unsigned int inside = 0;
+      unsigned int boundary = 0;
+      for ( unsigned int j=0; j<points.size(); ++j )
+      {
+        float distSq = measurer.distanceSq< Point2, 2 >( targets[ i ], points[ j ] );
+        if ( distSq < radiusSq * ( 1.0f - 1e-5f ) )
+          ++inside;
+        else if ( distSq < radiusSq * ( 1.0f + 1e-5f ) )
+          ++boundary;
+      }
+
+      unsigned int count = tree.withinRadius( targets[ i ], radii[ r ], &found[ 0 ], found.size() );
+
+      if ( count < inside || count > inside + boundary )
+      {
+        std::cerr << "Error - Found " << count << " points within " << radii[ r ] << " of lookup "
+          << i << " rather than " << inside << std::endl;
+      }
+
+      for ( unsigned int j=0; j<count; ++j )
+      {
+        if ( measurer.distanceSq< Point2, 2 >( targets[ i ], found[ j ] ) >= radiusSq * ( 1.0f + 1e-5f ) )
+        {
+          std::cerr << "Error - Found point outside radius " << radii[ r ] << " of lookup " << i << std::endl;
+        }
+      }
+
+      unsigned int limited = tree.countWithinRadius( targets[ i ], radii[ r ], 10 );
+      if ( limited != ( count < 10 ? count : 10 ) )
+      {
+        std::cerr << "Error - Counted " << limited << " points within " << radii[ r ] << " of lookup " << i << std::endl;
+      }
+    }
+  }
+
+  for ( unsigned int i=0; i+1<targets.size(); i+=20 )
+  {
+    float min[ 2 ] = { std::min( targets[ i ][ 0 ], targets[ i + 1 ][ 0 ] ), std::min( targets[ i ][ 1 ], targets[ i + 1 ][ 1 ] ) };
+    float max[ 2 ] = { std::max( targets[ i ][ 0 ], targets[ i + 1 ][ 0 ] ), std::max( targets[ i ][ 1 ], targets[ i + 1 ][ 1 ] ) };
+    kd::Bounds< Point2, 2 > box( min, max );
+
+    unsigned int inside = 0;
+    for ( unsigned int j=0; j<points.size(); ++j )
+    {
+      if ( box.contains( points[ j ] ) )
+        ++inside;
+    }
+
+    const unsigned long long allocations = allocationCount;
+    unsigned int count = tree.withinBox( box, &found[ 0 ], found.size() );
+
+    if ( allocationCount != allocations )
+    {
+      std::cerr << "Error - Box query " << i << " allocated" << std::endl;
+    }
+
+    if ( count != inside )
+    {
+      std::cerr << "Error - Found " << count << " points inside box " << i << " rather than " << inside << std::endl;
+    }
+
+    for ( unsigned int j=0; j<count; ++j )
+    {
+      if ( ! box.contains( found[ j ] ) )
+        std::cerr << "Error - Found point outside box " << i << std::endl;
+    }
+
+    unsigned int limited = tree.countWithinBox( box, 10 );
+    if ( limited != ( inside < 10 ? inside : 10 ) )
+    {
+      std::cerr << "Error - Counted " << limited << " points inside box " << i << std::endl;
+    }
+  }
+
+  // Halving distances split by sliding midpoints give a tree deeper than a box query keeps on its own stack
+  std::vector< Point2 > halving( 2 * kd::NodeStack::DEPTH );
+  for ( unsigned int i=0; i<halving.size(); ++i )
+  {
+    halving[ i ][ 0 ] = ldexpf( 1.0f, -int( i ) );
+    halving[ i ][ 1 ] = 0.0f;
+  }
+
+  kd::BoundsFactory boundsFactory;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 1 );
+  treeFactory.setSplitRule( kd::SPLIT_SLIDING_MIDPOINT );
+  std::unique_ptr< kd::Tree< Point2, 2 > > deep( treeFactory.create< Point2, 2 >( halving ) );
+
+  for ( unsigned int i=0; i<halving.size(); i+=7 )
+  {
+    float min[ 2 ] = { 0.0f, 0.0f };
+    float max[ 2 ] = { halving[ i ][ 0 ], 1.0f };
+    const kd::Bounds< Point2, 2 > box( min, max );
+
+    if ( deep->countWithinBox( box ) != halving.size() - i )
+    {
+      std::cerr << "Error - Counted " << deep->countWithinBox( box ) << " points inside box " << i << " of a deep tree" << std::endl;
+    }
+  }
+}
+
+
+/*! \brief Task sleeping for a while, then queueing its children in the same group
+ */
+class SleepingTask : public kd::Task
+{
+public:
+  SleepingTask( kd::TaskGroup& group, unsigned int children, std::atomic< unsigned int >& done )
+    : m_group( group ), m_children( children ), m_done( done ) {}
+
+  void run()
+  {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+
+    for ( unsigned int i=0; i<m_children; ++i )
+      m_group.run( new SleepingTask( m_group, 0, m_done ) );
+
+    m_done.fetch_add( 1 );
+  }
+
+private:
+  kd::TaskGroup& m_group;
+  unsigned int m_children;
+  std::atomic< unsigned int >& m_done;
+};
+
+
+//! CPU time used by the calling thread, in seconds
+double threadTime()
+{
+  timespec time;
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+
+/*! \brief Checks that waiting on a group runs every task, and sleeps rather than spins while others run
+ */
+void testTaskGroup()
+{
+  kd::ThreadPool pool( 2 );
+  std::atomic< unsigned int > done( 0 );
+
+  {
+    kd::TaskGroup group( pool );
+    group.run( new SleepingTask( group, 3, done ) );
+
+    // Leave the first task to the worker, so the waiter has nothing to run for a while
+    std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+
+    const double start = threadTime();
+    group.wait();
+
+    if ( threadTime() - start > 0.05 )
+    {
+      std::cerr << "Error - Waiting on a task group took " << threadTime() - start << "s of CPU time" << std::endl;
+    }
+  }
+
+  if ( done.load() != 4 )
+  {
+    std::cerr << "Error - Ran " << done.load() << " of 4 grouped tasks" << std::endl;
+  }
+}
+
+
+/*! \brief Checks batched queries on a thread pool against individual queries
+ */
+void testBatchQueries( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  kd::ThreadPool pool( 4 );
+
+  const unsigned int num = 5;
+  std::vector< Point2 > neighbours( targets.size() * num );
+  std::vector< float > distancesSq( targets.size() * num );
+
+  tree.nearestNeighbours( num, &targets[ 0 ], targets.size(), &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+
+  std::vector< Point2 > nearest( targets.size() );
+  tree.nearestNeighbour( &targets[ 0 ], targets.size(), &nearest[ 0 ], 0, pool );
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::NeighbourData< Point2 > neighbourData = tree.nearestNeighbour( targets[ i ], tree.bounds() );
+
+    if ( nearest[ i ][ 0 ] != neighbourData.point()[ 0 ] || nearest[ i ][ 1 ] != neighbourData.point()[ 1 ] )
+    {
+      std::cerr << "Error - Batch found incorrect point for lookup " << i << std::endl;
+    }
+
+    kd::MultiNeighbourData< Point2 > neighboursData = tree.nearestNeighbours( num, targets[ i ], tree.bounds() );
+
+    kd::MultiNeighbourData< Point2 >::PointDistanceList::const_iterator it = neighboursData.points().begin();
+
+    for ( unsigned int j=0; j<num; ++j, ++it )
+    {
+      const Point2& neighbour = neighbours[ i * num + j ];
+
+      if ( neighbour[ 0 ] != it->point[ 0 ] || neighbour[ 1 ] != it->point[ 1 ] || distancesSq[ i * num + j ] != it->distSq )
+      {
+        std::cerr << "Error - Batch found incorrect point set for lookup ( " << i << ":" << j << " ) " << std::endl;
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks a tree written to disk and mapped back answers queries the same
+ */
+void testTreeFile( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFile treeFile( measurer, boundsFactory );
+
+  char path[] = "/tmp/kdtree-test-XXXXXX";
+  int fd = mkstemp( path );
+  if ( fd < 0 )
+  {
+    std::cerr << "Error - Unable to create temporary tree file" << std::endl;
+    return;
+  }
+  close( fd );
+
+  if ( ! treeFile.write( tree, path ) )
+  {
+    std::cerr << "Error - Unable to write tree file" << std::endl;
+    unlink( path );
+    return;
+  }
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > mapped( treeFile.map< Point2, 2 >( path, true ) );
+
+  if ( ! mapped.get() || mapped->size() != tree.size() )
+  {
+    std::cerr << "Error - Unable to map tree file" << std::endl;
+    unlink( path );
+    return;
+  }
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( 5, targets[ i ], tree.bounds() );
+    kd::MultiNeighbourData< Point2 > found = mapped->nearestNeighbours( 5, targets[ i ], mapped->bounds() );
+
+    for ( unsigned int j=0; j<5; ++j )
+    {
+      if ( expected.points()[ j ].distSq != found.points()[ j ].distSq )
+      {
+        std::cerr << "Error - Mapped tree found incorrect point set for lookup " << i << std::endl;
+        break;
+      }
+    }
+  }
+
+  if ( treeFile.map< Point2, 3 >( path ) )
+  {
+    std::cerr << "Error - Mapped tree file with the wrong dimension" << std::endl;
+  }
+
+  // Flip a byte of the last point's coordinates, only the checksum notices
+  FILE* file = fopen( path, "r+b" );
+  fseek( file, -1, SEEK_END );
+  int last = fgetc( file );
+  fseek( file, -1, SEEK_END );
+  fputc( last ^ 0xff, file );
+  fclose( file );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > unverified( treeFile.map< Point2, 2 >( path ) );
+  std::unique_ptr< kd::Tree< Point2, 2 > > corrupt( treeFile.map< Point2, 2 >( path, true ) );
+
+  if ( ! unverified.get() || corrupt.get() )
+  {
+    std::cerr << "Error - Tree file checksum not checked correctly" << std::endl;
+  }
+
+  if ( treeFile.map< Point2, 2 >( "/nonexistent/kdtree" ) )
+  {
+    std::cerr << "Error - Mapped missing tree file" << std::endl;
+  }
+
+  // Nodes pointing outside the tree are refused even unverified, whatever the checksum
+  unsigned int firstSplit = 0, firstLeaf = 0;
+  while ( tree.nodes()[ firstSplit ].leaf() ) ++firstSplit;
+  while ( ! tree.nodes()[ firstLeaf ].leaf() ) ++firstLeaf;
+
+  const char* corruptions[] = { "split dimension", "upper child", "lower child", "leaf start", "leaf size" };
+
+  for ( unsigned int c=0; c<5; ++c )
+  {
+    if ( ! treeFile.write( tree, path ) )
+      continue;
+
+    kd::TreeFileHeader head;
+    file = fopen( path, "r+b" );
+    fread( &head, sizeof( head ), 1, file );
+
+    const unsigned int index = c < 3 ? firstSplit : firstLeaf;
+    kd::Node< Point2 > node = tree.nodes()[ index ];
+
+    switch ( c )
+    {
+      case 0: node.dim = 2; break;
+      case 1: node.right = tree.nodeCount() - index; break;
+      case 2: node.right = 1; break;
+      case 3: node.first = tree.size() - node.count + 1; break;
+      default: node.count = kd::Tree< Point2, 2 >::MAX_BUCKET_SIZE + 1; break;
+    }
+
+    fseek( file, long( head.nodesOffset + index * sizeof( node ) ), SEEK_SET );
+    fwrite( &node, sizeof( node ), 1, file );
+    fclose( file );
+
+    if ( treeFile.map< Point2, 2 >( path ) || treeFile.map< Point2, 2 >( path, true ) )
+    {
+      std::cerr << "Error - Mapped tree file with a corrupt " << corruptions[ c ] << std::endl;
+    }
+  }
+
+  unlink( path );
+}
+
+
+/*! \brief Checks trees built out of core within a small memory budget answer queries as ones built in memory
+ */
+void testExternalBuilder( const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  kd::TreeFile treeFile( measurer, boundsFactory );
+
+  // Uniform points, plus many copies of one point and many on one line so
+  // that cells are full of ties along their splits
+  std::vector< Point2 > points;
+  for ( unsigned int i=0; i<20000; ++i )
+  {
+    float p[ 2 ] = { float( drand48() ), float( drand48() ) };
+
+    if ( i % 5 == 0 )
+      p[ 0 ] = p[ 1 ] = 0.5f;
+    else if ( i % 7 == 0 )
+      p[ 0 ] = 0.25f;
+
+    points.push_back( Point2( p ) );
+  }
+
+  char path[] = "/tmp/kdtree-test-XXXXXX";
+  int fd = mkstemp( path );
+  if ( fd < 0 )
+  {
+    std::cerr << "Error - Unable to create temporary points file" << std::endl;
+    return;
+  }
+  close( fd );
+
+  FILE* file = fopen( path, "wb" );
+  fwrite( &points[ 0 ], sizeof( Point2 ), points.size(), file );
+  fclose( file );
+
+  const std::string treePath = std::string( path ) + ".tree";
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > expected( treeFactory.create< Point2, 2 >( points ) );
+
+  // Small enough budgets to split the points over several levels of files, and large enough for none
+  const size_t budgets[] = { 32 << 10, 96 << 10, 16 << 20 };
+
+  for ( unsigned int b=0; b<sizeof( budgets ) / sizeof( budgets[ 0 ] ); ++b )
+  {
+    kd::ExternalTreeBuilder builder( treeFactory, budgets[ b ] );
+    kd::FilePointStream< Point2 > stream( path );
+
+    if ( ! builder.build< Point2, 2 >( stream, treePath.c_str() ) )
+    {
+      std::cerr << "Error - External build failed with a budget of " << budgets[ b ] << std::endl;
+      continue;
+    }
+
+    if ( builder.peakMemory() > budgets[ b ] )
+    {
+      std::cerr << "Error - External build took " << builder.peakMemory() << " bytes of a budget of " << budgets[ b ] << std::endl;
+    }
+
+    std::unique_ptr< kd::Tree< Point2, 2 > > tree( treeFile.map< Point2, 2 >( treePath.c_str(), true ) );
+
+    if ( ! tree.get() || tree->size() != points.size() )
+    {
+      std::cerr << "Error - Unable to map externally built tree" << std::endl;
+      continue;
+    }
+
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      kd::MultiNeighbourData< Point2 > neighbours = expected->nearestNeighbours( 5, targets[ i ], expected->bounds() );
+      kd::MultiNeighbourData< Point2 > found = tree->nearestNeighbours( 5, targets[ i ], tree->bounds() );
+
+      for ( unsigned int j=0; j<5; ++j )
+      {
+        if ( found.points()[ j ].distSq != neighbours.points()[ j ].distSq )
+        {
+          std::cerr << "Error - Externally built tree found incorrect point set for lookup " << i << std::endl;
+          break;
+        }
+      }
+
+      if ( tree->countWithinRadius( targets[ i ], 0.05f ) != expected->countWithinRadius( targets[ i ], 0.05f ) )
+      {
+        std::cerr << "Error - Externally built tree found incorrect radius count for lookup " << i << std::endl;
+      }
+    }
+
+    if ( access( ( treePath + ".nodes" ).c_str(), F_OK ) == 0 || access( ( treePath + ".spill0" ).c_str(), F_OK ) == 0 )
+    {
+      std::cerr << "Error - External build left temporary files behind" << std::endl;
+    }
+  }
+
+  // Streams over points in memory, or a mapped file of them, build the same
+  kd::ExternalTreeBuilder builder( treeFactory, 64 << 10 );
+  kd::ViewPointStream< Point2 > view( kd::PointView< Point2 >( &points[ 0 ], points.size() ) );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > viewed(
+      builder.build< Point2, 2 >( view, treePath.c_str() ) ? treeFile.map< Point2, 2 >( treePath.c_str(), true ) : 0 );
+
+  if ( ! viewed.get() || viewed->size() != points.size() )
+  {
+    std::cerr << "Error - External build from a view failed" << std::endl;
+  }
+
+  builder.setMemoryBudget( 1 << 10 );
+  if ( builder.build< Point2, 2 >( view, treePath.c_str() ) )
+  {
+    std::cerr << "Error - External build ran in too small a budget" << std::endl;
+  }
+
+  // Many more points than a small budget builds at once nest cells several
+  // levels deep, each keeping its splits and buckets until its cells are done
+  std::vector< Point2 > many( 300000 );
+  for ( unsigned int i=0; i<many.size(); ++i )
+  {
+    many[ i ][ 0 ] = float( drand48() );
+    many[ i ][ 1 ] = float( drand48() );
+  }
+
+  kd::ViewPointStream< Point2 > manyView( kd::PointView< Point2 >( &many[ 0 ], many.size() ) );
+  builder.setMemoryBudget( 24 << 10 );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > nested(
+      builder.build< Point2, 2 >( manyView, treePath.c_str() ) ? treeFile.map< Point2, 2 >( treePath.c_str(), true ) : 0 );
+
+  if ( ! nested.get() || nested->size() != many.size() )
+  {
+    std::cerr << "Error - External build over nested cells failed" << std::endl;
+  }
+  else if ( builder.peakMemory() > builder.memoryBudget() )
+  {
+    std::cerr << "Error - External build over nested cells took " << builder.peakMemory() << " bytes of a budget of " << builder.memoryBudget() << std::endl;
+  }
+
+  nested.reset();
+
+  // Sliding midpoints split at the middle of the bounds, which no sampled
+  // point need be on, so a streamed point on it has no sampled ties to follow
+  std::vector< Point2 > spread( 100000 );
+  for ( unsigned int i=0; i<spread.size(); ++i )
+  {
+    spread[ i ][ 0 ] = float( drand48() );
+    spread[ i ][ 1 ] = float( drand48() );
+  }
+
+  spread[ 0 ][ 0 ] = spread[ 0 ][ 1 ] = 0.0f;
+  spread[ 1 ][ 0 ] = spread[ 1 ][ 1 ] = 1.0f;
+  spread[ 2 ][ 0 ] = spread[ 2 ][ 1 ] = 0.5f;
+
+  kd::TreeFactory midpointFactory( measurer, boundsFactory );
+  midpointFactory.setSplitRule( kd::SPLIT_SLIDING_MIDPOINT );
+
+  kd::ExternalTreeBuilder midpointBuilder( midpointFactory, 256 << 10 );
+  kd::ViewPointStream< Point2 > spreadView( kd::PointView< Point2 >( &spread[ 0 ], spread.size() ) );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > midpoint(
+      midpointBuilder.build< Point2, 2 >( spreadView, treePath.c_str() ) ? treeFile.map< Point2, 2 >( treePath.c_str(), true ) : 0 );
+
+  if ( ! midpoint.get() || midpoint->size() != spread.size() )
+  {
+    std::cerr << "Error - External build with sliding midpoint splits failed" << std::endl;
+  }
+  else
+  {
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      float best = std::numeric_limits< float >::max();
+      for ( unsigned int j=0; j<spread.size(); ++j )
+        best = std::min( best, ( spread[ j ][ 0 ] - targets[ i ][ 0 ] ) * ( spread[ j ][ 0 ] - targets[ i ][ 0 ] )
+            + ( spread[ j ][ 1 ] - targets[ i ][ 1 ] ) * ( spread[ j ][ 1 ] - targets[ i ][ 1 ] ) );
+
+      if ( ! sameDistance( midpoint->nearestNeighbour( targets[ i ], midpoint->bounds() ).maxDistanceSq(), best ) )
+      {
+        std::cerr << "Error - Sliding midpoint external tree found incorrect point for lookup " << i << std::endl;
+        break;
+      }
+    }
+
+    if ( midpoint->nearestNeighbour( spread[ 2 ], midpoint->bounds() ).maxDistanceSq() != 0.0f )
+    {
+      std::cerr << "Error - Sliding midpoint external tree lost the point on the midpoint" << std::endl;
+    }
+  }
+
+  midpoint.reset();
+
+  if ( access( ( treePath + ".nodes" ).c_str(), F_OK ) == 0 || access( ( treePath + ".spill0" ).c_str(), F_OK ) == 0 )
+  {
+    std::cerr << "Error - Sliding midpoint external build left temporary files behind" << std::endl;
+  }
+
+  unlink( treePath.c_str() );
+  unlink( path );
+}
+
+
+/*! \brief Checks a forest against brute force through a mix of inserts and removals
+ */
+void testForest( const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  kd::Forest< Point2, 2 > forest( treeFactory );
+  std::vector< Point2 > current;
+
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    forest.insert( points[ i ] );
+    current.push_back( points[ i ] );
+
+    // Remove one point in every three, so some levels get compacted
+    if ( i % 3 == 2 )
+    {
+      unsigned int index = lrand48() % current.size();
+
+      if ( ! forest.remove( current[ index ] ) )
+      {
+        std::cerr << "Error - Forest could not remove point " << index << std::endl;
+      }
+
+      current.erase( current.begin() + index );
+    }
+
+    if ( i % 100 == 99 )
+    {
+      std::vector< Point2 > batch( targets.begin() + i - 99, targets.begin() + i - 49 );
+      forest.insert( batch );
+      current.insert( current.end(), batch.begin(), batch.end() );
+    }
+  }
+
+  if ( forest.size() != current.size() )
+  {
+    std::cerr << "Error - Forest has " << forest.size() << " points, expected " << current.size() << std::endl;
+  }
+
+  Point2 missing( targets[ 0 ] );
+  missing[ 0 ] = 2.0;
+
+  if ( forest.remove( missing ) )
+  {
+    std::cerr << "Error - Forest removed a point it does not hold" << std::endl;
+  }
+
+  for ( unsigned int pass=0; pass<2; ++pass )
+  {
+    for ( unsigned int i=0; i<targets.size(); i+=10 )
+    {
+      const Point2& target = targets[ i ];
+
+      std::vector< float > distances;
+      unsigned int inRadius = 0;
+      unsigned int inBox = 0;
+
+      for ( unsigned int j=0; j<current.size(); ++j )
+      {
+        float distSq = measurer.distanceSq< Point2, 2 >( current[ j ], target );
+        distances.push_back( distSq );
+
+        if ( distSq < 0.01f )
+          ++inRadius;
+
+        if ( fabs( current[ j ][ 0 ] - target[ 0 ] ) <= 0.1f && fabs( current[ j ][ 1 ] - target[ 1 ] ) <= 0.1f )
+          ++inBox;
+      }
+
+      std::sort( distances.begin(), distances.end() );
+
+      kd::MultiNeighbourData< Point2 > neighbours = forest.nearestNeighbours( 5, target );
+
+      for ( unsigned int j=0; j<5; ++j )
+      {
+        if ( ! sameDistance( neighbours.points()[ j ].distSq, distances[ j ] ) )
+        {
+          std::cerr << "Error - Forest found incorrect point set for lookup " << i << std::endl;
+          break;
+        }
+      }
+
+      if ( ! sameDistance( forest.nearestNeighbour( target ).maxDistanceSq(), distances[ 0 ] ) )
+      {
+        std::cerr << "Error - Forest found incorrect point for lookup " << i << std::endl;
+      }
+
+      if ( forest.countWithinRadius( target, 0.1f ) != inRadius )
+      {
+        std::cerr << "Error - Forest found incorrect radius count for lookup " << i << std::endl;
+      }
+
+      Point2 min( target );
+      Point2 max( target );
+      min[ 0 ] -= 0.1f; min[ 1 ] -= 0.1f;
+      max[ 0 ] += 0.1f; max[ 1 ] += 0.1f;
+
+      kd::CountVisitor< Point2 > visitor( ~0u );
+      forest.withinBox( kd::Bounds< Point2, 2 >( min, max ), visitor );
+
+      if ( visitor.count() != inBox )
+      {
+        std::cerr << "Error - Forest found incorrect box count for lookup " << i << std::endl;
+      }
+    }
+
+    // The same answers must come back once everything is in one tree
+    forest.compact();
+
+    if ( forest.trees() != 1 || forest.size() != current.size() )
+    {
+      std::cerr << "Error - Forest did not compact into one tree" << std::endl;
+    }
+  }
+}
+
+
+/*! \brief Checks approximate searches stay within their error bound and report their work
+ */
+void testApproximateSearch( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  const unsigned int num = 5;
+  const double epsilon = 0.5;
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > exact = tree.nearestNeighbours( num, targets[ i ], tree.bounds() );
+
+    kd::SearchStats exactStats;
+    kd::MultiNeighbourData< Point2 > same = tree.nearestNeighbours( num, targets[ i ], tree.bounds(), kd::SearchOptions(), &exactStats );
+
+    kd::SearchStats approximateStats;
+    kd::MultiNeighbourData< Point2 > approximate = tree.nearestNeighbours(
+        num, targets[ i ], tree.bounds(), kd::SearchOptions( epsilon ), &approximateStats );
+
+    for ( unsigned int j=0; j<num; ++j )
+    {
+      if ( same.points()[ j ].distSq != exact.points()[ j ].distSq )
+      {
+        std::cerr << "Error - Search with default options is not exact for lookup " << i << std::endl;
+      }
+
+      if ( approximate.points()[ j ].distSq > exact.points()[ j ].distSq * ( 1 + epsilon ) * ( 1 + epsilon ) * ( 1 + 1e-5 ) )
+      {
+        std::cerr << "Error - Approximate search outside error bound for lookup " << i << std::endl;
+      }
+    }
+
+    if ( exactStats.leaves == 0 || exactStats.nodes <= exactStats.leaves
+        || approximateStats.leaves > exactStats.leaves || approximateStats.nodes > exactStats.nodes )
+    {
+      std::cerr << "Error - Incorrect search statistics for lookup " << i << std::endl;
+    }
+
+    kd::SearchStats cappedStats;
+    tree.nearestNeighbours( num, targets[ i ], tree.bounds(), kd::SearchOptions( 0.0, 1 ), &cappedStats );
+
+    if ( cappedStats.leaves != 1 )
+    {
+      std::cerr << "Error - Leaf limit not kept to for lookup " << i << std::endl;
+    }
+  }
+}
+
+
+/*! \brief Checks best-first searches find the same neighbours as depth-first ones in fewer leaves
+ */
+void testBestFirstSearch( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  const unsigned int num = 5;
+  const double epsilon = 0.5;
+
+  kd::SearchStats depthFirstStats;
+  kd::SearchStats bestFirstStats;
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > depthFirst = tree.nearestNeighbours(
+        num, targets[ i ], tree.bounds(), kd::SearchOptions(), &depthFirstStats );
+
+    kd::MultiNeighbourData< Point2 > bestFirst = tree.nearestNeighbours(
+        num, targets[ i ], tree.bounds(), kd::SearchOptions( 0.0, ~0u, kd::TRAVERSAL_BEST_FIRST ), &bestFirstStats );
+
+    kd::MultiNeighbourData< Point2 > approximate = tree.nearestNeighbours(
+        num, targets[ i ], tree.bounds(), kd::SearchOptions( epsilon, ~0u, kd::TRAVERSAL_BEST_FIRST ) );
+
+    for ( unsigned int j=0; j<num; ++j )
+    {
+      if ( bestFirst.points()[ j ].distSq != depthFirst.points()[ j ].distSq )
+      {
+        std::cerr << "Error - Best-first search found incorrect point set for lookup " << i << std::endl;
+      }
+
+      if ( approximate.points()[ j ].distSq > depthFirst.points()[ j ].distSq * ( 1 + epsilon ) * ( 1 + epsilon ) * ( 1 + 1e-5 ) )
+      {
+        std::cerr << "Error - Approximate best-first search outside error bound for lookup " << i << std::endl;
+      }
+    }
+
+    kd::NeighbourData< Point2 > nearest = tree.nearestNeighbour(
+        targets[ i ], tree.bounds(), kd::SearchOptions( 0.0, ~0u, kd::TRAVERSAL_BEST_FIRST ) );
+
+    if ( nearest.maxDistanceSq() != depthFirst.points()[ 0 ].distSq )
+    {
+      std::cerr << "Error - Best-first search found incorrect point for lookup " << i << std::endl;
+    }
+
+    kd::SearchStats cappedStats;
+    tree.nearestNeighbours( num, targets[ i ], tree.bounds(), kd::SearchOptions( 0.0, 2, kd::TRAVERSAL_BEST_FIRST ), &cappedStats );
+
+    if ( cappedStats.leaves > 2 )
+    {
+      std::cerr << "Error - Best-first leaf limit not kept to for lookup " << i << std::endl;
+    }
+  }
+
+  if ( bestFirstStats.leaves > depthFirstStats.leaves )
+  {
+    std::cerr << "Error - Best-first search checked more leaves than depth-first" << std::endl;
+  }
+}
+
+
+/*! \brief Checks a tree searched with a metric against brute force with the same metric
+ */
+template< typename M >
+void testMetric( const M& metric, const char* name, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  std::unique_ptr< kd::Tree< Point2, 2, M > > tree( treeFactory.create< Point2, 2 >( points, metric ) );
+
+  const unsigned int num = 5;
+  const float radius = 0.1f;
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    std::vector< float > distances;
+    for ( unsigned int j=0; j<points.size(); ++j )
+    {
+      distances.push_back( kd::pointDistance( metric, points[ j ], targets[ i ], 2 ) );
+    }
+
+    std::sort( distances.begin(), distances.end() );
+
+    const float radiusDistance = metric.fromLength( radius );
+    const unsigned int inRadius = std::lower_bound( distances.begin(), distances.end(), radiusDistance ) - distances.begin();
+
+    for ( unsigned int t=0; t<2; ++t )
+    {
+      const kd::SearchOptions options( 0.0, ~0u, t ? kd::TRAVERSAL_BEST_FIRST : kd::TRAVERSAL_DEPTH_FIRST );
+
+      kd::MultiNeighbourData< Point2 > neighbours = tree->nearestNeighbours( num, targets[ i ], tree->bounds(), options );
+
+      for ( unsigned int j=0; j<num; ++j )
+      {
+        if ( ! sameDistance( neighbours.points()[ j ].distSq, distances[ j ] ) )
+        {
+          std::cerr << "Error - " << name << " metric found incorrect point set for lookup " << i << std::endl;
+          break;
+        }
+      }
+    }
+
+    // Points right on the radius may fall either side with rounding
+    const unsigned int found = tree->countWithinRadius( targets[ i ], radius );
+    const unsigned int onRadius = std::upper_bound( distances.begin(), distances.end(), radiusDistance * 1.00001f ) - distances.begin()
+      - ( std::lower_bound( distances.begin(), distances.end(), radiusDistance * 0.99999f ) - distances.begin() );
+
+    if ( found + onRadius < inRadius || found > inRadius + onRadius )
+    {
+      std::cerr << "Error - " << name << " metric found incorrect radius count for lookup " << i << std::endl;
+    }
+  }
+}
+
+
+//! Runs testMetric for each of the metrics
+void testMetrics( const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  testMetric( kd::EuclideanMetric< float >(), "Euclidean", points, targets );
+  testMetric( kd::ManhattanMetric< float >(), "Manhattan", points, targets );
+  testMetric( kd::ChebyshevMetric< float >(), "Chebyshev", points, targets );
+
+  const float weights[ 2 ] = { 0.25f, 4.0f };
+  testMetric( kd::WeightedEuclideanMetric< float, 2 >( weights ), "Weighted Euclidean", points, targets );
+
+  // Points and targets both lie in [ 0, 1 )
+  testMetric( kd::PeriodicMetric< float, 2 >(), "Periodic", points, targets );
+
+  // Every kernel must give the same distances as the scalar one
+  std::vector< float > block( 2 * 37 );
+  for ( unsigned int j=0; j<block.size(); ++j )
+    block[ j ] = drand48();
+
+  const float target[ 2 ] = { 0.3f, 0.8f };
+
+  for ( int level=kd::SIMD_SCALAR; level<=kd::detectSimdLevel(); ++level )
+  {
+    kd::ChebyshevMetric< float > chebyshev;
+    kd::PeriodicMetric< float, 2 > periodic;
+    chebyshev.setSimdLevel( kd::SimdLevel( level ) );
+    periodic.setSimdLevel( kd::SimdLevel( level ) );
+
+    float distances[ 37 ];
+    float expected[ 37 ];
+
+    chebyshev.distances( &block[ 0 ], 37, target, 2, distances );
+    kd::MetricKernel< kd::ChebyshevMetric< float >, float >::scalar( chebyshev, &block[ 0 ], 37, target, 2, expected );
+
+    for ( unsigned int j=0; j<37; ++j )
+    {
+      if ( distances[ j ] != expected[ j ] )
+        std::cerr << "Error - Chebyshev " << kd::simdLevelName( kd::SimdLevel( level ) ) << " kernel incorrect for point " << j << std::endl;
+    }
+
+    periodic.distances( &block[ 0 ], 37, target, 2, distances );
+    kd::MetricKernel< kd::PeriodicMetric< float, 2 >, float >::scalar( periodic, &block[ 0 ], 37, target, 2, expected );
+
+    for ( unsigned int j=0; j<37; ++j )
+    {
+      if ( ! sameDistance( distances[ j ], expected[ j ] ) )
+        std::cerr << "Error - Periodic " << kd::simdLevelName( kd::SimdLevel( level ) ) << " kernel incorrect for point " << j << std::endl;
+    }
+  }
+}
+
+
+/*! \brief Checks trees with quantized leaves find exactly what trees with exact ones do
+ */
+template< typename M >
+void testQuantizedLeaves( const M& metric, const char* name, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 8 );
+
+  // Every point twice, so some leaves cover no range at all along an axis
+  std::vector< Point2 > doubled( points );
+  doubled.insert( doubled.end(), points.begin(), points.end() );
+
+  std::unique_ptr< kd::Tree< Point2, 2, M > > exact( treeFactory.create< Point2, 2 >( doubled, metric ) );
+
+  const kd::LeafPrecision precisions[] = { kd::LEAF_QUANTIZED_16, kd::LEAF_QUANTIZED_8 };
+  const float radius = 0.05f;
+  float min[ 2 ] = { 0.2f, 0.4f };
+  float max[ 2 ] = { 0.3f, 0.45f };
+  const kd::Bounds< Point2, 2 > box( min, max );
+
+  for ( unsigned int p=0; p<2; ++p )
+  {
+    treeFactory.setLeafPrecision( precisions[ p ] );
+    std::unique_ptr< kd::Tree< Point2, 2, M > > tree( treeFactory.create< Point2, 2 >( doubled, metric ) );
+
+    if ( tree->leafPrecision() != precisions[ p ] || tree->coordinates() )
+    {
+      std::cerr << "Error - " << name << " tree not quantized" << std::endl;
+      continue;
+    }
+
+    // Each instruction set has its own lower bound kernel
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      tree->setSimdLevel( kd::SimdLevel( i % ( kd::detectSimdLevel() + 1 ) ) );
+
+      for ( unsigned int t=0; t<2; ++t )
+      {
+        const kd::SearchOptions options( 0.0, ~0u, t ? kd::TRAVERSAL_BEST_FIRST : kd::TRAVERSAL_DEPTH_FIRST );
+
+        kd::MultiNeighbourData< Point2 > expected = exact->nearestNeighbours( 5, targets[ i ], exact->bounds(), options );
+        kd::MultiNeighbourData< Point2 > found = tree->nearestNeighbours( 5, targets[ i ], tree->bounds(), options );
+
+        // Re-ranking measures with the scalar kernel, so may round differently
+        for ( unsigned int j=0; j<5; ++j )
+        {
+          if ( ! sameDistance( found.points()[ j ].distSq, expected.points()[ j ].distSq ) )
+          {
+            std::cerr << "Error - " << name << " quantized tree found incorrect point set for lookup " << i << std::endl;
+            break;
+          }
+        }
+      }
+
+      if ( tree->countWithinRadius( targets[ i ], radius ) != exact->countWithinRadius( targets[ i ], radius ) )
+      {
+        std::cerr << "Error - " << name << " quantized tree found incorrect radius count for lookup " << i << std::endl;
+      }
+    }
+
+    if ( tree->countWithinBox( box ) != exact->countWithinBox( box ) )
+    {
+      std::cerr << "Error - " << name << " quantized tree found incorrect box count" << std::endl;
+    }
+  }
+}
+
+
+/*! \brief Checks periodic quantized trees against brute force with the points packed about the wrap
+ *
+ *  The points are just either side of the wrap along x, in groups spread
+ *  over a far longer period along y, so leaves split along y hold points
+ *  from both ends of x and their quantized ranges reach round. Targets are
+ *  on a group, so their nearest points differ along x alone.
+ */
+void testQuantizedWrap( const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 8 );
+
+  const float origin[ 2 ] = { 0.0f, 0.0f };
+  const float period[ 2 ] = { 1.0f, 1000.0f };
+  const kd::PeriodicMetric< float, 2 > metric( origin, period );
+
+  std::vector< Point2 > points( 4000 );
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    const float offset = float( drand48() ) * 1e-5f;
+
+    points[ i ][ 0 ] = i % 2 ? 1.0f - offset : offset;
+    points[ i ][ 1 ] = float( i / 10 );
+  }
+
+  points[ 0 ][ 0 ] = 0.0f;
+  points[ 1 ][ 0 ] = std::nextafter( 1.0f, 0.0f );
+
+  const kd::LeafPrecision precisions[] = { kd::LEAF_QUANTIZED_16, kd::LEAF_QUANTIZED_8 };
+
+  for ( unsigned int p=0; p<2; ++p )
+  {
+    treeFactory.setLeafPrecision( precisions[ p ] );
+    std::unique_ptr< kd::Tree< Point2, 2, kd::PeriodicMetric< float, 2 > > > tree( treeFactory.create< Point2, 2 >( points, metric ) );
+
+    unsigned int wrong = 0;
+
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      tree->setSimdLevel( kd::SimdLevel( i % ( kd::detectSimdLevel() + 1 ) ) );
+
+      Point2 target = targets[ i ];
+      target[ 0 ] = i % 2 ? target[ 0 ] * 1e-5f : 1.0f - target[ 0 ] * 1e-5f;
+      target[ 1 ] = float( int( target[ 1 ] * 400.0f ) );
+
+      std::vector< float > distances( points.size() );
+      for ( unsigned int j=0; j<points.size(); ++j )
+        distances[ j ] = kd::pointDistance( metric, points[ j ], target, 2 );
+
+      std::partial_sort( distances.begin(), distances.begin() + 5, distances.end() );
+
+      kd::MultiNeighbourData< Point2 > found = tree->nearestNeighbours( 5, target, tree->bounds() );
+
+      for ( unsigned int j=0; j<5; ++j )
+      {
+        if ( ! sameDistance( found.points()[ j ].distSq, distances[ j ] ) )
+        {
+          ++wrong;
+          break;
+        }
+      }
+    }
+
+    if ( wrong )
+    {
+      std::cerr << "Error - Periodic quantized tree found incorrect point sets for " << wrong << " of " << targets.size() << " lookups about the wrap" << std::endl;
+    }
+  }
+}
+
+
+/*! \brief A point which counts its destruction, so can not be kept in an arena
+ */
+struct DestructedPoint : public Point2
+{
+  DestructedPoint() {}
+  DestructedPoint( const Point2& point ) : Point2( point ) {}
+  ~DestructedPoint() { ++destructed; }
+
+  static unsigned int destructed;
+};
+
+unsigned int DestructedPoint::destructed = 0;
+
+
+/*! \brief Checks trees kept in an arena answer the same as ones kept in vectors
+ */
+void testArenaAllocation( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  const kd::TreeAllocation allocations[] = { kd::ALLOCATE_ARENA, kd::ALLOCATE_HUGE_PAGES };
+
+  for ( unsigned int a=0; a<2; ++a )
+  {
+    treeFactory.setAllocation( allocations[ a ] );
+    std::unique_ptr< kd::Tree< Point2, 2 > > arenaTree( treeFactory.create< Point2, 2 >( points ) );
+
+    if ( arenaTree->size() != tree.size() || arenaTree->nodeCount() != tree.nodeCount() )
+    {
+      std::cerr << "Error - Arena tree has a different shape" << std::endl;
+      continue;
+    }
+
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( 5, targets[ i ], tree.bounds() );
+      kd::MultiNeighbourData< Point2 > found = arenaTree->nearestNeighbours( 5, targets[ i ], arenaTree->bounds() );
+
+      for ( unsigned int j=0; j<5; ++j )
+      {
+        if ( found.points()[ j ].distSq != expected.points()[ j ].distSq )
+          std::cerr << "Error - Arena tree found incorrect point set for lookup " << i << std::endl;
+      }
+    }
+  }
+
+  // Allocations are aligned and stop at the end of the arena
+  kd::ArenaStorage arena( 1000 );
+  char* first = arena.allocate< char >( 10 );
+  double* second = arena.allocate< double >( 100 );
+
+  if ( ! first || ! second || ( reinterpret_cast< size_t >( second ) % kd::ArenaStorage::ALIGNMENT ) != 0
+      || second != reinterpret_cast< double* >( first + kd::ArenaStorage::ALIGNMENT ) )
+  {
+    std::cerr << "Error - Arena allocations incorrectly placed" << std::endl;
+  }
+
+  if ( arena.allocate< double >( 100 ) != 0 )
+  {
+    std::cerr << "Error - Arena allocated beyond its capacity" << std::endl;
+  }
+
+  // Points which need destructing are kept in vectors, and destructed with the tree
+  std::vector< DestructedPoint > destructed( points.begin(), points.end() );
+
+  treeFactory.setAllocation( kd::ALLOCATE_ARENA );
+  kd::Tree< DestructedPoint, 2 >* destructedTree = treeFactory.create< DestructedPoint, 2 >( destructed );
+
+  const unsigned int before = DestructedPoint::destructed;
+  delete destructedTree;
+
+  if ( DestructedPoint::destructed - before < destructed.size() )
+  {
+    std::cerr << "Error - Points of an arena tree were not destructed" << std::endl;
+  }
+}
+
+
+/*! \brief A point with data stored alongside it, for index trees over strided views
+ */
+struct Record
+{
+  Point2 point;
+  unsigned int id;
+  char payload[ 52 ];
+};
+
+
+/*! \brief Checks points ordered along curves, and index trees over points stored in that order
+ */
+void testCurveOrder( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  // Points at the centres of a 16 by 16 grid of the cells of the top four
+  // bits of each coordinate, along the Hilbert curve each is next to the last
+  const float side = float( ( 1 << 21 ) - 1 );
+  float low[ 2 ] = { 0.0f, 0.0f };
+  float high[ 2 ] = { side, side };
+  const kd::Bounds< Point2, 2 > bounds( ( Point2( low ) ), Point2( high ) );
+
+  std::vector< Point2 > grid;
+  for ( unsigned int x=0; x<16; ++x )
+  {
+    for ( unsigned int y=0; y<16; ++y )
+    {
+      float p[ 2 ] = { float( ( x << 17 ) + ( 1 << 16 ) ), float( ( y << 17 ) + ( 1 << 16 ) ) };
+      grid.push_back( Point2( p ) );
+    }
+  }
+
+  const kd::Curve curves[] = { kd::CURVE_HILBERT, kd::CURVE_MORTON };
+
+  for ( unsigned int c=0; c<2; ++c )
+  {
+    std::vector< unsigned int > order;
+    kd::curveOrder( kd::PointView< Point2 >( &grid[ 0 ], grid.size() ), bounds, curves[ c ], order );
+
+    unsigned int jumps = 0;
+    std::vector< bool > seen( grid.size(), false );
+
+    for ( unsigned int i=0; i<order.size(); ++i )
+    {
+      seen[ order[ i ] ] = true;
+
+      if ( i && fabs( grid[ order[ i ] ][ 0 ] - grid[ order[ i - 1 ] ][ 0 ] ) + fabs( grid[ order[ i ] ][ 1 ] - grid[ order[ i - 1 ] ][ 1 ] ) != float( 1 << 17 ) )
+        ++jumps;
+    }
+
+    if ( std::count( seen.begin(), seen.end(), true ) != int( grid.size() ) || ( jumps == 0 ) != ( curves[ c ] == kd::CURVE_HILBERT ) )
+    {
+      std::cerr << "Error - Curve " << c << " ordered the grid with " << jumps << " jumps" << std::endl;
+    }
+  }
+
+  // An index tree over the points stored along the curve, mapped back through the order, finds the same
+  const kd::Tree< Point2, 2 >::PointList points( tree.points(), tree.points() + tree.size() );
+
+  std::vector< unsigned int > order;
+  kd::curveOrder( kd::PointView< Point2 >( &points[ 0 ], points.size() ), tree.bounds(), kd::CURVE_HILBERT, order );
+
+  std::vector< Point2 > ordered( points.size() );
+  for ( unsigned int i=0; i<order.size(); ++i )
+    ordered[ i ] = points[ order[ i ] ];
+
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::IndexTree< Point2, 2 > > indexTree( treeFactory.createIndexed< Point2, 2 >( kd::PointView< Point2 >( &ordered[ 0 ], ordered.size() ) ) );
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( 5, targets[ i ], tree.bounds() );
+    kd::MultiNeighbourData< kd::PointIndex< unsigned int, float > > found = indexTree->nearestNeighbours( 5, targets[ i ], indexTree->bounds() );
+
+    for ( unsigned int j=0; j<5; ++j )
+    {
+      const Point2& original = points[ order[ found.points()[ j ].point.index ] ];
+
+      if ( found.points()[ j ].distSq != expected.points()[ j ].distSq
+          || ! sameDistance( measurer.distanceSq< Point2, 2 >( targets[ i ], original ), found.points()[ j ].distSq ) )
+      {
+        std::cerr << "Error - Curve ordered index tree found incorrect point set for lookup " << i << std::endl;
+        break;
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks index trees find the same neighbours as the tree holding copies of the points
+ */
+void testIndexTree( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  std::unique_ptr< kd::IndexTree< Point2, 2 > > indexTree(
+      treeFactory.createIndexed< Point2, 2 >( kd::PointView< Point2 >( points.data(), points.size() ) ) );
+
+  std::vector< Record > records( points.size() );
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    records[ i ].point = points[ i ];
+    records[ i ].id = i;
+  }
+
+  treeFactory.setAllocation( kd::ALLOCATE_ARENA );
+
+  std::unique_ptr< kd::IndexTree< Point2, 2, unsigned short > > stridedTree(
+      treeFactory.createIndexed< Point2, 2, unsigned short >(
+        kd::PointView< Point2 >( &records[ 0 ].point, records.size(), sizeof( Record ) ) ) );
+
+  typedef kd::PointIndex< unsigned int, float > Index;
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( 5, targets[ i ], tree.bounds() );
+    kd::MultiNeighbourData< Index > found = indexTree->nearestNeighbours( 5, targets[ i ], indexTree->bounds() );
+
+    for ( unsigned int j=0; j<5; ++j )
+    {
+      const unsigned int index = found.points()[ j ].point.index;
+
+      if ( found.points()[ j ].distSq != expected.points()[ j ].distSq
+          || ! sameDistance( measurer.distanceSq< Point2, 2 >( targets[ i ], points[ index ] ), found.points()[ j ].distSq ) )
+      {
+        std::cerr << "Error - Index tree found incorrect point set for lookup " << i << std::endl;
+      }
+    }
+
+    const unsigned short nearest = stridedTree->nearestNeighbour( targets[ i ], stridedTree->bounds() ).point().index;
+
+    if ( records[ nearest ].id != nearest
+        || ! sameDistance( measurer.distanceSq< Point2, 2 >( targets[ i ], records[ nearest ].point ), expected.points()[ 0 ].distSq ) )
+    {
+      std::cerr << "Error - Strided index tree found incorrect point for lookup " << i << std::endl;
+    }
+
+    if ( indexTree->countWithinRadius( targets[ i ], 0.1f ) != tree.countWithinRadius( targets[ i ], 0.1f ) )
+    {
+      std::cerr << "Error - Index tree found incorrect radius count for lookup " << i << std::endl;
+    }
+  }
+
+  for ( unsigned int i=0; i + 1<targets.size(); i+=2 )
+  {
+    float min[ 2 ] = { std::min( targets[ i ][ 0 ], targets[ i + 1 ][ 0 ] ), std::min( targets[ i ][ 1 ], targets[ i + 1 ][ 1 ] ) };
+    float max[ 2 ] = { std::max( targets[ i ][ 0 ], targets[ i + 1 ][ 0 ] ), std::max( targets[ i ][ 1 ], targets[ i + 1 ][ 1 ] ) };
+    kd::Bounds< Point2, 2 > box( min, max );
+
+    if ( indexTree->countWithinBox( box ) != tree.countWithinBox( box ) )
+    {
+      std::cerr << "Error - Index tree found incorrect box count for box " << i << std::endl;
+    }
+  }
+
+  // More points than the index or the node counts can hold are refused before any are read
+  if ( treeFactory.createIndexed< Point2, 2, unsigned char >( kd::PointView< Point2 >( points.data(), points.size() ) ) )
+  {
+    std::cerr << "Error - Index tree built with too narrow an index" << std::endl;
+  }
+
+  if ( treeFactory.createIndexed< Point2, 2, unsigned long long >( kd::PointView< Point2 >( points.data(), 1ull << 32, 0 ) ) )
+  {
+    std::cerr << "Error - Index tree built over more points than nodes can count" << std::endl;
+  }
+}
+
+
+/*! \brief Checks every split rule builds trees giving the same answers, even for clustered and repeated points
+ */
+void testSplitRules( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+
+  // Tight clusters, a line and repeated points all give splits something to get wrong
+  std::vector< Point2 > clustered( points );
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    float coords[ 2 ] = { 0.5f + 0.001f * points[ i ][ 0 ], 0.25f + 0.001f * points[ i ][ 1 ] };
+    clustered.push_back( Point2( coords ) );
+
+    float line[ 2 ] = { points[ i ][ 0 ], 0.75f };
+    clustered.push_back( Point2( line ) );
+
+    float repeated[ 2 ] = { 0.1f, 0.9f };
+    clustered.push_back( Point2( repeated ) );
+  }
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > clusteredTree( treeFactory.create< Point2, 2 >( clustered ) );
+
+  const kd::SplitRule rules[] = { kd::SPLIT_MAX_SPREAD, kd::SPLIT_MAX_VARIANCE, kd::SPLIT_SLIDING_MIDPOINT, kd::SPLIT_SAMPLED_COST };
+  const char* names[] = { "max spread", "max variance", "sliding midpoint", "sampled cost" };
+
+  for ( unsigned int r=0; r<4; ++r )
+  {
+    treeFactory.setSplitRule( rules[ r ] );
+
+    std::unique_ptr< kd::Tree< Point2, 2 > > uniform( treeFactory.create< Point2, 2 >( points ) );
+    std::unique_ptr< kd::Tree< Point2, 2 > > split( treeFactory.create< Point2, 2 >( clustered ) );
+
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( 5, targets[ i ], tree.bounds() );
+      kd::MultiNeighbourData< Point2 > found = uniform->nearestNeighbours( 5, targets[ i ], uniform->bounds() );
+
+      kd::MultiNeighbourData< Point2 > clusteredExpected = clusteredTree->nearestNeighbours( 5, targets[ i ], clusteredTree->bounds() );
+      kd::MultiNeighbourData< Point2 > clusteredFound = split->nearestNeighbours( 5, targets[ i ], split->bounds() );
+
+      for ( unsigned int j=0; j<5; ++j )
+      {
+        if ( found.points()[ j ].distSq != expected.points()[ j ].distSq
+            || clusteredFound.points()[ j ].distSq != clusteredExpected.points()[ j ].distSq )
+        {
+          std::cerr << "Error - Tree split by " << names[ r ] << " found incorrect point set for lookup " << i << std::endl;
+        }
+      }
+
+      if ( split->countWithinRadius( targets[ i ], 0.05f ) != clusteredTree->countWithinRadius( targets[ i ], 0.05f ) )
+      {
+        std::cerr << "Error - Tree split by " << names[ r ] << " found incorrect radius count for lookup " << i << std::endl;
+      }
+    }
+  }
+
+  // Each longer side must replace the longest found so far
+  float min[ 3 ] = { 0.0f, 0.0f, 0.0f };
+  float max[ 3 ] = { 1.0f, 3.0f, 2.0f };
+  kd::Bounds< Point3, 3 > bounds( min, max );
+
+  if ( bounds.longestDimension() != 1 )
+  {
+    std::cerr << "Error - Longest dimension incorrect" << std::endl;
+  }
+}
+
+
+/*! \brief Nearest neighbour data which does not derive from kd::Data
+ *
+ *  Searches are compiled for the type they are handed, so anything with the
+ *  same members can be searched with.
+ */
+class PlainNeighbourData
+{
+public:
+
+  PlainNeighbourData() : m_distanceSq( std::numeric_limits< float >::max() ), m_found( false ) {}
+
+  void updateBulk( const Point2* points, const float* distancesSq, unsigned int count )
+  {
+    for ( unsigned int i=0; i<count; ++i )
+    {
+      if ( distancesSq[ i ] < m_distanceSq )
+      {
+        m_point = points[ i ];
+        m_distanceSq = distancesSq[ i ];
+        m_found = true;
+      }
+    }
+  }
+
+  bool incomplete() const { return ! m_found; }
+
+  float maxDistanceSq() const { return m_distanceSq; }
+
+private:
+
+  Point2 m_point;
+  float m_distanceSq;
+  bool m_found;
+};
+
+
+/*! \brief Checks searches through a warmed up QueryContext allocate nothing and find the same points
+ */
+void testQueryContext( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  const unsigned int sizes[] = { 1, 5, 16 };
+
+  kd::Tree< Point2, 2 >::Context context;
+
+  for ( unsigned int t=0; t<2; ++t )
+  {
+    const kd::SearchOptions options( 0.0, ~0u, t ? kd::TRAVERSAL_BEST_FIRST : kd::TRAVERSAL_DEPTH_FIRST );
+
+    // The first pass grows the context to fit, the second must reuse it
+    for ( unsigned int pass=0; pass<2; ++pass )
+    {
+      const unsigned long long allocations = allocationCount;
+
+      // Searching for the expected points allocates, so is left out
+      unsigned long long checking = 0;
+
+      for ( unsigned int s=0; s<sizeof( sizes ) / sizeof( sizes[ 0 ] ); ++s )
+      {
+        for ( unsigned int i=0; i<targets.size(); ++i )
+        {
+          kd::NeighbourData< Point2 > nearest = tree.nearestNeighbour( targets[ i ], context, options );
+          kd::MultiNeighbourData< Point2 >::PointDistanceList found = tree.nearestNeighbours( sizes[ s ], targets[ i ], context, options );
+
+          if ( ! pass )
+            continue;
+
+          const unsigned long long before = allocationCount;
+          kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( sizes[ s ], targets[ i ], tree.bounds() );
+
+          if ( found.size() != sizes[ s ] || nearest.maxDistanceSq() != expected.points()[ 0 ].distSq )
+          {
+            std::cerr << "Error - Context found incorrect point for lookup " << i << std::endl;
+          }
+
+          for ( unsigned int j=0; j<found.size(); ++j )
+          {
+            if ( found[ j ].distSq != expected.points()[ j ].distSq )
+            {
+              std::cerr << "Error - Context found incorrect point set for lookup " << i << std::endl;
+              break;
+            }
+          }
+
+          checking += allocationCount - before;
+        }
+      }
+
+      if ( pass && allocationCount - allocations != checking )
+      {
+        std::cerr << "Error - Searches through a context made " << allocationCount - allocations - checking << " allocations" << std::endl;
+      }
+    }
+  }
+}
+
+
+/*! \brief The example in the documentation of QueryRecorder, kept as written there
+ */
+void recordedSearch(
+    const kd::Tree< Point2, 2 >* tree,
+    kd::QueryStatistics& statistics,
+    unsigned int num,
+    const Point2& target,
+    const kd::SearchOptions& options
+    )
+{
+  kd::QueryRecorder recorder( statistics );
+  tree->nearestNeighbours( num, target, tree->bounds(), options, recorder.stats() );
+}
+
+
+/*! \brief Checks the counters of searches and the totals and shape statistics gathered from them
+ */
+void testStatistics( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  const unsigned int num = 5;
+
+  kd::TreeShape shape = kd::treeShape( tree );
+
+  if ( shape.points != tree.size() || shape.nodes != tree.nodeCount() || shape.nodes != 2 * shape.leaves - 1 )
+  {
+    std::cerr << "Error - Tree shape has " << shape.leaves << " leaves for " << shape.nodes << " nodes" << std::endl;
+  }
+
+  if ( shape.minDepth > shape.meanDepth || shape.meanDepth > shape.maxDepth || shape.balance < 1.0
+      || shape.minOccupancy > shape.meanOccupancy || shape.meanOccupancy > shape.maxOccupancy )
+  {
+    std::cerr << "Error - Tree shape is inconsistent" << std::endl;
+  }
+
+  kd::QueryStatistics statistics;
+  kd::SearchStats expected;
+
+  for ( unsigned int t=0; t<2; ++t )
+  {
+    const kd::SearchOptions options( 0.0, ~0u, t ? kd::TRAVERSAL_BEST_FIRST : kd::TRAVERSAL_DEPTH_FIRST );
+
+    for ( unsigned int i=0; i<targets.size(); ++i )
+    {
+      kd::SearchStats stats;
+      kd::MultiNeighbourData< Point2 > found = tree.nearestNeighbours( num, targets[ i ], tree.bounds(), options, &stats );
+
+      if ( stats.leaves == 0 || stats.nodes < 2 * stats.leaves - 1 || stats.points < num
+          || stats.farCells >= stats.nodes || stats.refined != 0 )
+      {
+        std::cerr << "Error - Search counted " << stats.nodes << " nodes, " << stats.leaves << " leaves and "
+                  << stats.points << " points for lookup " << i << std::endl;
+      }
+
+      // Uncounted searches must find the same
+      kd::MultiNeighbourData< Point2 > uncounted = tree.nearestNeighbours( num, targets[ i ], tree.bounds(), options );
+
+      if ( uncounted.points().back().distSq != found.points().back().distSq )
+      {
+        std::cerr << "Error - Counted search found different points for lookup " << i << std::endl;
+      }
+
+      expected.nodes += stats.nodes;
+      expected.leaves += stats.leaves;
+      expected.points += stats.points;
+      expected.farCells += stats.farCells;
+
+      kd::QueryRecorder recorder( statistics );
+      tree.nearestNeighbours( num, targets[ i ], tree.bounds(), options, recorder.stats() );
+    }
+  }
+
+  // Recorded from several threads at once must add up all the same
+  std::vector< std::thread > threads;
+
+  for ( unsigned int t=0; t<4; ++t )
+  {
+    threads.push_back( std::thread( [ &tree, &targets, &statistics ]()
+    {
+      for ( unsigned int i=0; i<targets.size(); ++i )
+      {
+        kd::QueryRecorder recorder( statistics );
+        tree.nearestNeighbour( targets[ i ], tree.bounds(), kd::SearchOptions(), recorder.stats() );
+      }
+    } ) );
+  }
+
+  for ( unsigned int t=0; t<threads.size(); ++t )
+    threads[ t ].join();
+
+  kd::StatisticsSnapshot snapshot = statistics.snapshot();
+
+  const unsigned long long queries = 2 * targets.size() + 4 * targets.size();
+
+  if ( snapshot.queries != queries || snapshot.nodes < expected.nodes || snapshot.leaves < expected.leaves
+      || snapshot.points < expected.points || snapshot.farCells < expected.farCells )
+  {
+    std::cerr << "Error - Statistics recorded " << snapshot.queries << " queries, expected " << queries << std::endl;
+  }
+
+  unsigned long long histogram = 0;
+  for ( unsigned int b=0; b<kd::StatisticsSnapshot::LATENCY_BUCKETS; ++b )
+    histogram += snapshot.histogram[ b ];
+
+  if ( histogram != queries || snapshot.percentile( 0.5 ) > snapshot.percentile( 0.99 ) || snapshot.latency == 0 )
+  {
+    std::cerr << "Error - Statistics latency histogram is inconsistent" << std::endl;
+  }
+
+  if ( kd::QueryStatistics::bucket( 0 ) != 0 || kd::QueryStatistics::bucket( 1000 ) != 9 || kd::QueryStatistics::bucket( ~0ull ) != 31 )
+  {
+    std::cerr << "Error - Statistics put latencies in the wrong buckets" << std::endl;
+  }
+
+  statistics.reset();
+
+  if ( statistics.snapshot().queries != 0 )
+  {
+    std::cerr << "Error - Statistics were not reset" << std::endl;
+  }
+
+  recordedSearch( &tree, statistics, num, targets[ 0 ], kd::SearchOptions() );
+
+  if ( statistics.snapshot().queries != 1 || statistics.snapshot().nodes == 0 )
+  {
+    std::cerr << "Error - Documented QueryRecorder example did not record its search" << std::endl;
+  }
+}
+
+
+/*! \brief Points of one generation of a SharedTree, telling which by their count and first coordinate
+ */
+std::vector< Point2 > generationPoints( unsigned int generation )
+{
+  std::vector< Point2 > points( 100 + 7 * generation );
+
+  for ( unsigned int i=0; i<points.size(); ++i )
+  {
+    points[ i ][ 0 ] = generation + 0.5f * float( drand48() );
+    points[ i ][ 1 ] = float( drand48() );
+  }
+
+  return points;
+}
+
+
+/*! \brief Checks readers of a SharedTree racing the installs of new trees
+ *
+ *  Every reader checks that its snapshot is one whole generation, that the
+ *  generations it sees never go backwards and that a snapshot held keeps
+ *  the writer from deleting its tree.
+ */
+void testSharedTree( const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  const unsigned int generations = 60;
+
+  std::vector< std::vector< Point2 > > points;
+  for ( unsigned int g=0; g<generations; ++g )
+    points.push_back( generationPoints( g ) );
+
+  kd::SharedTree< Point2, 2 > shared( treeFactory.create< Point2, 2 >( points[ 0 ] ) );
+
+  std::atomic< bool > done( false );
+  std::atomic< unsigned int > errors( 0 );
+  std::atomic< unsigned long long > reads( 0 );
+
+  std::vector< std::thread > readers;
+
+  for ( unsigned int t=0; t<8; ++t )
+  {
+    readers.push_back( std::thread( [ &, t ]()
+    {
+      kd::Tree< Point2, 2 >::Context context;
+      unsigned int seen = 0;
+      unsigned long long count = 0;
+
+      for ( unsigned int i=t; ! done.load() || i < t + targets.size(); ++i, ++count )
+      {
+        kd::SharedTree< Point2, 2 >::Snapshot tree = shared.snapshot();
+
+        const unsigned int generation = ( tree->size() - 100 ) / 7;
+        Point2 target = targets[ i % targets.size() ];
+        target[ 0 ] += float( generation );
+
+        // Search twice with some other work between, in case the tree is freed under the reader
+        const float first = tree->nearestNeighbour( target, context ).maxDistanceSq();
+        const kd::NeighbourData< Point2 > found = tree->nearestNeighbour( target, context );
+
+        if ( tree->size() != 100 + 7 * generation || generation < seen || found.maxDistanceSq() != first
+            || floor( found.point()[ 0 ] ) != float( generation ) )
+        {
+          errors.fetch_add( 1 );
+        }
+
+        seen = generation;
+      }
+
+      reads.fetch_add( count );
+    } ) );
+  }
+
+  std::thread writer( [ & ]()
+  {
+    for ( unsigned int g=1; g<generations; ++g )
+      shared.install( treeFactory.create< Point2, 2 >( points[ g ] ) );
+  } );
+
+  writer.join();
+  done.store( true );
+
+  for ( unsigned int t=0; t<readers.size(); ++t )
+    readers[ t ].join();
+
+  if ( errors.load() != 0 )
+  {
+    std::cerr << "Error - SharedTree readers saw " << errors.load() << " inconsistent trees in " << reads.load() << " reads" << std::endl;
+  }
+
+  if ( shared.epoch() != generations - 1 || shared.snapshot()->size() != points.back().size() )
+  {
+    std::cerr << "Error - SharedTree did not end with the last tree installed" << std::endl;
+  }
+
+  // A snapshot held must keep the writer waiting, and searchable, until it is released
+  kd::SharedTree< Point2, 2 >::Snapshot held = shared.snapshot();
+  std::atomic< bool > installed( false );
+
+  std::thread waiting( [ & ]()
+  {
+    shared.install( treeFactory.create< Point2, 2 >( points[ 0 ] ) );
+    installed.store( true );
+  } );
+
+  while ( shared.snapshot()->size() != points[ 0 ].size() )
+    std::this_thread::yield();
+
+  usleep( 20000 );
+
+  if ( installed.load() || held->size() != points.back().size() || held->nearestNeighbour( points.back()[ 0 ], held->bounds() ).maxDistanceSq() != 0.0f )
+  {
+    std::cerr << "Error - SharedTree deleted a tree still held by a snapshot" << std::endl;
+  }
+
+  held.release();
+  waiting.join();
+
+  if ( ! installed.load() || held.get() != 0 )
+  {
+    std::cerr << "Error - SharedTree install did not finish once the snapshot was released" << std::endl;
+  }
+}
+
+
+/*! \brief Checks a dual-tree join against searching for each query on its own
+ */
+void testJoin( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > queries( treeFactory.create< Point2, 2 >( targets ) );
+
+  kd::ThreadPool pool( 4 );
+
+  const unsigned int num = 5;
+  std::vector< Point2 > neighbours( queries->size() * num );
+  std::vector< float > distancesSq( queries->size() * num );
+
+  kd::nearestNeighbourJoin( *queries, tree, num, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+
+  for ( unsigned int i=0; i<queries->size(); ++i )
+  {
+    const Point2& target = queries->points()[ i ];
+    kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( num, target, tree.bounds() );
+
+    for ( unsigned int j=0; j<num; ++j )
+    {
+      if ( ! sameDistance( distancesSq[ i * num + j ], expected.points()[ j ].distSq )
+          || ! sameDistance( measurer.distanceSq< Point2, 2 >( target, neighbours[ i * num + j ] ), distancesSq[ i * num + j ] ) )
+      {
+        std::cerr << "Error - Join found incorrect point set for query " << i << std::endl;
+        break;
+      }
+    }
+  }
+
+  // Trees with quantized leaves are joined over exact copies of their points, so find the same
+  treeFactory.setLeafPrecision( kd::LEAF_QUANTIZED_8 );
+  std::unique_ptr< kd::Tree< Point2, 2 > > quantizedQueries( treeFactory.create< Point2, 2 >( targets ) );
+  std::unique_ptr< kd::Tree< Point2, 2 > > quantizedReferences(
+      treeFactory.create< Point2, 2 >( std::vector< Point2 >( tree.points(), tree.points() + tree.size() ) ) );
+
+  std::vector< Point2 > quantizedNeighbours( queries->size() * num );
+  std::vector< float > quantizedDistancesSq( queries->size() * num, -1.0f );
+
+  kd::nearestNeighbourJoin( *quantizedQueries, *quantizedReferences, num, &quantizedNeighbours[ 0 ], &quantizedDistancesSq[ 0 ], pool );
+
+  for ( unsigned int i=0; i<quantizedQueries->size(); ++i )
+  {
+    const Point2& target = quantizedQueries->points()[ i ];
+    kd::MultiNeighbourData< Point2 > expected = tree.nearestNeighbours( num, target, tree.bounds() );
+
+    for ( unsigned int j=0; j<num; ++j )
+    {
+      if ( ! sameDistance( quantizedDistancesSq[ i * num + j ], expected.points()[ j ].distSq )
+          || ! sameDistance( measurer.distanceSq< Point2, 2 >( target, quantizedNeighbours[ i * num + j ] ), quantizedDistancesSq[ i * num + j ] ) )
+      {
+        std::cerr << "Error - Join of quantized trees found incorrect point set for query " << i << std::endl;
+        break;
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks joins split finely between tasks against brute force
+ *
+ *  The test trees are smaller than the default grain, which would join
+ *  each on a single task, so the grain is lowered to split them over many.
+ */
+void testParallelJoin( const std::vector< Point2 >& points, const std::vector< Point2 >& targets )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  std::unique_ptr< kd::Tree< Point2, 2 > > queries( treeFactory.create< Point2, 2 >( targets ) );
+  std::unique_ptr< kd::Tree< Point2, 2 > > references( treeFactory.create< Point2, 2 >( points ) );
+
+  kd::ThreadPool pool( 4 );
+
+  const unsigned int num = 4;
+
+  for ( unsigned int self=0; self<2; ++self )
+  {
+    const kd::Tree< Point2, 2 >& joined = self ? *references : *queries;
+
+    kd::NeighbourJoin< Point2, 2, kd::EuclideanMetric< float >, Point2, Point2 > join( joined, *references, self == 1 );
+    join.setGrain( 16 );
+
+    std::vector< Point2 > neighbours( joined.size() * num );
+    std::vector< float > distancesSq( joined.size() * num, -1.0f );
+
+    join.nearestNeighbours( num, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+
+    for ( unsigned int i=0; i<joined.size(); ++i )
+    {
+      const Point2& target = joined.points()[ i ];
+
+      std::vector< float > distances;
+      for ( unsigned int j=0; j<references->size(); ++j )
+      {
+        if ( ! self || j != i )
+          distances.push_back( measurer.distanceSq< Point2, 2 >( target, references->points()[ j ] ) );
+      }
+
+      std::partial_sort( distances.begin(), distances.begin() + num, distances.end() );
+
+      for ( unsigned int j=0; j<num; ++j )
+      {
+        if ( ! sameDistance( distancesSq[ i * num + j ], distances[ j ] )
+            || ! sameDistance( measurer.distanceSq< Point2, 2 >( target, neighbours[ i * num + j ] ), distances[ j ] ) )
+        {
+          std::cerr << "Error - " << ( self ? "Self" : "Cross" ) << " join split between tasks incorrect for query " << i << std::endl;
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks the all nearest neighbours of a tree against a brute force search
+ */
+template< typename M >
+void testAllNearestNeighbours( const M& metric, const char* name, const std::vector< Point2 >& points )
+{
+  kd::BoundsFactory boundsFactory;
+  kd::Measurer measurer;
+  kd::TreeFactory treeFactory( measurer, boundsFactory );
+  treeFactory.setBucketSize( 4 );
+
+  kd::ThreadPool pool( 3 );
+
+  // Quantized trees are joined over exact copies of their points
+  const kd::LeafPrecision precisions[] = { kd::LEAF_EXACT, kd::LEAF_QUANTIZED_8 };
+
+  for ( unsigned int p=0; p<2; ++p )
+  {
+    treeFactory.setLeafPrecision( precisions[ p ] );
+    std::unique_ptr< kd::Tree< Point2, 2, M > > tree( treeFactory.create< Point2, 2 >( points, metric ) );
+
+    const unsigned int num = 3;
+    std::vector< Point2 > neighbours( tree->size() * num );
+    std::vector< float > distancesSq( tree->size() * num, -1.0f );
+
+    kd::allNearestNeighbours( *tree, num, &neighbours[ 0 ], &distancesSq[ 0 ], pool );
+
+    for ( unsigned int i=0; i<tree->size(); ++i )
+    {
+      std::vector< float > distances;
+      for ( unsigned int j=0; j<tree->size(); ++j )
+      {
+        if ( j != i )
+          distances.push_back( kd::pointDistance( metric, tree->points()[ i ], tree->points()[ j ], 2 ) );
+      }
+
+      std::sort( distances.begin(), distances.end() );
+
+      for ( unsigned int j=0; j<num; ++j )
+      {
+        if ( ! sameDistance( distancesSq[ i * num + j ], distances[ j ] ) )
+        {
+          std::cerr << "Error - " << name << " all nearest neighbours incorrect for point " << i << " with precision " << p << std::endl;
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+/*! \brief Checks searches through the virtual Data interface match the inlined ones
+ */
+void testInlinedSearch( const kd::Tree< Point2, 2 >& tree, const std::vector< Point2 >& targets )
+{
+  const unsigned int num = 5;
+  const float unbounded = std::numeric_limits< float >::max();
+
+  for ( unsigned int i=0; i<targets.size(); ++i )
+  {
+    kd::MultiNeighbourData< Point2 > inlined( num, unbounded );
+    tree.search( targets[ i ], inlined, tree.bounds() );
+
+    kd::MultiNeighbourData< Point2 > virtualData( num, unbounded );
+    kd::Data< Point2 >& base = virtualData;
+    tree.search( targets[ i ], base, tree.bounds(), kd::SearchOptions( 0.0, ~0u, kd::TRAVERSAL_BEST_FIRST ) );
+
+    for ( unsigned int j=0; j<num; ++j )
+    {
+      if ( inlined.points()[ j ].distSq != virtualData.points()[ j ].distSq )
+      {
+        std::cerr << "Error - Virtual search found incorrect point set for lookup " << i << std::endl;
+      }
+    }
+
+    PlainNeighbourData plain;
+    tree.search( targets[ i ], plain, tree.bounds() );
+
+    if ( plain.maxDistanceSq() != inlined.points()[ 0 ].distSq )
+    {
+      std::cerr << "Error - Search with plain data found incorrect point for lookup " << i << std::endl;
+    }
+  }
+}
+
+
 int main( int argc, char** argv )
 {
   std::vector< Point2 > points;
@@ -143,6 +2271,45 @@ int main( int argc, char** argv )
     }
   }
 
+  std::vector< Point2 > targets;
+  for ( unsigned int i=0; i<POINT_COUNT; ++i )
+  {
+    float p[ 2 ] = { float( drand48() ), float( drand48() ) };
+    targets.push_back( Point2( p ) );
+  }
+
+  testDistanceKernels< float >();
+  testDistanceKernels< double >();
+  testBucketSizes( points, targets );
+  testNeighbourGroups( *tree, points, targets );
+  testRangeQueries( *tree, points, targets );
+  testParallelBuild( points );
+  testTaskGroup();
+  testBatchQueries( *tree, targets );
+  testTreeFile( *tree, targets );
+  testForest( points, targets );
+  testApproximateSearch( *tree, targets );
+  testBestFirstSearch( *tree, targets );
+  testMetrics( points, targets );
+  testInlinedSearch( *tree, targets );
+  testArenaAllocation( *tree, points, targets );
+  testIndexTree( *tree, points, targets );
+  testCurveOrder( *tree, targets );
+  testSplitRules( *tree, points, targets );
+  testJoin( *tree, targets );
+  testParallelJoin( points, targets );
+  testQueryContext( *tree, targets );
+  testStatistics( *tree, targets );
+  testSharedTree( targets );
+  testExternalBuilder( targets );
+  testQuantizedLeaves( kd::EuclideanMetric< float >(), "Euclidean", points, targets );
+  testQuantizedLeaves( kd::ChebyshevMetric< float >(), "Chebyshev", points, targets );
+  testQuantizedLeaves( kd::PeriodicMetric< float, 2 >(), "Periodic", points, targets );
+  testQuantizedWrap( targets );
+  testAllNearestNeighbours( kd::EuclideanMetric< float >(), "Euclidean", points );
+  testAllNearestNeighbours( kd::ChebyshevMetric< float >(), "Chebyshev", points );
+  testAllNearestNeighbours( kd::PeriodicMetric< float, 2 >(), "Periodic", points );
+
   std::cerr << "Completed Testing" << std::endl;
 
   return 0;